@@ -1,4 +1,5 @@
 #include "compositor.h"
+#include "executor.h"
 #include "transform-util.h"
 #include "frame.h"
 
@@ -10,6 +11,10 @@
 #include <drm_fourcc.h>
 #include <math.h>
 #include <string.h>
+#include <time.h>
+#include <inttypes.h>
+
+#define ROTATION_ROUNDS 20
 
 struct nvnc_frame* read_png_file(const char *filename);
 
@@ -80,10 +85,80 @@ static void on_done(struct nvnc_composite_fb* cfb,
 	nvnc_frame_write_sixel(cfb->fbs[0]);
 }
 
+static uint64_t gettime_us(clockid_t clock)
+{
+	struct timespec ts = { 0 };
+	clock_gettime(clock, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000ULL;
+}
+
+static const char* transform_name(enum nvnc_transform transform)
+{
+	switch (transform) {
+	case NVNC_TRANSFORM_NORMAL: return "normal";
+	case NVNC_TRANSFORM_90: return "90";
+	case NVNC_TRANSFORM_180: return "180";
+	case NVNC_TRANSFORM_270: return "270";
+	case NVNC_TRANSFORM_FLIPPED: return "flipped";
+	case NVNC_TRANSFORM_FLIPPED_90: return "flipped-90";
+	case NVNC_TRANSFORM_FLIPPED_180: return "flipped-180";
+	case NVNC_TRANSFORM_FLIPPED_270: return "flipped-270";
+	}
+	return "unknown";
+}
+
+// Composite the whole image with each transform and report the throughput
+static int run_rotation_bench(const char* file)
+{
+	struct nvnc_frame* src = read_png_file(file);
+	if (!src) {
+		printf("Failed to read png file: %s\n", file);
+		return 1;
+	}
+
+	printf("%s (%dx%d):\n", file, src->width, src->height);
+
+	for (int t = NVNC_TRANSFORM_NORMAL; t <= NVNC_TRANSFORM_FLIPPED_270;
+			++t) {
+		src->transform = t;
+
+		uint32_t width = src->width;
+		uint32_t height = src->height;
+		nvnc_transform_dimensions(t, &width, &height);
+
+		struct nvnc_frame* dst = nvnc_frame_new(width, height,
+				src->fourcc_format, width);
+		assert(dst);
+
+		struct nvnc_composite_fb cfb = {
+			.fbs = { src },
+			.n_fbs = 1,
+		};
+
+		uint64_t start = gettime_us(CLOCK_MONOTONIC);
+		for (int i = 0; i < ROTATION_ROUNDS; ++i)
+			composite_buffer_now(dst, &cfb, NULL);
+		uint64_t dt = gettime_us(CLOCK_MONOTONIC) - start;
+
+		double mpix = (double)width * height * ROTATION_ROUNDS * 1e-6;
+		printf("\t%-12s %8.1f MPix/s (%"PRIu64" µs per frame)\n",
+				transform_name(t), mpix / (dt * 1e-6),
+				dt / ROTATION_ROUNDS);
+
+		nvnc_frame_unref(dst);
+	}
+
+	nvnc_frame_unref(src);
+	return 0;
+}
+
 int main(int argc, char* argv[])
 {
 	int rc = 0;
 
+	if (argc == 3 && strcmp(argv[1], "--rotate") == 0)
+		return run_rotation_bench(argv[2]);
+
 	if (argc < 4) {
 		fprintf(stderr, "Missing arguments\n");
 		return 1;
@@ -129,7 +204,10 @@ int main(int argc, char* argv[])
 		cfb.fbs[cfb.n_fbs++] = fb;
 	}
 
-	struct compositor* compositor = compositor_create();
+	struct executor* executor = executor_new(aml);
+	assert(executor);
+
+	struct compositor* compositor = compositor_create(executor);
 	assert(compositor);
 
 	struct pixman_region16 damage;
@@ -144,6 +222,7 @@ int main(int argc, char* argv[])
 	printf("Done\n");
 
 	compositor_destroy(compositor);
+	executor_destroy(executor);
 out:
 	nvnc_composite_fb_unref(&cfb);
 	aml_unref(aml);
@@ -1,4 +1,5 @@
 #include "parallel-deflate.h"
+#include "executor.h"
 #include "vec.h"
 
 #include <stdio.h>
@@ -156,8 +157,11 @@ static int run_benchmark(const char* file)
 
 	establish_baseline(&raw_data);
 
-	struct parallel_deflate* pd = parallel_deflate_new(level, -window_bits,
-			mem_level, strategy);
+	struct executor* executor = executor_new(aml_get_default());
+	assert(executor);
+
+	struct parallel_deflate* pd = parallel_deflate_new(executor, level,
+			-window_bits, mem_level, strategy);
 	assert(pd);
 
 	struct stopwatch stopwatch;
@@ -201,6 +205,7 @@ static int run_benchmark(const char* file)
 				(double)raw_data.len));
 
 	parallel_deflate_destroy(pd);
+	executor_destroy(executor);
 	inflateEnd(&inflate_zs);
 	vec_destroy(&raw_data);
 	vec_destroy(&deflate_result);
@@ -0,0 +1,103 @@
+/*
+ * Copyright (c) 2026 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "stream/websocket.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+#include <inttypes.h>
+
+#define PAYLOAD_SIZE (64 * 1024 * 1024)
+#define N_ROUNDS 8
+
+static uint64_t gettime_us(void)
+{
+	struct timespec ts = { 0 };
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000ULL;
+}
+
+static void report(const char* name, uint64_t dt_us)
+{
+	double mib = (double)PAYLOAD_SIZE * N_ROUNDS / (1024.0 * 1024.0);
+	printf("%s: %"PRIu64" µs, %.0f MiB/s\n", name, dt_us,
+			mib / (dt_us * 1e-6));
+}
+
+// This is how payloads were unmasked before there were wider kernels
+static void copy_payload_bytewise(const struct ws_frame_header* header,
+		uint8_t* restrict dst, const uint8_t* restrict src, size_t len)
+{
+	const uint8_t* restrict key = header->masking_key;
+	for (uint64_t i = 0; i < len; ++i)
+		dst[i] = src[i] ^ key[(header->payload_offset + i) % 4];
+}
+
+static void run_benchmark(const char* name,
+		void (*copy)(const struct ws_frame_header*, uint8_t* restrict,
+			const uint8_t* restrict, size_t),
+		const struct ws_frame_header* header, uint8_t* dst,
+		const uint8_t* src)
+{
+	uint64_t start = gettime_us();
+
+	for (int i = 0; i < N_ROUNDS; ++i)
+		copy(header, dst, src, PAYLOAD_SIZE);
+
+	report(name, gettime_us() - start);
+}
+
+int main(int argc, char* argv[])
+{
+	// One extra byte so that both buffers can be used unaligned
+	uint8_t* src = malloc(PAYLOAD_SIZE + 1);
+	uint8_t* reference = malloc(PAYLOAD_SIZE + 1);
+	uint8_t* result = malloc(PAYLOAD_SIZE + 1);
+	assert(src && reference && result);
+
+	srand(0);
+	for (size_t i = 0; i < PAYLOAD_SIZE + 1; ++i)
+		src[i] = rand();
+
+	// Fault the pages in so that the first run isn't penalised
+	memset(reference, 0, PAYLOAD_SIZE + 1);
+	memset(result, 0, PAYLOAD_SIZE + 1);
+
+	struct ws_frame_header header = {
+		.mask = true,
+		.payload_length = PAYLOAD_SIZE,
+		.masking_key = { 0x12, 0x34, 0x56, 0x78 },
+	};
+
+	for (int unaligned = 0; unaligned < 2; ++unaligned) {
+		header.payload_offset = unaligned;
+
+		printf("%s buffers:\n", unaligned ? "Unaligned" : "Aligned");
+		run_benchmark("  bytewise", copy_payload_bytewise, &header,
+				reference + unaligned, src + unaligned);
+		run_benchmark("  ws_copy_payload", ws_copy_payload, &header,
+				result + unaligned, src + unaligned);
+	}
+
+	free(result);
+	free(reference);
+	free(src);
+	return 0;
+}
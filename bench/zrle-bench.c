@@ -15,6 +15,7 @@
  */
 
 #include "enc/encoder.h"
+#include "executor.h"
 #include "frame.h"
 #include "rfb-proto.h"
 #include "neatvnc.h"
@@ -211,7 +212,11 @@ static int run_benchmark(const char *image)
 
 	pixman_region_union_rect(&region, &region, 0, 0, width, height);
 
-	struct encoder* enc = encoder_new(RFB_ENCODING_ZRLE, width, height);
+	struct executor* executor = executor_new(aml_get_default());
+	assert(executor);
+
+	struct encoder* enc = encoder_new(executor, NULL, RFB_ENCODING_ZRLE,
+			width, height);
 	assert(enc);
 
 	encoder_set_quality(enc, 10);
@@ -269,6 +274,7 @@ static int run_benchmark(const char *image)
 	printf("\n");
 
 	encoder_unref(enc);
+	executor_destroy(executor);
 
 	if (rc < 0)
 		goto failure;
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <stdbool.h>
+
 struct bwe_sample {
 	int bytes;
 	int departure_time;
@@ -10,5 +12,6 @@ struct bwe* bwe_create(int rtt_min);
 void bwe_destroy(struct bwe* self);
 
 void bwe_feed(struct bwe* self, const struct bwe_sample* sample);
+void bwe_feed_delivery_rate(struct bwe* self, double rate, bool is_app_limited);
 void bwe_update_rtt_min(struct bwe* self, int rtt_min);
 int bwe_get_estimate(const struct bwe* self);
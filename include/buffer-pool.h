@@ -21,13 +21,17 @@
 #include "weakref.h"
 #include "sys/queue.h"
 
+#include <stdatomic.h>
+
 TAILQ_HEAD(nvnc_buffer_queue, nvnc_buffer);
 
 struct nvnc_buffer_pool {
 	void* userdata;
 	nvnc_cleanup_fn cleanup_fn;
-	int ref;
+	atomic_int ref;
 	struct weakref_subject weakref;
 	struct nvnc_buffer_queue buffers;
 	nvnc_buffer_alloc_fn alloc_fn;
 };
+
+bool nvnc_buffer_pool__recycle(struct nvnc_buffer* buffer);
@@ -18,6 +18,7 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stdatomic.h>
 
 #include "neatvnc.h"
 #include "weakref.h"
@@ -29,12 +30,13 @@ struct nvnc_buffer {
 	void* userdata;
 	nvnc_cleanup_fn cleanup_fn;
 
-	int ref;
+	atomic_int ref;
 	enum nvnc_buffer_type type;
 	bool is_external;
 
 	/* main memory buffer */
 	void* addr;
+	size_t mapped_size; // non-zero if addr was mapped with mmap
 
 	/* dmabuf attributes */
 	struct gbm_bo* bo;
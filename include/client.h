@@ -35,12 +35,14 @@
 struct aml_idle;
 struct aml_timer;
 struct bwe;
-struct compositor;
+struct rate_control;
+struct encoding_policy;
 struct crypto_key;
 struct encoder;
 struct nvnc;
 struct stream;
 struct nvnc_desktop_layout;
+struct nvnc__scaled_output;
 
 enum nvnc_client_state {
 	VNC_CLIENT_STATE_WAITING_FOR_VERSION = 0,
@@ -80,11 +82,13 @@ struct nvnc_client {
 	LIST_ENTRY(nvnc_client) link;
 	struct pixman_region16 damage;
 	int n_pending_requests;
-	bool is_updating;
+	bool is_updating; // compositing or encoding
+	int n_outgoing_frames; // encoded, but not yet written to the socket
 	size_t buffer_index;
 	size_t buffer_len;
 	uint8_t msg_buffer[MSG_BUFFER_SIZE];
 	struct nvnc_desktop_layout* known_layout;
+	struct nvnc__scaled_output* scaled_output; // NULL if not scaled
 	struct cut_text cut_text;
 	uint32_t ext_clipboard_caps;
 	uint32_t ext_clipboard_max_unsolicited_text_size;
@@ -98,7 +102,6 @@ struct nvnc_client {
 	struct encoder* encoder;
 	struct encoder* zrle_encoder;
 	struct encoder* tight_encoder;
-	struct compositor* compositor;
 	uint32_t cursor_seq;
 	int quality;
 	bool formats_changed;
@@ -117,6 +120,20 @@ struct nvnc_client {
 	int32_t min_rtt;
 	struct bwe* bwe;
 	int32_t inflight_bytes;
+	uint32_t link_info_seq;
+	bool has_notsent_lowat;
+	struct rate_control* rate_control;
+	int update_quality;
+	uint32_t update_area;
+	struct encoding_policy* encoding_policy;
+	uint64_t encode_start_time;
+	struct aml_timer* refresh_timer;
+	uint64_t refresh_deadline; // µs, 0 when not armed
+	struct pixman_region16 refresh_region;
+	struct pixman_region16 update_refresh_region;
+	bool is_refresh_update;
+	bool has_pointer_position;
+	uint16_t pointer_x, pointer_y; // in client coordinates
 	bool has_ext_mouse_buttons;
 	struct aml_idle* close_task;
 	bool needs_desktop_name_update;
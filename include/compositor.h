@@ -17,7 +17,9 @@
 #pragma once
 
 #include <stdint.h>
+#include <stdbool.h>
 
+struct executor;
 struct nvnc_frame;
 struct pixman_region16;
 struct nvnc_composite_fb;
@@ -30,9 +32,28 @@ typedef void (*compositor_fn)(struct nvnc_composite_fb*,
 void composite_buffer_now(struct nvnc_frame* dst, struct nvnc_composite_fb* src,
 		struct pixman_region16* damage);
 
-struct compositor* compositor_create(void);
+struct compositor* compositor_create(struct executor* executor);
 void compositor_destroy(struct compositor*);
 
+/* The output of a scaled compositor is the source scaled down by the given
+ * factor, where 0 < scale <= 1. Damage is given in source coordinates.
+ */
+struct compositor* compositor_create_scaled(struct executor* executor,
+		double scale);
+
+// True if no jobs are in flight
+bool compositor_is_idle(const struct compositor*);
+
+/* The output of a compositing job is shared between everyone who feeds the
+ * same source frames before the next call to compositor_damage(). The damage
+ * passed to compositor_feed() is handed back unchanged to on_done.
+ */
 int compositor_feed(struct compositor*, struct nvnc_composite_fb* fb,
 		struct pixman_region16* damage, compositor_fn on_done,
 		void* userdata);
+
+// Mark a region of the source as changed
+void compositor_damage(struct compositor*, struct pixman_region16* damage);
+
+// Drop pending callbacks with the given userdata
+void compositor_cancel(struct compositor*, void* userdata);
@@ -82,6 +82,16 @@ ssize_t crypto_cipher_decrypt(struct crypto_cipher* self, uint8_t* dst,
 		uint8_t* mac, const uint8_t* src, size_t len,
 		const uint8_t* ad, size_t ad_len);
 
+/* Concurrent encryption: crypto_cipher_reserve_messages() claims the nonces of
+ * n consecutive messages and returns the index of the first one. Each of them
+ * can then be encrypted with crypto_cipher_encrypt_message() in any order and
+ * on any thread, as it does not modify the cipher.
+ */
+uint64_t crypto_cipher_reserve_messages(struct crypto_cipher* self, size_t n);
+bool crypto_cipher_encrypt_message(const struct crypto_cipher* self,
+		uint64_t index, uint8_t* dst, uint8_t* mac, const uint8_t* src,
+		size_t len, const uint8_t* ad, size_t ad_len);
+
 // Hashing
 struct crypto_hash* crypto_hash_new(enum crypto_hash_type type);
 void crypto_hash_del(struct crypto_hash* self);
@@ -39,3 +39,10 @@ void damage_refine(struct damage_refinery* self,
 		struct pixman_region16* refined, 
 		struct pixman_region16* hint,
 		struct nvnc_frame* buffer);
+
+/* Hash the pixels within a rectangle of a mapped buffer. This uses the same
+ * hash function as the refinery, but the full 64 bits of it, so that the result
+ * can be used to look up content.
+ */
+uint64_t damage_hash_rect(const struct nvnc_frame* buffer, uint32_t x,
+		uint32_t y, uint32_t width, uint32_t height, uint64_t seed);
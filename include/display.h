@@ -20,10 +20,21 @@
 #include "damage-refinery.h"
 
 #include <stdint.h>
+#include <stdatomic.h>
 #include <pixels.h>
+#include <pixman.h>
 
 struct nvnc;
 struct nvnc_frame;
+struct aml_handler;
+
+/* The same frame may be submitted to displays on several servers, so the
+ * damage that is accumulated for one display is kept out of the frame.
+ */
+struct nvnc_display_submission {
+	struct nvnc_frame* fb;
+	struct pixman_region16 damage;
+};
 
 struct nvnc_display {
 	void* userdata;
@@ -35,4 +46,15 @@ struct nvnc_display {
 	uint16_t logical_width, logical_height;
 	struct nvnc_frame* buffer;
 	struct damage_refinery damage_refinery;
+
+	/* Frames submitted from other threads wait here until the server's
+	 * loop picks them up. A byte written to the pipe wakes up the loop.
+	 */
+	_Atomic(struct nvnc_display_submission*) mailbox;
+	atomic_bool is_wakeup_pending;
+	int wakeup_fds[2];
+	struct aml_handler* wakeup_handler;
 };
+
+int nvnc_display__start_mailbox(struct nvnc_display* self);
+void nvnc_display__stop_mailbox(struct nvnc_display* self);
@@ -0,0 +1,38 @@
+/*
+ * Copyright (c) 2026 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pixman.h>
+
+/* Downscaling by a ratio of p source pixels to q destination pixels */
+struct downscale_ratio {
+	int p, q;
+};
+
+bool downscale_find_ratio(struct downscale_ratio* ratio, uint32_t src_size,
+		uint32_t dst_size);
+bool downscale_is_supported_format(uint32_t fourcc);
+
+/* Area-average a box of the destination from src. The box is in destination
+ * coordinates. Each 8-bit channel is averaged separately. Strides are in
+ * pixels.
+ */
+void downscale32(uint32_t* dst, int32_t dst_stride, const uint32_t* src,
+		int32_t src_stride, struct downscale_ratio h_ratio,
+		struct downscale_ratio v_ratio, const pixman_box16_t* box);
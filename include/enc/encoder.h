@@ -21,6 +21,9 @@
 #include <stdint.h>
 #include <unistd.h>
 
+struct aml;
+struct executor;
+struct tile_cache;
 struct encoder;
 struct nvnc_composite_fb;
 struct pixman_region16;
@@ -45,6 +48,12 @@ struct encoder_impl {
 	void (*request_key_frame)(struct encoder*);
 
 	void (*reset)(struct encoder*);
+
+	uint64_t (*get_refresh_region)(struct encoder*,
+			struct pixman_region16* dst, uint64_t idle_time);
+
+	void (*set_roi)(struct encoder*, struct pixman_region16* roi,
+			int quality);
 };
 
 struct encoded_frame {
@@ -58,6 +67,8 @@ struct encoded_frame {
 
 struct encoder {
 	struct encoder_impl* impl;
+	struct executor* executor;
+	struct aml* loop;
 
 	int ref;
 
@@ -65,12 +76,15 @@ struct encoder {
 	void* userdata;
 };
 
-struct encoder* encoder_new(enum rfb_encodings type, uint16_t width,
-		uint16_t height);
+/* The tile cache is optional and may be shared between encoders. */
+struct encoder* encoder_new(struct executor* executor,
+		struct tile_cache* tile_cache, enum rfb_encodings type,
+		uint16_t width, uint16_t height);
 void encoder_ref(struct encoder* self);
 void encoder_unref(struct encoder* self);
 
-void encoder_init(struct encoder* self, struct encoder_impl*);
+void encoder_init(struct encoder* self, struct encoder_impl*,
+		struct executor* executor);
 
 enum rfb_encodings encoder_get_type(const struct encoder* self);
 enum encoder_kind encoder_get_kind(const struct encoder* self);
@@ -79,6 +93,12 @@ void encoder_set_output_format(struct encoder* self,
 		const struct rfb_pixel_format*);
 void encoder_set_quality(struct encoder* self, int value);
 
+/* Use a different quality for the region of interest than for the rest of the
+ * frame. An empty region disables it.
+ */
+void encoder_set_roi(struct encoder* self, struct pixman_region16* roi,
+		int quality);
+
 int encoder_encode(struct encoder* self, struct nvnc_composite_fb* fb,
 		struct pixman_region16* damage);
 
@@ -88,6 +108,13 @@ void encoder_finish_frame(struct encoder* self, struct encoded_frame* result);
 
 void encoder_reset(struct encoder* self);
 
+/* Add areas that were encoded lossily and have not changed for at least
+ * idle_time µs to dst. Returns the number of µs until more lossy areas become
+ * eligible, or 0 if there are none.
+ */
+uint64_t encoder_get_refresh_region(struct encoder* self,
+		struct pixman_region16* dst, uint64_t idle_time);
+
 static inline void encoded_frame_ref(struct encoded_frame* self)
 {
 	rcbuf_ref(&self->buf);
@@ -19,6 +19,7 @@
 #include <unistd.h>
 #include <stdbool.h>
 
+struct aml;
 struct nvnc_frame;
 struct h264_encoder;
 
@@ -26,21 +27,22 @@ typedef void (*h264_encoder_packet_handler_fn)(const void* payload, size_t size,
 		uint64_t pts, void* userdata);
 
 struct h264_encoder_impl {
-	struct h264_encoder* (*create)(uint32_t width, uint32_t height,
-			uint32_t format, int quality);
+	struct h264_encoder* (*create)(struct aml* loop, uint32_t width,
+			uint32_t height, uint32_t format, int quality);
 	void (*destroy)(struct h264_encoder*);
 	void (*feed)(struct h264_encoder*, struct nvnc_frame*);
 };
 
 struct h264_encoder {
 	struct h264_encoder_impl *impl;
+	struct aml* loop;
 	h264_encoder_packet_handler_fn on_packet_ready;
 	void* userdata;
 	bool next_frame_should_be_keyframe;
 };
 
-struct h264_encoder* h264_encoder_create(uint32_t width, uint32_t height,
-		uint32_t format, int quality);
+struct h264_encoder* h264_encoder_create(struct aml* loop, uint32_t width,
+		uint32_t height, uint32_t format, int quality);
 
 void h264_encoder_destroy(struct h264_encoder*);
 
@@ -0,0 +1,42 @@
+/*
+ * Copyright (c) 2026 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+
+/* A size-bounded LRU cache of encoded tiles, keyed on a hash of the tile's
+ * content and the parameters that it was encoded with. Lookups and insertions
+ * are safe from multiple threads, but references must be taken and dropped on
+ * the main thread.
+ */
+struct tile_cache;
+
+struct tile_cache* tile_cache_create(size_t max_bytes);
+void tile_cache_ref(struct tile_cache* self);
+void tile_cache_unref(struct tile_cache* self);
+
+/* Copies the cached data into dst if it is found and fits. Returns the size of
+ * the data or -1 if it was not found.
+ */
+ssize_t tile_cache_lookup(struct tile_cache* self, uint64_t key, void* dst,
+		size_t max_size);
+
+void tile_cache_insert(struct tile_cache* self, uint64_t key,
+		const void* data, size_t size);
@@ -0,0 +1,49 @@
+/*
+ * Copyright (c) 2026 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#pragma once
+
+#include <stdint.h>
+#include <unistd.h>
+
+struct vec;
+struct rfb_pixel_format;
+
+enum zrle_subencoding {
+	ZRLE_RAW = 0,
+	ZRLE_SOLID = 1,
+	ZRLE_PACKED_PALETTE = 2, // 2 to 16 is the palette size
+	ZRLE_PLAIN_RLE = 128,
+	ZRLE_PALETTE_RLE = 130, // 128 + the palette size
+};
+
+/* Encode a tile of up to 64x64 tightly packed pixels into dst, before
+ * compression, using whichever subencoding yields the smallest output. dst
+ * must have room for a raw tile along with a palette of 127 colours. Returns
+ * the subencoding that was used.
+ */
+enum zrle_subencoding zrle_encode_tile(struct vec* dst,
+		const struct rfb_pixel_format* dst_fmt, const uint8_t* src,
+		const struct rfb_pixel_format* src_fmt, int width, int height);
+
+/* Estimate the size that the tile would have when encoded with the given
+ * subencoding, or 0 if the subencoding can't be used for it.
+ */
+size_t zrle_estimate_tile_size(const uint8_t* src,
+		const struct rfb_pixel_format* dst_fmt,
+		const struct rfb_pixel_format* src_fmt, int width, int height,
+		enum zrle_subencoding subencoding);
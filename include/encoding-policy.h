@@ -0,0 +1,43 @@
+/*
+ * Copyright (c) 2026 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include "rfb-proto.h"
+
+#include <stdint.h>
+#include <unistd.h>
+
+struct encoding_policy;
+
+struct encoding_policy_input {
+	int bandwidth; // bytes per second
+	uint32_t n_pixels; // area of the whole frame
+	uint32_t n_damaged_pixels; // area of the damage in the next update
+	int bytes_per_pixel; // for the raw pixel format
+};
+
+struct encoding_policy* encoding_policy_create(void);
+void encoding_policy_destroy(struct encoding_policy* self);
+
+void encoding_policy_feed(struct encoding_policy* self,
+		enum rfb_encodings encoding, uint32_t n_bytes, uint32_t n_pixels,
+		uint32_t encode_time); // µs
+
+/* The candidates must be ordered by client preference. */
+enum rfb_encodings encoding_policy_choose(struct encoding_policy* self,
+		const enum rfb_encodings* candidates, size_t n_candidates,
+		const struct encoding_policy_input* input);
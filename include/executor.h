@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2026 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#pragma once
+
+#include <unistd.h>
+
+struct aml;
+struct executor;
+
+/* Work is queued per stage so that long running jobs of one kind cannot hold
+ * up latency critical jobs of another. Each worker serves one stage first and
+ * only takes work from the other stages when its own queue is empty.
+ */
+enum executor_stage {
+	EXECUTOR_STAGE_COMPOSITE = 0,
+	EXECUTOR_STAGE_ENCODE,
+	EXECUTOR_STAGE_COMPRESS,
+
+	EXECUTOR_STAGE_COUNT,
+};
+
+typedef void (*executor_fn)(void* userdata);
+
+/* Completion callbacks are called on the given loop.
+ */
+struct executor* executor_new(struct aml* loop);
+void executor_destroy(struct executor* self);
+
+struct aml* executor_get_loop(const struct executor* self);
+
+/* Executors that are left with the default configuration share one set of
+ * workers for the whole process. Executors that are configured with any of the
+ * following get workers of their own.
+ *
+ * The following must be called before the first job is submitted. They return
+ * -1 if the workers have already been started or if the platform does not
+ * support the requested setting.
+ *
+ * There is always at least one worker per stage.
+ */
+int executor_set_worker_count(struct executor* self, int n);
+
+/* Pin each worker to one of the given CPUs, in a round-robin fashion.
+ */
+int executor_set_cpus(struct executor* self, const int* cpus, size_t n);
+
+/* Let the workers run on any of the CPUs of the given NUMA node.
+ */
+int executor_set_numa_node(struct executor* self, int node);
+
+/* Run work_fn on a worker thread and then done_fn on the executor's loop.
+ * Either may be NULL. This may be called from any thread.
+ */
+int executor_submit(struct executor* self, enum executor_stage stage,
+		executor_fn work_fn, executor_fn done_fn, void* userdata);
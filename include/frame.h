@@ -38,7 +38,7 @@ struct nvnc_frame_metadata {
 struct nvnc_frame {
 	void* userdata;
 	nvnc_cleanup_fn cleanup_fn;
-	int ref;
+	atomic_int ref;
 	uint16_t x_off;
 	uint16_t y_off;
 	uint16_t width;
@@ -52,6 +52,9 @@ struct nvnc_frame {
 	struct pixman_region16 damage;
 
 	struct nvnc_buffer* buffer;
+
+	// Set for views, which keep the frame that they were made from alive
+	struct nvnc_frame* parent;
 };
 
 struct nvnc_composite_fb {
@@ -64,6 +67,8 @@ struct nvnc_frame_metadata* nvnc_frame_metadata_new(void);
 void nvnc_frame_metadata_ref(struct nvnc_frame_metadata*);
 void nvnc_frame_metadata_unref(struct nvnc_frame_metadata*);
 
+struct nvnc_frame* nvnc_frame_new_view(struct nvnc_frame* parent);
+
 void nvnc_frame_get_effective_logical_size(const struct nvnc_frame* self,
 		uint16_t* width, uint16_t* height);
 
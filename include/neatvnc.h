@@ -55,6 +55,7 @@
 	if (!(statement)) \
 		nvnc_log(NVNC_LOG_PANIC, fmt, ## __VA_ARGS__)
 
+struct aml;
 struct nvnc;
 struct nvnc_client;
 struct nvnc_auth_creds;
@@ -85,6 +86,11 @@ enum nvnc_buffer_type {
 	NVNC_BUFFER_GBM_BO,
 };
 
+enum nvnc_buffer_alloc_flags {
+	NVNC_BUFFER_ALLOC_HUGEPAGES = 1 << 0,
+	NVNC_BUFFER_ALLOC_PREFAULT = 1 << 1,
+};
+
 enum nvnc_stream_type {
 	NVNC_STREAM_NORMAL = 0,
 	NVNC_STREAM_WEBSOCKET,
@@ -157,9 +163,28 @@ void nvnc__log(const struct nvnc_log_data*, const char* fmt, ...);
 
 /**
  * Create a new VNC server instance.
+ *
+ * The server runs on the default aml loop.
  */
 struct nvnc* nvnc_new(void);
 
+/**
+ * Create a new VNC server instance that runs on the given aml loop.
+ *
+ * All of the server's handlers, timers and worker jobs are started on this
+ * loop, and all of its callbacks are called from the thread that runs it. The
+ * server must only be used from that thread, except for
+ * nvnc_display_submit_frame().
+ *
+ * This allows a large number of clients to be spread over several threads by
+ * creating one server per thread, each with its own loop, and distributing
+ * connections between them, e.g. by listening on the same port with
+ * nvnc_set_reuse_port_enabled() or by passing accepted sockets to
+ * nvnc_listen(). Each server has its own display, and new frames are broadcast
+ * to all of them with nvnc_display_submit_frame().
+ */
+struct nvnc* nvnc_new_with_loop(struct aml* loop);
+
 /**
  * Destroy the server and close all client connections.
  */
@@ -167,11 +192,17 @@ void nvnc_del(struct nvnc* self);
 
 /**
  * Start accepting connections on an existing file descriptor.
+ *
+ * listen() is called on the socket with a backlog of 16, but its file status
+ * flags are not changed. Connections are only accepted in batches (see
+ * nvnc_set_accept_batch_size()) if the socket is non-blocking.
  */
 int nvnc_listen(struct nvnc* self, int fd, enum nvnc_stream_type type);
 
 /**
  * Create a TCP socket on the given address and port and start listening.
+ *
+ * See also nvnc_set_reuse_port_enabled().
  */
 int nvnc_listen_tcp(struct nvnc* self, const char* addr, uint16_t port,
 		enum nvnc_stream_type type);
@@ -299,6 +330,22 @@ void nvnc_client_close(struct nvnc_client* client);
 void nvnc_client_set_led_state(struct nvnc_client*,
 		enum nvnc_keyboard_led_state);
 
+/**
+ * Scale the desktop down by the given factor, where 0 < scale <= 1, before it
+ * is sent to the client. This is useful for thumbnail views and display walls.
+ * Clients that use the same scale share the scaled frames, and pointer events
+ * from the client are mapped back to desktop coordinates.
+ *
+ * The client is told about the new size in the same way as when the desktop is
+ * resized.
+ */
+int nvnc_client_set_output_scale(struct nvnc_client*, double scale);
+
+/**
+ * Get the scale that was set using nvnc_client_set_output_scale().
+ */
+double nvnc_client_get_output_scale(const struct nvnc_client*);
+
 /**
  * Set the desktop name advertised to VNC clients.
  *
@@ -306,6 +353,114 @@ void nvnc_client_set_led_state(struct nvnc_client*,
  */
 void nvnc_set_name(struct nvnc* self, const char* name);
 
+/**
+ * Let the server choose between the frame encodings that each client supports
+ * based on measured bandwidth and encoding cost, instead of always using the
+ * client's most preferred one.
+ *
+ * This is disabled by default.
+ */
+void nvnc_set_adaptive_encoding(struct nvnc* self, bool enable);
+
+/**
+ * Limit the amount of unsent data that may sit in the kernel's send buffer for
+ * each client, using TCP_NOTSENT_LOWAT. When set, encoding of the next update
+ * is held back until the client's socket has drained below the limit, so that
+ * each update carries the freshest content that is available.
+ *
+ * This applies to clients that connect after the call. Zero disables it, which
+ * is the default.
+ */
+void nvnc_set_notsent_lowat(struct nvnc* self, uint32_t bytes);
+
+/**
+ * Set the maximum number of connections that are accepted each time a
+ * listening socket becomes readable. The rest stay in the backlog until the
+ * next iteration of the loop, so that a storm of reconnecting clients does not
+ * hold up those that are already connected.
+ *
+ * The default is 16.
+ */
+void nvnc_set_accept_batch_size(struct nvnc* self, uint32_t size);
+
+/**
+ * Set SO_REUSEPORT on sockets created by nvnc_listen_tcp() after this call.
+ *
+ * This lets several servers, each running on its own loop, listen on the same
+ * address and port. The kernel then spreads incoming connections across them.
+ * See nvnc_new_with_loop().
+ *
+ * Returns -1 if SO_REUSEPORT is not supported on this platform.
+ */
+int nvnc_set_reuse_port_enabled(struct nvnc* self, bool enable);
+
+/**
+ * Set the number of worker threads that the server uses for compositing,
+ * encoding and compression. The default is the number of online CPUs, and
+ * there are never fewer than three.
+ *
+ * Each worker gives priority to one kind of work and only takes on other work
+ * when it has nothing else to do, so that long running compression jobs do not
+ * hold up compositing.
+ *
+ * All servers that are left with the default settings share one set of workers
+ * for the whole process. A server for which this or one of the following
+ * functions is called gets workers of its own.
+ *
+ * This and the following functions must be called before the first frame is
+ * fed to the server. They return -1 if it is too late or if the platform does
+ * not support the setting.
+ */
+int nvnc_set_worker_count(struct nvnc* self, int n);
+
+/**
+ * Pin each worker thread to one of the given CPUs, in a round-robin fashion.
+ */
+int nvnc_set_worker_cpus(struct nvnc* self, const int* cpus, size_t n);
+
+/**
+ * Let the worker threads run only on the CPUs of the given NUMA node.
+ */
+int nvnc_set_worker_numa_node(struct nvnc* self, int node);
+
+/**
+ * Re-send areas that were encoded lossily, e.g. using JPEG, without loss once
+ * they have stayed unchanged for the given number of milliseconds and the
+ * client's link is not busy. This keeps the bandwidth low while the content is
+ * moving and makes text sharp again once it stops.
+ *
+ * Zero disables it, which is the default.
+ */
+void nvnc_set_lossless_refresh_delay(struct nvnc* self, uint32_t delay_ms);
+
+/**
+ * Encode the area around the pointer and the focus rectangle with a higher
+ * quality than the rest of the frame. The quality is on the same 0 to 10 scale
+ * as the JPEG quality levels that clients request, where 10 means lossless.
+ *
+ * This only applies to clients that have asked for lossy encoding and only
+ * when the given quality is higher than the one that is otherwise used.
+ * A negative value disables it, which is the default.
+ */
+void nvnc_set_roi_quality(struct nvnc* self, int quality);
+
+/**
+ * Set the focus rectangle in desktop coordinates, e.g. the geometry of the
+ * focused window. It is used by nvnc_set_roi_quality(). A zero width or height
+ * clears it.
+ */
+void nvnc_set_focus_rect(struct nvnc* self, int x, int y,
+		unsigned int width, unsigned int height);
+
+/**
+ * Scale the desktop down for clients that request a smaller desktop size via
+ * ExtendedDesktopSize, if the request is rejected by the desktop layout handler
+ * and the requested size has the same aspect ratio as the desktop.
+ *
+ * This is disabled by default.
+ */
+void nvnc_set_resize_by_scaling(struct nvnc* self, bool enable);
+
 /**
  * Set a handler for keyboard keysym events.
  */
@@ -396,6 +551,17 @@ int nvnc_enable_auth(struct nvnc* self, enum nvnc_auth_flags flags,
 int nvnc_set_tls_creds(struct nvnc* self, const char* privkey_path,
 		const char* cert_path);
 
+/**
+ * Let the kernel encrypt and decrypt TLS records (kTLS) once the handshake is
+ * done, so that encrypted connections are sent the same way as plain ones.
+ * Connections fall back to encrypting in user space if the kernel does not
+ * support it, e.g. because the tls module is not loaded. Older GnuTLS versions
+ * additionally require kTLS to be enabled in the system-wide GnuTLS config.
+ *
+ * Returns -1 if neatvnc was built without kTLS support.
+ */
+int nvnc_set_ktls_enabled(struct nvnc* self, bool enable);
+
 /**
  * Load an RSA private key for RSA-AES authentication.
  */
@@ -435,12 +601,26 @@ void nvnc_auth_creds_reject(struct nvnc_auth_creds*, const char* reason);
  * Allocate a new buffer with the given size.
  *
  * The buffer is allocated from main memory using aligned_alloc with an
- * alignment of min(4, sizeof(void*)).
+ * alignment of 64 bytes, i.e. a cache line.
  *
  * The buffer will have a type of NVNC_BUFFER_SIMPLE.
  */
 struct nvnc_buffer* nvnc_buffer_new(size_t size);
 
+/**
+ * Allocate a new buffer with the given size and allocation flags.
+ *
+ * If any flags are set, the buffer is mapped directly from the kernel instead.
+ * With NVNC_BUFFER_ALLOC_HUGEPAGES, it is backed by reserved huge pages if
+ * there are any, and otherwise it is aligned for and advised to use
+ * transparent huge pages. With NVNC_BUFFER_ALLOC_PREFAULT, all of its pages
+ * are faulted in up front instead of on first touch.
+ *
+ * Without flags, this is the same as nvnc_buffer_new().
+ */
+struct nvnc_buffer* nvnc_buffer_new_with_flags(size_t size,
+		enum nvnc_buffer_alloc_flags flags);
+
 /**
  * Wrap an external memory address into a buffer object.
  *
@@ -664,6 +844,14 @@ struct nvnc_frame_pool* nvnc_frame_pool_new(uint16_t width, uint16_t height,
 bool nvnc_frame_pool_resize(struct nvnc_frame_pool*, uint16_t width,
 		uint16_t height, uint32_t fourcc_format, uint16_t stride);
 
+/**
+ * Set the flags that the pool's buffers are allocated with. See
+ * nvnc_buffer_new_with_flags(). Frames that have already been allocated are
+ * not reused afterwards, and the flags also apply after resizing.
+ */
+void nvnc_frame_pool_set_alloc_flags(struct nvnc_frame_pool*,
+		enum nvnc_buffer_alloc_flags flags);
+
 /**
  * Increment the reference count of the frame pool.
  */
@@ -731,6 +919,28 @@ struct nvnc* nvnc_display_get_server(const struct nvnc_display*);
  */
 void nvnc_display_feed_frame(struct nvnc_display*, struct nvnc_frame*);
 
+/**
+ * Submit a new frame from any thread.
+ *
+ * This is the thread-safe counterpart of nvnc_display_feed_frame(). The frame
+ * is handed over to the server's loop, which feeds it to the display. If another
+ * frame is submitted before that happens, the earlier one is dropped and its
+ * damage is added to the new one.
+ *
+ * The display must have been added to a server. Frames for one display must
+ * only be submitted from one thread at a time.
+ *
+ * The same frame may be submitted to displays on several servers, as long as
+ * it is not modified until all of them have released it.
+ *
+ * Frames and buffers have atomic reference counts, so they may be referenced
+ * and unreferenced on any thread, and frames may be acquired from frame pools
+ * and buffer pools on any thread. A frame pool must not be resized while it is
+ * being used on another thread. Note that the cleanup functions of frames and
+ * buffers may also be called on other threads.
+ */
+void nvnc_display_submit_frame(struct nvnc_display*, struct nvnc_frame*);
+
 /**
  * Get the total desktop width from the layout in logical coordinates.
  */
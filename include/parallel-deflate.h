@@ -18,11 +18,12 @@
 
 #include <unistd.h>
 
+struct executor;
 struct vec;
 struct parallel_deflate;
 
-struct parallel_deflate* parallel_deflate_new(int level, int window_bits,
-		int mem_level, int strategy);
+struct parallel_deflate* parallel_deflate_new(struct executor* executor,
+		int level, int window_bits, int mem_level, int strategy);
 void parallel_deflate_destroy(struct parallel_deflate* self);
 
 void parallel_deflate_feed(struct parallel_deflate* self, struct vec* out,
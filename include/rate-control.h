@@ -0,0 +1,40 @@
+/*
+ * Copyright (c) 2026 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#define RATE_CONTROL_QUALITY_LEVELS 10
+
+struct rate_control;
+
+struct rate_control_input {
+	int bandwidth; // bytes per second
+	int inflight_bytes;
+	int32_t min_rtt; // µs
+	uint32_t n_pixels; // area of the next update
+	int min_quality;
+	int max_quality;
+};
+
+struct rate_control* rate_control_create(void);
+void rate_control_destroy(struct rate_control* self);
+
+void rate_control_feed(struct rate_control* self, int quality,
+		uint32_t n_bytes, uint32_t n_pixels);
+int rate_control_get_quality(struct rate_control* self,
+		const struct rate_control_input* input);
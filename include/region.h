@@ -22,3 +22,4 @@ void nvnc_region_scale(struct pixman_region16* dst, struct pixman_region16* src,
 		double h_scale, double v_scale);
 void nvnc_region_translate(struct pixman_region16* dst,
 		struct pixman_region16* src, int x, int y);
+int nvnc_scale_coordinate(int value, double scale);
@@ -43,6 +43,9 @@
 #define MAX_SECURITY_TYPES 32
 
 struct aml_handler;
+struct compositor;
+struct executor;
+struct tile_cache;
 struct crypto_rsa_priv_key;
 struct crypto_rsa_pub_key;
 struct nvnc;
@@ -59,6 +62,7 @@ struct nvnc__socket {
 	struct nvnc* parent;
 	enum nvnc_stream_type type;
 	bool is_external;
+	bool is_nonblocking;
 	int fd;
 	struct aml_handler* poll_handle;
 	LIST_ENTRY(nvnc__socket) link;
@@ -66,7 +70,20 @@ struct nvnc__socket {
 
 LIST_HEAD(nvnc__socket_list, nvnc__socket);
 
+/* Clients that view the desktop at the same scale share a compositor, so the
+ * scaling is only done once per scale.
+ */
+struct nvnc__scaled_output {
+	double scale;
+	int ref;
+	struct compositor* compositor;
+	LIST_ENTRY(nvnc__scaled_output) link;
+};
+
+LIST_HEAD(nvnc__scaled_output_list, nvnc__scaled_output);
+
 struct nvnc {
+	struct aml* loop;
 	void* userdata;
 	nvnc_cleanup_fn cleanup_fn;
 	bool is_closing;
@@ -96,6 +113,7 @@ struct nvnc {
 
 #ifdef ENABLE_TLS
 	gnutls_certificate_credentials_t tls_creds;
+	bool is_ktls_enabled;
 #endif
 
 #ifdef HAVE_CRYPTO
@@ -107,6 +125,21 @@ struct nvnc {
 	enum rfb_security_type security_types[MAX_SECURITY_TYPES];
 
 	uint32_t n_damage_clients;
+	struct executor* executor;
+	struct tile_cache* tile_cache;
+	struct compositor* compositor;
+	struct nvnc__scaled_output_list scaled_outputs;
+	bool is_adaptive_encoding_enabled;
+	bool is_resize_by_scaling_enabled;
+	uint32_t notsent_lowat;
+	uint32_t accept_batch_size;
+	bool is_reuse_port_enabled;
+	uint64_t lossless_refresh_delay; // µs
+	int roi_quality; // negative if disabled
+	struct {
+		int x, y;
+		unsigned int width, height;
+	} focus_rect;
 };
 
 void nvnc__damage_region(struct nvnc* self,
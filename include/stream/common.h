@@ -35,5 +35,15 @@ static inline void stream__poll_rw(struct stream* self)
 	aml_set_event_mask(self->handler, AML_EVENT_READ | AML_EVENT_WRITE);
 }
 
+// Poll for writing only if somebody is waiting for the stream to drain
+static inline void stream__poll_idle(struct stream* self)
+{
+	if (self->wants_writable)
+		stream__poll_rw(self);
+	else
+		stream__poll_r(self);
+}
+
 void stream_req__finish(struct stream_req* req, enum stream_req_status status);
 void stream__remote_closed(struct stream* self);
+void stream__on_drained(struct stream* self);
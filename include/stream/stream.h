@@ -30,6 +30,9 @@
 
 #define STREAM_ALLOC_SIZE 4096
 
+// Large enough for a WebSocket frame header
+#define STREAM_REQ_PREFIX_SIZE 14
+
 enum stream_state {
 	STREAM_STATE_NORMAL = 0,
 	STREAM_STATE_CLOSED,
@@ -47,8 +50,10 @@ enum stream_req_status {
 enum stream_event {
 	STREAM_EVENT_READ,
 	STREAM_EVENT_REMOTE_CLOSED,
+	STREAM_EVENT_WRITABLE,
 };
 
+struct aml;
 struct stream;
 struct crypto_cipher;
 
@@ -58,6 +63,17 @@ typedef struct rcbuf* (*stream_exec_fn)(struct stream*, void* userdata);
 
 struct stream_req {
 	struct rcbuf* payload;
+	size_t offset; // bytes of the request already handed to the transport
+
+	/* The TCP stream sends payload_len bytes of the payload, starting at
+	 * payload_start, after the prefix. This lets framing be added and
+	 * large payloads be split up without copying them.
+	 */
+	size_t payload_start;
+	size_t payload_len;
+	uint8_t prefix[STREAM_REQ_PREFIX_SIZE];
+	uint8_t prefix_len;
+
 	stream_req_fn on_done;
 	stream_exec_fn exec;
 	void* userdata;
@@ -66,6 +82,20 @@ struct stream_req {
 
 TAILQ_HEAD(stream_send_queue, stream_req);
 
+/* Congestion state as reported by the kernel. Sizes are in bytes and times
+ * are in µs. Fields that the socket type cannot provide are left at zero.
+ */
+struct stream_link_info {
+	uint32_t seq; // incremented on each update
+	uint32_t rtt;
+	uint32_t min_rtt;
+	uint64_t delivery_rate; // bytes per second
+	bool is_app_limited;
+	uint32_t cwnd;
+	uint32_t unacked;
+	uint32_t notsent;
+};
+
 struct stream_impl {
 	int (*close)(struct stream*);
 	void (*destroy)(struct stream*);
@@ -82,6 +112,7 @@ struct stream {
 
 	enum stream_state state;
 
+	struct aml* loop;
 	int fd;
 	struct aml_handler* handler;
 	stream_event_fn on_event;
@@ -93,16 +124,22 @@ struct stream {
 	uint32_t bytes_received;
 
 	bool cork;
+	bool wants_writable;
+
+	struct stream_link_info link_info;
+	bool has_link_info;
 
 	struct crypto_cipher* cipher;
 	struct vec tmp_buf;
 };
 
 #ifdef ENABLE_WEBSOCKET
-struct stream* stream_ws_new(int fd, stream_event_fn on_event, void* userdata);
+struct stream* stream_ws_new(struct aml* loop, int fd,
+		stream_event_fn on_event, void* userdata);
 #endif
 
-struct stream* stream_new(int fd, stream_event_fn on_event, void* userdata);
+struct stream* stream_new(struct aml* loop, int fd,
+		stream_event_fn on_event, void* userdata);
 void stream_init(struct stream* self);
 void stream_ref(struct stream* self);
 int stream_close(struct stream* self);
@@ -116,8 +153,16 @@ int stream_send_first(struct stream* self, struct rcbuf* payload);
 // Queue a pure function to be executed when time comes to send it.
 void stream_exec_and_send(struct stream* self, stream_exec_fn, void* userdata);
 
+// True if nothing is queued and the socket will accept more data. With
+// TCP_NOTSENT_LOWAT, this means that the kernel's unsent data is below the
+// low-water mark.
+bool stream_is_drained(struct stream* self);
+
+// Emit STREAM_EVENT_WRITABLE once the stream is drained.
+void stream_notify_writable(struct stream* self);
+
 #ifdef ENABLE_TLS
-int stream_upgrade_to_tls(struct stream* self, void* context);
+int stream_upgrade_to_tls(struct stream* self, void* context, bool use_ktls);
 #endif
 
 #ifdef HAVE_CRYPTO
@@ -36,6 +36,7 @@ struct ws_frame_header {
 	enum ws_opcode opcode;
 	bool mask;
 	uint64_t payload_length;
+	uint64_t payload_offset; // bytes of the payload consumed so far
 	uint8_t masking_key[4];
 	size_t header_length;
 };
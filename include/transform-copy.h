@@ -0,0 +1,32 @@
+/*
+ * Copyright (c) 2026 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include "neatvnc.h"
+
+#include <stdint.h>
+#include <pixman.h>
+
+/* Copy a box of 32 bit pixels from src to dst while applying the transform.
+ * The box is in the coordinates of the transformed image and src_width and
+ * src_height are the dimensions of the source before the transform. Strides
+ * are in pixels.
+ */
+void nvnc_transform_copy32(uint32_t* dst, int32_t dst_stride,
+		const uint32_t* src, int32_t src_stride,
+		uint32_t src_width, uint32_t src_height,
+		enum nvnc_transform transform, const pixman_box16_t* box);
@@ -90,7 +90,8 @@ static int on_vencrypt_subtype_message(struct nvnc_client* client)
 
 	send_byte(client, 1);
 
-	if (stream_upgrade_to_tls(client->net_stream, client->server->tls_creds) < 0) {
+	if (stream_upgrade_to_tls(client->net_stream, client->server->tls_creds,
+				client->server->is_ktls_enabled) < 0) {
 		nvnc_client_close(client);
 		return -1;
 	}
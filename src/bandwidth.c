@@ -4,6 +4,7 @@
 #include <tgmath.h>
 
 #define SAMPLES_MAX 16
+#define DELIVERY_RATE_SMOOTHING 0.25
 
 // bandwidth estimator
 struct bwe {
@@ -11,6 +12,7 @@ struct bwe {
 	int n_samples;
 	int index;
 	double estimate;
+	double delivery_rate;
 	struct bwe_sample samples[0];
 };
 
@@ -95,6 +97,23 @@ void bwe_feed(struct bwe* self, const struct bwe_sample* sample)
 	update_estimate(self);
 }
 
+// Delivery rate as measured by the kernel's TCP stack. When the sender is
+// application limited, the measured rate says little about the capacity of the
+// link, so it is only allowed to raise the estimate, and it is not used at all
+// until a sample that is not application limited has arrived.
+void bwe_feed_delivery_rate(struct bwe* self, double rate, bool is_app_limited)
+{
+	if (rate <= 0)
+		return;
+
+	if (self->delivery_rate == 0) {
+		if (!is_app_limited)
+			self->delivery_rate = rate;
+	} else if (!is_app_limited || rate > self->delivery_rate)
+		self->delivery_rate += DELIVERY_RATE_SMOOTHING *
+			(rate - self->delivery_rate);
+}
+
 void bwe_update_rtt_min(struct bwe* self, int rtt_min)
 {
 	self->rtt_min = rtt_min;
@@ -102,5 +121,10 @@ void bwe_update_rtt_min(struct bwe* self, int rtt_min)
 
 int bwe_get_estimate(const struct bwe* self)
 {
+	// The kernel's measurement is fresher than the fence round-trips, but it
+	// is only available for TCP. Unix sockets and TCP connections that have
+	// not yet yielded a usable sample rely on the fence round-trips.
+	if (self->delivery_rate > 0)
+		return round(self->delivery_rate);
 	return round(self->estimate);
 }
@@ -20,9 +20,16 @@
 
 #include <assert.h>
 #include <stdlib.h>
+#include <pthread.h>
 
 #define EXPORT __attribute__((visibility("default")))
 
+/* Buffers may be acquired and released on any thread. This protects the pools'
+ * queues and the weak references between buffers and their pools, which are
+ * only touched briefly.
+ */
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 EXPORT
 struct nvnc_buffer_pool* nvnc_buffer_pool_new(nvnc_buffer_alloc_fn alloc_fn)
 {
@@ -40,12 +47,20 @@ struct nvnc_buffer_pool* nvnc_buffer_pool_new(nvnc_buffer_alloc_fn alloc_fn)
 
 static void nvnc_buffer_pool__destroy(struct nvnc_buffer_pool* self)
 {
+	struct nvnc_buffer_queue buffers = TAILQ_HEAD_INITIALIZER(buffers);
+
+	pthread_mutex_lock(&pool_mutex);
+
 	// Notify in-flight buffers so they free instead of returning to us
 	weakref_subject_deinit(&self->weakref);
 
-	while (!TAILQ_EMPTY(&self->buffers)) {
-		struct nvnc_buffer* buffer = TAILQ_FIRST(&self->buffers);
-		TAILQ_REMOVE(&self->buffers, buffer, link);
+	TAILQ_CONCAT(&buffers, &self->buffers, link);
+
+	pthread_mutex_unlock(&pool_mutex);
+
+	while (!TAILQ_EMPTY(&buffers)) {
+		struct nvnc_buffer* buffer = TAILQ_FIRST(&buffers);
+		TAILQ_REMOVE(&buffers, buffer, link);
 		nvnc_buffer_unref(buffer);
 	}
 
@@ -73,24 +88,50 @@ static struct nvnc_buffer* nvnc_buffer_pool__acquire_new(
 	if (!buffer)
 		return NULL;
 
+	pthread_mutex_lock(&pool_mutex);
 	weakref_observer_init(&buffer->pool, &self->weakref);
+	pthread_mutex_unlock(&pool_mutex);
+
 	return buffer;
 }
 
 static struct nvnc_buffer* nvnc_buffer_pool__acquire_from_queue(
 		struct nvnc_buffer_pool* self)
 {
+	pthread_mutex_lock(&pool_mutex);
+
 	struct nvnc_buffer* buffer = TAILQ_FIRST(&self->buffers);
-	assert(buffer);
-	TAILQ_REMOVE(&self->buffers, buffer, link);
-	weakref_observer_init(&buffer->pool, &self->weakref);
+	if (buffer) {
+		TAILQ_REMOVE(&self->buffers, buffer, link);
+		weakref_observer_init(&buffer->pool, &self->weakref);
+	}
+
+	pthread_mutex_unlock(&pool_mutex);
 	return buffer;
 }
 
 EXPORT
 struct nvnc_buffer* nvnc_buffer_pool_acquire(struct nvnc_buffer_pool* self)
 {
-	return TAILQ_EMPTY(&self->buffers) ?
-		nvnc_buffer_pool__acquire_new(self) :
-		nvnc_buffer_pool__acquire_from_queue(self);
+	struct nvnc_buffer* buffer = nvnc_buffer_pool__acquire_from_queue(self);
+	return buffer ? buffer : nvnc_buffer_pool__acquire_new(self);
+}
+
+/* Puts a buffer whose reference count has dropped to zero back into the pool
+ * that it came from. Returns false if the pool is gone.
+ */
+bool nvnc_buffer_pool__recycle(struct nvnc_buffer* buffer)
+{
+	pthread_mutex_lock(&pool_mutex);
+
+	struct nvnc_buffer_pool* pool =
+		WEAKREF_CAST(buffer->pool, struct nvnc_buffer_pool, weakref);
+	if (pool) {
+		weakref_observer_deinit(&buffer->pool);
+		buffer->ref = 1;
+		TAILQ_INSERT_TAIL(&pool->buffers, buffer, link);
+	}
+
+	pthread_mutex_unlock(&pool_mutex);
+	return pool != NULL;
 }
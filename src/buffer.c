@@ -20,7 +20,10 @@
 #include "logging.h"
 
 #include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
 #include <sys/param.h>
+#include <sys/mman.h>
 
 #include "config.h"
 
@@ -32,6 +35,9 @@
 #define UDIV_UP(a, b) (((a) + (b) - 1) / (b))
 #define ALIGN_UP(n, a) (UDIV_UP(n, a) * a)
 
+#define CACHE_LINE_SIZE 64
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
 EXPORT
 struct nvnc_buffer* nvnc_buffer_new(size_t size)
 {
@@ -42,7 +48,7 @@ struct nvnc_buffer* nvnc_buffer_new(size_t size)
 	buffer->ref = 1;
 	buffer->type = NVNC_BUFFER_SIMPLE;
 
-	size_t alignment = MAX(4, sizeof(void*));
+	size_t alignment = CACHE_LINE_SIZE;
 	size_t aligned_size = ALIGN_UP(size, alignment);
 
 	buffer->addr = aligned_alloc(alignment, aligned_size);
@@ -54,6 +60,101 @@ struct nvnc_buffer* nvnc_buffer_new(size_t size)
 	return buffer;
 }
 
+static void* map_anonymous(size_t size, int flags)
+{
+	void* addr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0);
+	return addr != MAP_FAILED ? addr : NULL;
+}
+
+/* Transparent huge pages can only back the parts of a mapping that are
+ * aligned to a huge page, so a larger area is mapped and then trimmed.
+ */
+static void* map_huge_page_aligned(size_t size)
+{
+	size_t padded_size = size + HUGE_PAGE_SIZE;
+	uint8_t* addr = map_anonymous(padded_size, 0);
+	if (!addr)
+		return NULL;
+
+	uintptr_t start = ALIGN_UP((uintptr_t)addr, HUGE_PAGE_SIZE);
+	size_t head = start - (uintptr_t)addr;
+	size_t tail = padded_size - head - size;
+
+	if (head)
+		munmap(addr, head);
+	if (tail)
+		munmap((uint8_t*)start + size, tail);
+
+	return (void*)start;
+}
+
+static void prefault(void* addr, size_t size)
+{
+#ifdef MADV_POPULATE_WRITE
+	if (madvise(addr, size, MADV_POPULATE_WRITE) == 0)
+		return;
+#endif
+
+	volatile uint8_t* bytes = addr;
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	for (size_t i = 0; i < size; i += page_size)
+		bytes[i] = 0;
+}
+
+static void* map_buffer(size_t* size, enum nvnc_buffer_alloc_flags flags)
+{
+	void* addr = NULL;
+
+	// Rounding small buffers up to a whole huge page would waste memory
+	if ((flags & NVNC_BUFFER_ALLOC_HUGEPAGES) && *size >= HUGE_PAGE_SIZE) {
+		*size = ALIGN_UP(*size, HUGE_PAGE_SIZE);
+#ifdef MAP_HUGETLB
+		// This only succeeds if huge pages have been reserved
+		addr = map_anonymous(*size, MAP_HUGETLB);
+#endif
+		if (!addr) {
+			addr = map_huge_page_aligned(*size);
+#ifdef MADV_HUGEPAGE
+			if (addr)
+				madvise(addr, *size, MADV_HUGEPAGE);
+#endif
+		}
+	} else {
+		*size = ALIGN_UP(*size, (size_t)sysconf(_SC_PAGESIZE));
+		addr = map_anonymous(*size, 0);
+	}
+
+	if (addr && (flags & NVNC_BUFFER_ALLOC_PREFAULT))
+		prefault(addr, *size);
+
+	return addr;
+}
+
+EXPORT
+struct nvnc_buffer* nvnc_buffer_new_with_flags(size_t size,
+		enum nvnc_buffer_alloc_flags flags)
+{
+	if (!flags)
+		return nvnc_buffer_new(size);
+
+	struct nvnc_buffer* buffer = calloc(1, sizeof(*buffer));
+	if (!buffer)
+		return NULL;
+
+	buffer->ref = 1;
+	buffer->type = NVNC_BUFFER_SIMPLE;
+
+	buffer->mapped_size = size;
+	buffer->addr = map_buffer(&buffer->mapped_size, flags);
+	if (!buffer->addr) {
+		free(buffer);
+		return NULL;
+	}
+
+	return buffer;
+}
+
 EXPORT
 struct nvnc_buffer* nvnc_buffer_from_addr(void* addr)
 {
@@ -101,7 +202,10 @@ static void nvnc__buffer_free_internal(struct nvnc_buffer* buffer)
 	case NVNC_BUFFER_UNSPEC:
 		abort();
 	case NVNC_BUFFER_SIMPLE:
-		free(buffer->addr);
+		if (buffer->mapped_size)
+			munmap(buffer->addr, buffer->mapped_size);
+		else
+			free(buffer->addr);
 		break;
 	case NVNC_BUFFER_GBM_BO:
 #ifdef HAVE_GBM
@@ -121,14 +225,8 @@ void nvnc_buffer_unref(struct nvnc_buffer* buffer)
 
 	nvnc_buffer_unmap(buffer);
 
-	struct nvnc_buffer_pool* pool =
-		WEAKREF_CAST(buffer->pool, struct nvnc_buffer_pool, weakref);
-	if (pool) {
-		weakref_observer_deinit(&buffer->pool);
-		buffer->ref = 1;
-		TAILQ_INSERT_TAIL(&pool->buffers, buffer, link);
+	if (nvnc_buffer_pool__recycle(buffer))
 		return;
-	}
 
 	if (!buffer->is_external)
 		nvnc__buffer_free_internal(buffer);
@@ -18,16 +18,25 @@
 #include "neatvnc.h"
 #include "frame.h"
 #include "transform-util.h"
+#include "transform-copy.h"
+#include "downscale.h"
 #include "region.h"
 #include "pixels.h"
 #include "usdt.h"
+#include "executor.h"
 
 #include <stdlib.h>
+#include <string.h>
 #include <aml.h>
 #include <pixman.h>
 #include <assert.h>
 #include <libdrm/drm_fourcc.h>
-#include <pthread.h>
+#include <sys/queue.h>
+#include <sys/param.h>
+
+#define MAX_BANDS 16
+#define MIN_BAND_HEIGHT 64
+#define FILTER_SUBSAMPLE_BITS 4
 
 struct fb_side_data {
 	struct pixman_region16 buffer_damage;
@@ -36,23 +45,64 @@ struct fb_side_data {
 
 LIST_HEAD(fb_side_data_list, fb_side_data);
 
-struct compositor {
-	struct nvnc_frame_pool* pool;
-	struct fb_side_data_list fb_side_data_list;
-	uint32_t seq_head, seq_tail;
-	pthread_mutex_t mutex;
-	pthread_cond_t cond;
-	bool is_being_destroyed;
+/* Somebody who wants the result of a compositing job, along with their own
+ * frame damage.
+ */
+struct compositor_waiter {
+	struct pixman_region16 frame_damage;
+	struct nvnc_frame_metadata* metadata;
+	compositor_fn on_done;
+	void* userdata;
+	TAILQ_ENTRY(compositor_waiter) link;
 };
 
+TAILQ_HEAD(compositor_waiter_list, compositor_waiter);
+
+/* A job is split into horizontal bands that are composited concurrently. The
+ * job is finished when its last band is done, and finished jobs are handed
+ * out in the order in which they were fed.
+ */
 struct compositor_work {
 	struct compositor* compositor;
-	struct pixman_region16 frame_damage;
+	struct pixman_region16 buffer_damage;
 	struct nvnc_composite_fb src;
 	struct nvnc_frame* dst;
 	uint32_t seq;
-	compositor_fn on_done;
-	void* userdata;
+	uint32_t generation;
+	int n_pending_bands;
+	struct compositor_waiter_list waiters;
+	TAILQ_ENTRY(compositor_work) link;
+};
+
+TAILQ_HEAD(compositor_work_list, compositor_work);
+
+struct compositor_band {
+	struct compositor_work* job;
+	struct pixman_region16 damage;
+};
+
+struct compositor {
+	struct executor* executor;
+	struct aml* loop;
+	struct nvnc_frame_pool* pool;
+	struct fb_side_data_list fb_side_data_list;
+	uint32_t seq;
+	bool is_being_destroyed;
+
+	// Output is this much smaller than the source
+	double scale;
+
+	/* The generation is bumped whenever the source is damaged. The output
+	 * of the latest job is kept around and handed out to everyone who asks
+	 * for the same generation of the same source frames.
+	 */
+	uint32_t generation;
+	struct compositor_work_list jobs;
+	struct {
+		struct nvnc_composite_fb src;
+		struct nvnc_frame* frame;
+		uint32_t generation;
+	} output;
 };
 
 static void fb_side_data_destroy(void* userdata)
@@ -72,54 +122,235 @@ static void compositor_damage_all_buffers(struct compositor* self,
 				region);
 }
 
-static void compositor_work_free(void* userdata)
+static struct compositor_waiter* compositor_waiter_new(
+		const struct nvnc_composite_fb* cfb,
+		struct pixman_region16* damage, compositor_fn on_done,
+		void* userdata)
 {
-	struct compositor_work* work = userdata;
+	struct compositor_waiter* self = calloc(1, sizeof(*self));
+	if (!self)
+		return NULL;
+
+	pixman_region_init(&self->frame_damage);
+	pixman_region_copy(&self->frame_damage, damage);
+
+	self->metadata = cfb->metadata;
+	if (self->metadata)
+		nvnc_frame_metadata_ref(self->metadata);
+
+	self->on_done = on_done;
+	self->userdata = userdata;
+
+	return self;
+}
+
+static void compositor_waiter_free(struct compositor_waiter* self)
+{
+	nvnc_frame_metadata_unref(self->metadata);
+	pixman_region_fini(&self->frame_damage);
+	free(self);
+}
+
+static void compositor_work_free(struct compositor_work* work)
+{
+	while (!TAILQ_EMPTY(&work->waiters)) {
+		struct compositor_waiter* waiter = TAILQ_FIRST(&work->waiters);
+		TAILQ_REMOVE(&work->waiters, waiter, link);
+		compositor_waiter_free(waiter);
+	}
 
 	nvnc_composite_fb_unref(&work->src);
 
 	nvnc_frame_unref(work->dst);
 
-	pixman_region_fini(&work->frame_damage);
+	pixman_region_fini(&work->buffer_damage);
 
 	free(work);
 }
 
-struct compositor* compositor_create(void)
+static void compositor_release_output(struct compositor* self)
+{
+	if (!self->output.frame)
+		return;
+
+	nvnc_composite_fb_unref(&self->output.src);
+	nvnc_frame_unref(self->output.frame);
+	memset(&self->output, 0, sizeof(self->output));
+}
+
+struct compositor* compositor_create_scaled(struct executor* executor,
+		double scale)
 {
+	assert(scale > 0 && scale <= 1);
+
 	struct compositor* self = calloc(1, sizeof(*self));
 	if (!self)
 		return NULL;
 
+	self->executor = executor;
+	self->loop = executor_get_loop(executor);
+	self->scale = scale;
+
 	self->pool = nvnc_frame_pool_new(0, 0, DRM_FORMAT_INVALID, 0);
 	if (!self->pool) {
 		free(self);
 		return NULL;
 	}
 
-	LIST_INIT(&self->fb_side_data_list);
+	/* Composited frames are large and get written in full, so it is cheaper
+	 * to map them in one go, using huge pages where possible.
+	 */
+	nvnc_frame_pool_set_alloc_flags(self->pool,
+			NVNC_BUFFER_ALLOC_HUGEPAGES | NVNC_BUFFER_ALLOC_PREFAULT);
 
-	pthread_mutex_init(&self->mutex, NULL);
-	pthread_cond_init(&self->cond, NULL);
+	LIST_INIT(&self->fb_side_data_list);
+	TAILQ_INIT(&self->jobs);
 
 	return self;
 }
 
+struct compositor* compositor_create(struct executor* executor)
+{
+	return compositor_create_scaled(executor, 1.0);
+}
+
+bool compositor_is_idle(const struct compositor* self)
+{
+	return TAILQ_EMPTY(&self->jobs);
+}
+
 void compositor_destroy(struct compositor* self)
 {
 	self->is_being_destroyed = true;
 
-	while (self->seq_tail != self->seq_head) {
-		aml_poll(aml_get_default(), -1);
-		aml_dispatch(aml_get_default());
+	while (!TAILQ_EMPTY(&self->jobs)) {
+		aml_poll(self->loop, -1);
+		aml_dispatch(self->loop);
 	}
 
+	compositor_release_output(self);
 	nvnc_frame_pool_unref(self->pool);
 	free(self);
 }
 
-void composite_buffer_now(struct nvnc_frame* dst, struct nvnc_composite_fb* csrc,
-		struct pixman_region16* damage)
+/* Rotating and flipping without scaling is just moving pixels around, which
+ * can be done a lot faster than going through pixman's generic transform path.
+ */
+static bool is_direct_copy_possible(const struct nvnc_frame* dst,
+		const struct nvnc_frame* src, bool is_scaled)
+{
+	return !is_scaled && src->fourcc_format == dst->fourcc_format &&
+		nvnc_frame_get_pixel_size(src) == 4;
+}
+
+typedef void (*copy_box_fn)(struct nvnc_frame* dst, uint32_t* dst_origin,
+		struct nvnc_frame* src, const pixman_box16_t* box,
+		const void* userdata);
+
+/* Calls fn for each damaged box within the destination rectangle. The boxes
+ * are relative to dst_origin, which is at (x_off, y_off) in dst.
+ */
+static void copy_damaged_boxes(struct nvnc_frame* dst, struct nvnc_frame* src,
+		struct pixman_region16* damage, int x_off, int y_off,
+		uint32_t width, uint32_t height, copy_box_fn fn,
+		const void* userdata)
+{
+	struct pixman_region16 region;
+	pixman_region_init_rect(&region, x_off, y_off, width, height);
+	pixman_region_intersect_rect(&region, &region, 0, 0, dst->width,
+			dst->height);
+	if (damage)
+		pixman_region_intersect(&region, &region, damage);
+
+	uint32_t* dst_origin = (uint32_t*)dst->buffer->addr +
+		y_off * dst->stride + x_off;
+
+	int n_boxes = 0;
+	pixman_box16_t* boxes = pixman_region_rectangles(&region, &n_boxes);
+	for (int i = 0; i < n_boxes; ++i) {
+		pixman_box16_t box = {
+			.x1 = boxes[i].x1 - x_off,
+			.y1 = boxes[i].y1 - y_off,
+			.x2 = boxes[i].x2 - x_off,
+			.y2 = boxes[i].y2 - y_off,
+		};
+		fn(dst, dst_origin, src, &box, userdata);
+	}
+
+	pixman_region_fini(&region);
+}
+
+static void copy_transformed_box(struct nvnc_frame* dst, uint32_t* dst_origin,
+		struct nvnc_frame* src, const pixman_box16_t* box,
+		const void* userdata)
+{
+	nvnc_transform_copy32(dst_origin, dst->stride, src->buffer->addr,
+			src->stride, src->width, src->height, src->transform,
+			box);
+}
+
+/* HiDPI outputs are commonly scaled down by 2:1, 3:2 or 4:3, and thumbnails
+ * by 4:1 or 8:1. Those can be done with a fixed set of taps per pixel instead
+ * of a generic filter.
+ */
+static bool is_fast_downscale_possible(const struct nvnc_frame* dst,
+		const struct nvnc_frame* src, uint32_t dst_width,
+		uint32_t dst_height, struct downscale_ratio* h_ratio,
+		struct downscale_ratio* v_ratio)
+{
+	return src->transform == NVNC_TRANSFORM_NORMAL &&
+		src->fourcc_format == dst->fourcc_format &&
+		downscale_is_supported_format(src->fourcc_format) &&
+		downscale_find_ratio(h_ratio, src->width, dst_width) &&
+		downscale_find_ratio(v_ratio, src->height, dst_height);
+}
+
+struct downscale_ratios {
+	struct downscale_ratio h, v;
+};
+
+static void copy_downscaled_box(struct nvnc_frame* dst, uint32_t* dst_origin,
+		struct nvnc_frame* src, const pixman_box16_t* box,
+		const void* userdata)
+{
+	const struct downscale_ratios* ratios = userdata;
+	downscale32(dst_origin, dst->stride, src->buffer->addr, src->stride,
+			ratios->h, ratios->v, box);
+}
+
+/* Bilinear filtering only samples the 2x2 nearest source pixels, so it aliases
+ * when scaling down by more than 2:1. A box filter averages all the source
+ * pixels that each destination pixel covers instead. The scales are in source
+ * pixels per destination pixel, along the axes of the source image.
+ */
+static void set_scaling_filter(pixman_image_t* img, double horiz_scale,
+		double vert_scale)
+{
+	if (horiz_scale <= 1.0 || vert_scale <= 1.0) {
+		pixman_image_set_filter(img, PIXMAN_FILTER_BILINEAR, NULL, 0);
+		return;
+	}
+
+	int n_params = 0;
+	pixman_fixed_t* params = pixman_filter_create_separable_convolution(
+			&n_params, pixman_double_to_fixed(horiz_scale),
+			pixman_double_to_fixed(vert_scale),
+			PIXMAN_KERNEL_BOX, PIXMAN_KERNEL_BOX,
+			PIXMAN_KERNEL_BOX, PIXMAN_KERNEL_BOX,
+			FILTER_SUBSAMPLE_BITS, FILTER_SUBSAMPLE_BITS);
+	if (!params) {
+		pixman_image_set_filter(img, PIXMAN_FILTER_BILINEAR, NULL, 0);
+		return;
+	}
+
+	pixman_image_set_filter(img, PIXMAN_FILTER_SEPARABLE_CONVOLUTION,
+			params, n_params);
+	free(params);
+}
+
+static void composite_buffer(struct nvnc_frame* dst,
+		struct nvnc_composite_fb* csrc, struct pixman_region16* damage,
+		double scale)
 {
 	assert(dst->transform == NVNC_TRANSFORM_NORMAL);
 
@@ -140,14 +371,6 @@ void composite_buffer_now(struct nvnc_frame* dst, struct nvnc_composite_fb* csrc
 		struct nvnc_frame* src = csrc->fbs[i];
 		assert(src);
 
-		pixman_format_code_t src_fmt = 0;
-		ok = fourcc_to_pixman_fmt(&src_fmt, src->fourcc_format);
-		assert(ok);
-
-		pixman_image_t* srcimg = pixman_image_create_bits_no_clear(
-				src_fmt, src->width, src->height, src->buffer->addr,
-				nvnc_frame_get_pixel_size(src) * src->stride);
-
 		uint32_t transformed_width, transformed_height;
 		transformed_width = src->width;
 		transformed_height = src->height;
@@ -164,6 +387,44 @@ void composite_buffer_now(struct nvnc_frame* dst, struct nvnc_composite_fb* csrc
 			src_height = transformed_height;
 		}
 
+		int x_off = src->x_off;
+		int y_off = src->y_off;
+		if (scale != 1.0) {
+			x_off = nvnc_scale_coordinate(src->x_off, scale);
+			y_off = nvnc_scale_coordinate(src->y_off, scale);
+			src_width = nvnc_scale_coordinate(src->x_off + src_width,
+					scale) - x_off;
+			src_height = nvnc_scale_coordinate(src->y_off + src_height,
+					scale) - y_off;
+		}
+
+		bool is_scaled = src_width != transformed_width ||
+			src_height != transformed_height;
+
+		if (is_direct_copy_possible(dst, src, is_scaled)) {
+			copy_damaged_boxes(dst, src, damage, x_off, y_off,
+					transformed_width, transformed_height,
+					copy_transformed_box, NULL);
+			continue;
+		}
+
+		struct downscale_ratios ratios;
+		if (is_fast_downscale_possible(dst, src, src_width, src_height,
+					&ratios.h, &ratios.v)) {
+			copy_damaged_boxes(dst, src, damage, x_off, y_off,
+					src_width, src_height,
+					copy_downscaled_box, &ratios);
+			continue;
+		}
+
+		pixman_format_code_t src_fmt = 0;
+		ok = fourcc_to_pixman_fmt(&src_fmt, src->fourcc_format);
+		assert(ok);
+
+		pixman_image_t* srcimg = pixman_image_create_bits_no_clear(
+				src_fmt, src->width, src->height, src->buffer->addr,
+				nvnc_frame_get_pixel_size(src) * src->stride);
+
 		double horiz_scale = transformed_width / (double)src_width;
 		double vert_scale = transformed_height / (double)src_height;
 
@@ -180,17 +441,17 @@ void composite_buffer_now(struct nvnc_frame* dst, struct nvnc_composite_fb* csrc
 
 		pixman_transform_multiply(&pxform, &rotation, &pxform);
 
-		if (src_width != transformed_width ||
-				src_height != transformed_height)
-			pixman_image_set_filter(srcimg, PIXMAN_FILTER_BILINEAR,
-					NULL, 0);
+		if (is_scaled && nvnc_is_transform_90_degrees(src->transform))
+			set_scaling_filter(srcimg, vert_scale, horiz_scale);
+		else if (is_scaled)
+			set_scaling_filter(srcimg, horiz_scale, vert_scale);
 
 		pixman_image_set_transform(srcimg, &pxform);
 
 		pixman_image_composite(PIXMAN_OP_SRC, srcimg, NULL, dstimg,
 				0, 0,
 				0, 0,
-				src->x_off, src->y_off,
+				x_off, y_off,
 				src_width, src_height);
 
 		pixman_image_unref(srcimg);
@@ -199,54 +460,126 @@ void composite_buffer_now(struct nvnc_frame* dst, struct nvnc_composite_fb* csrc
 	pixman_image_unref(dstimg);
 }
 
-static void do_work(struct aml_work* work)
+void composite_buffer_now(struct nvnc_frame* dst, struct nvnc_composite_fb* csrc,
+		struct pixman_region16* damage)
+{
+	composite_buffer(dst, csrc, damage, 1.0);
+}
+
+static void compositor_finish_job(struct compositor* compositor,
+		struct compositor_work* ctx)
 {
-	struct compositor_work* ctx = aml_get_userdata(work);
+	nvnc_trace("Compositor job done, seq=%u", ctx->seq);
 
-	struct nvnc_composite_fb* csrc = &ctx->src;
-	struct nvnc_frame* dst = ctx->dst;
-	struct fb_side_data* dst_side_data = nvnc_frame_get_userdata(dst);
+	if (compositor->is_being_destroyed)
+		return;
 
-	/* Side data contains the union of the buffer damage and the
-	 * frame damage.
-	 */
-	struct pixman_region16* damage = &dst_side_data->buffer_damage;
+	// Jobs finish in order, so this is always the newest output
+	compositor_release_output(compositor);
+	nvnc_composite_fb_copy(&compositor->output.src, &ctx->src);
+	compositor->output.frame = ctx->dst;
+	nvnc_frame_ref(ctx->dst);
+	compositor->output.generation = ctx->generation;
+
+	while (!TAILQ_EMPTY(&ctx->waiters)) {
+		struct compositor_waiter* waiter = TAILQ_FIRST(&ctx->waiters);
+		TAILQ_REMOVE(&ctx->waiters, waiter, link);
 
-	composite_buffer_now(dst, csrc, damage);
+		struct nvnc_composite_fb cfb;
+		struct nvnc_frame *fbs[] = { ctx->dst, NULL };
+		nvnc_composite_fb_init(&cfb, fbs);
+		cfb.metadata = waiter->metadata;
 
-	// Block the thread until previous jobs have completed
-	struct compositor* compositor = ctx->compositor;
-	pthread_mutex_lock(&compositor->mutex);
-	while (compositor->seq_tail + 1 != ctx->seq)
-		pthread_cond_wait(&compositor->cond, &compositor->mutex);
-	pthread_mutex_unlock(&compositor->mutex);
+		waiter->on_done(&cfb, &waiter->frame_damage, waiter->userdata);
+		compositor_waiter_free(waiter);
+	}
 }
 
-static void on_work_done(struct aml_work* work)
+static void compositor_process_finished_jobs(struct compositor* self)
 {
-	struct compositor_work* ctx = aml_get_userdata(work);
-	struct compositor* compositor = ctx->compositor;
+	while (!TAILQ_EMPTY(&self->jobs)) {
+		struct compositor_work* ctx = TAILQ_FIRST(&self->jobs);
+		if (ctx->n_pending_bands != 0)
+			break;
 
-	// Advertise to subsequent tasks that they may continue
-	pthread_mutex_lock(&compositor->mutex);
-	assert(compositor->seq_tail + 1 == ctx->seq);
-	compositor->seq_tail = ctx->seq;
-	pthread_cond_broadcast(&compositor->cond);
-	pthread_mutex_unlock(&compositor->mutex);
+		TAILQ_REMOVE(&self->jobs, ctx, link);
+		compositor_finish_job(self, ctx);
+		compositor_work_free(ctx);
+	}
+}
 
-	struct fb_side_data* fb_side_data = nvnc_frame_get_userdata(ctx->dst);
-	assert(fb_side_data);
-	LIST_INSERT_HEAD(&compositor->fb_side_data_list, fb_side_data, link);
+static void compositor_band_free(struct compositor_band* band)
+{
+	pixman_region_fini(&band->damage);
+	free(band);
+}
 
-	struct nvnc_composite_fb cfb;
-	struct nvnc_frame *fbs[] = { ctx->dst, NULL };
-	nvnc_composite_fb_init(&cfb, fbs);
-	cfb.metadata = ctx->src.metadata;
+static void do_band(void* userdata)
+{
+	struct compositor_band* band = userdata;
+	struct compositor_work* ctx = band->job;
 
-	nvnc_trace("Compositor job done, seq=%u", ctx->seq);
+	composite_buffer(ctx->dst, &ctx->src, &band->damage,
+			ctx->compositor->scale);
+}
+
+static void on_band_done(void* userdata)
+{
+	struct compositor_band* band = userdata;
+	struct compositor_work* ctx = band->job;
+
+	assert(ctx->n_pending_bands > 0);
+	if (--ctx->n_pending_bands == 0)
+		compositor_process_finished_jobs(ctx->compositor);
 
-	if (!compositor->is_being_destroyed)
-		ctx->on_done(&cfb, &ctx->frame_damage, ctx->userdata);
+	compositor_band_free(band);
+}
+
+static void compositor_start_band(struct compositor_work* ctx,
+		struct pixman_region16* damage)
+{
+	struct compositor_band* band = calloc(1, sizeof(*band));
+	if (!band)
+		goto failure;
+
+	band->job = ctx;
+	pixman_region_init(&band->damage);
+	pixman_region_copy(&band->damage, damage);
+
+	ctx->n_pending_bands++;
+	if (executor_submit(ctx->compositor->executor, EXECUTOR_STAGE_COMPOSITE,
+				do_band, on_band_done, band) < 0) {
+		ctx->n_pending_bands--;
+		compositor_band_free(band);
+		goto failure;
+	}
+
+	return;
+
+failure:
+	// Do it right here, rather than not at all
+	composite_buffer(ctx->dst, &ctx->src, damage, ctx->compositor->scale);
+}
+
+static void compositor_start_bands(struct compositor_work* ctx)
+{
+	uint32_t width = ctx->dst->width;
+	uint32_t height = ctx->dst->height;
+
+	int n_bands = MIN(MAX_BANDS, howmany(height, MIN_BAND_HEIGHT));
+	uint32_t band_height = howmany(height, MAX(n_bands, 1));
+
+	struct pixman_region16 band_damage;
+	pixman_region_init(&band_damage);
+
+	for (uint32_t y = 0; y < height; y += band_height) {
+		pixman_region_intersect_rect(&band_damage, &ctx->buffer_damage,
+				0, y, width, MIN(band_height, height - y));
+		if (pixman_region_not_empty(&band_damage))
+			compositor_start_band(ctx, &band_damage);
+	}
+
+	pixman_region_fini(&band_damage);
 }
 
 static void get_fb_dimensions(struct nvnc_frame* fb, uint32_t* width,
@@ -306,6 +639,67 @@ static bool is_compositing_needed(const struct nvnc_composite_fb* cfb)
 	return have_any_scaling(cfb) || !are_all_transforms_normal(cfb);
 }
 
+static bool is_same_source(const struct nvnc_composite_fb* a,
+		const struct nvnc_composite_fb* b)
+{
+	if (a->n_fbs != b->n_fbs)
+		return false;
+
+	for (int i = 0; i < a->n_fbs; ++i)
+		if (a->fbs[i] != b->fbs[i])
+			return false;
+
+	return true;
+}
+
+static bool has_same_layout(const struct nvnc_composite_fb* a,
+		const struct nvnc_composite_fb* b)
+{
+	if (a->n_fbs != b->n_fbs)
+		return false;
+
+	for (int i = 0; i < a->n_fbs; ++i) {
+		const struct nvnc_frame* x = a->fbs[i];
+		const struct nvnc_frame* y = b->fbs[i];
+		if (x->x_off != y->x_off || x->y_off != y->y_off ||
+				x->width != y->width || x->height != y->height ||
+				x->logical_width != y->logical_width ||
+				x->logical_height != y->logical_height ||
+				x->transform != y->transform)
+			return false;
+	}
+
+	return true;
+}
+
+void compositor_damage(struct compositor* self,
+		struct pixman_region16* damage)
+{
+	self->generation++;
+
+	struct pixman_region16 scaled_damage;
+	pixman_region_init(&scaled_damage);
+	nvnc_region_scale(&scaled_damage, damage, self->scale, self->scale);
+	compositor_damage_all_buffers(self, &scaled_damage);
+	pixman_region_fini(&scaled_damage);
+}
+
+void compositor_cancel(struct compositor* self, void* userdata)
+{
+	struct compositor_work* job;
+	TAILQ_FOREACH(job, &self->jobs, link) {
+		struct compositor_waiter* waiter;
+		struct compositor_waiter* tmp;
+		TAILQ_FOREACH_SAFE(waiter, &job->waiters, link, tmp) {
+			if (waiter->userdata != userdata)
+				continue;
+
+			TAILQ_REMOVE(&job->waiters, waiter, link);
+			compositor_waiter_free(waiter);
+		}
+	}
+}
+
 int compositor_feed(struct compositor* self, struct nvnc_composite_fb* cfb,
 		struct pixman_region16* damage, compositor_fn on_done,
 		void* userdata)
@@ -314,14 +708,45 @@ int compositor_feed(struct compositor* self, struct nvnc_composite_fb* cfb,
 
 	nvnc_assert(cfb->n_fbs != 0, "Composite fb contains no fbs");
 
-	if (self->seq_tail == self->seq_head && !is_compositing_needed(cfb)) {
+	if (TAILQ_EMPTY(&self->jobs) && self->scale == 1.0 &&
+			!is_compositing_needed(cfb)) {
 		nvnc_trace("Direct pass-through of %d framebuffers", cfb->n_fbs);
 		on_done(cfb, damage, userdata);
 		return 0;
 	}
 
-	uint32_t width = nvnc_composite_fb_width(cfb);
-	uint32_t height = nvnc_composite_fb_height(cfb);
+	if (self->output.frame && self->output.generation == self->generation &&
+			is_same_source(&self->output.src, cfb)) {
+		nvnc_trace("Reusing compositor output, generation=%u",
+				self->generation);
+
+		struct nvnc_composite_fb output;
+		struct nvnc_frame *fbs[] = { self->output.frame, NULL };
+		nvnc_composite_fb_init(&output, fbs);
+		output.metadata = cfb->metadata;
+
+		on_done(&output, damage, userdata);
+		return 0;
+	}
+
+	struct compositor_waiter* waiter = compositor_waiter_new(cfb, damage,
+			on_done, userdata);
+	if (!waiter)
+		return -1;
+
+	// Join the latest job if it's already compositing the same thing
+	struct compositor_work* latest =
+		TAILQ_LAST(&self->jobs, compositor_work_list);
+	if (latest && latest->generation == self->generation &&
+			is_same_source(&latest->src, cfb)) {
+		TAILQ_INSERT_TAIL(&latest->waiters, waiter, link);
+		return 0;
+	}
+
+	uint32_t width = nvnc_scale_coordinate(nvnc_composite_fb_width(cfb),
+			self->scale);
+	uint32_t height = nvnc_scale_coordinate(nvnc_composite_fb_height(cfb),
+			self->scale);
 
 	struct nvnc_frame* first_fb = cfb->fbs[0];
 	assert(first_fb);
@@ -329,15 +754,12 @@ int compositor_feed(struct compositor* self, struct nvnc_composite_fb* cfb,
 	nvnc_frame_pool_resize(self->pool, width, height, first_fb->fourcc_format,
 			width);
 
-	struct aml* aml = aml_get_default();
-	assert(aml);
-
 	struct compositor_work* ctx = calloc(1, sizeof(*ctx));
 	if (!ctx)
-		return -1;
+		goto ctx_failure;
 
-	pixman_region_init(&ctx->frame_damage);
-	pixman_region_copy(&ctx->frame_damage, damage);
+	pixman_region_init(&ctx->buffer_damage);
+	TAILQ_INIT(&ctx->waiters);
 
 	ctx->dst = nvnc_frame_pool_acquire(self->pool);
 	if (!ctx->dst)
@@ -357,34 +779,43 @@ int compositor_feed(struct compositor* self, struct nvnc_composite_fb* cfb,
 		LIST_INSERT_HEAD(&self->fb_side_data_list, fb_side_data, link);
 	}
 
-	compositor_damage_all_buffers(self, damage);
+	/* The job gets everything that has changed since this buffer was last
+	 * composited. Damage that arrives while the job is running is added to
+	 * the side data for the next time around.
+	 */
+	pixman_region_union(&ctx->buffer_damage, &fb_side_data->buffer_damage,
+			damage);
+	pixman_region_clear(&fb_side_data->buffer_damage);
 
-	// The side data entry is removed from the list when damaging is done
-	// and added back when the job is finished.
-	LIST_REMOVE(fb_side_data, link);
+	// Displays may have been moved, added or removed without any damage
+	const struct nvnc_composite_fb* prev_src =
+		latest ? &latest->src : &self->output.src;
+	if (!has_same_layout(prev_src, cfb))
+		pixman_region_union_rect(&ctx->buffer_damage,
+				&ctx->buffer_damage, 0, 0, width, height);
 
 	nvnc_composite_fb_copy(&ctx->src, cfb);
 
 	ctx->compositor = self;
-	ctx->on_done = on_done;
-	ctx->userdata = userdata;
-	ctx->seq = ++self->seq_head;
-
-	struct aml_work* work = aml_work_new(do_work, on_work_done, ctx,
-			compositor_work_free);
-	if (!work) {
-		compositor_work_free(ctx);
-		return -1;
-	}
+	ctx->generation = self->generation;
+	ctx->seq = ++self->seq;
+	TAILQ_INSERT_TAIL(&ctx->waiters, waiter, link);
+	TAILQ_INSERT_TAIL(&self->jobs, ctx, link);
 
 	nvnc_composite_fb_map(&ctx->src);
 
-	int rc = aml_start(aml, work);
-	aml_unref(work);
-	return rc;
+	compositor_start_bands(ctx);
+
+	// If all bands were done synchronously or there was nothing to do
+	compositor_process_finished_jobs(self);
+	return 0;
 
 side_data_failure:
+	nvnc_frame_unref(ctx->dst);
 acquire_failure:
+	pixman_region_fini(&ctx->buffer_damage);
 	free(ctx);
+ctx_failure:
+	compositor_waiter_free(waiter);
 	return -1;
 }
@@ -20,6 +20,7 @@
 #include "neatvnc.h"
 
 #include <stdlib.h>
+#include <string.h>
 #include <nettle/aes.h>
 #include <nettle/eax.h>
 
@@ -34,6 +35,8 @@ struct crypto_aes256_eax {
 };
 
 struct crypto_cipher {
+	enum crypto_cipher_type type;
+
 	union {
 		struct aes128_ctx aes128_ecb;
 		struct crypto_aes_eax aes_eax;
@@ -52,8 +55,23 @@ struct crypto_cipher {
 	ssize_t (*decrypt)(struct crypto_cipher*, uint8_t* dst, uint8_t* mac,
 			const uint8_t* src, size_t src_len, const uint8_t* ad,
 			size_t ad_len);
+	bool (*encrypt_message)(const struct crypto_cipher*, uint64_t index,
+			uint8_t* dst, uint8_t* mac, const uint8_t* src,
+			size_t src_len, const uint8_t* ad, size_t ad_len);
 };
 
+/* Message indices only cover the low half of the 128 bit nonce counter. The
+ * high half would only be reached after 2^64 messages.
+ */
+static void crypto_eax_message_nonce(uint8_t* nonce, uint64_t index)
+{
+	uint64_t c[2] = { index, 0 };
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+	c[0] = __builtin_bswap64(c[0]);
+#endif
+	memcpy(nonce, c, sizeof(c));
+}
+
 static bool crypto_cipher_aes128_ecb_encrypt(struct crypto_cipher* self,
 		struct vec* dst, uint8_t* mac, const uint8_t* src,
 		size_t len, const uint8_t* ad, size_t ad_len)
@@ -72,6 +90,15 @@ static ssize_t crypto_cipher_aes128_ecb_decrypt(struct crypto_cipher* self,
 	return len;
 }
 
+static bool crypto_cipher_aes128_ecb_encrypt_message(
+		const struct crypto_cipher* self, uint64_t index, uint8_t* dst,
+		uint8_t* mac, const uint8_t* src, size_t len, const uint8_t* ad,
+		size_t ad_len)
+{
+	aes128_encrypt(&self->enc_ctx.aes128_ecb, len, dst, src);
+	return true;
+}
+
 static struct crypto_cipher* crypto_cipher_new_aes128_ecb(
 		const uint8_t* enc_key, const uint8_t* dec_key)
 {
@@ -87,6 +114,7 @@ static struct crypto_cipher* crypto_cipher_new_aes128_ecb(
 
 	self->encrypt = crypto_cipher_aes128_ecb_encrypt;
 	self->decrypt = crypto_cipher_aes128_ecb_decrypt;
+	self->encrypt_message = crypto_cipher_aes128_ecb_encrypt_message;
 
 	return self;
 }
@@ -135,6 +163,24 @@ static ssize_t crypto_cipher_aes_eax_decrypt(struct crypto_cipher* self,
 	return len;
 }
 
+static bool crypto_cipher_aes_eax_encrypt_message(
+		const struct crypto_cipher* self, uint64_t index, uint8_t* dst,
+		uint8_t* mac, const uint8_t* src, size_t src_len,
+		const uint8_t* ad, size_t ad_len)
+{
+	struct eax_aes128_ctx ctx = self->enc_ctx.aes_eax.ctx;
+
+	uint8_t nonce[16];
+	crypto_eax_message_nonce(nonce, index);
+
+	nettle_eax_aes128_set_nonce(&ctx, sizeof(nonce), nonce);
+	nettle_eax_aes128_update(&ctx, ad_len, ad);
+	nettle_eax_aes128_encrypt(&ctx, src_len, dst, src);
+	nettle_eax_aes128_digest(&ctx, mac);
+
+	return true;
+}
+
 static struct crypto_cipher* crypto_cipher_new_aes_eax(const uint8_t* enc_key,
 		const uint8_t* dec_key)
 {
@@ -147,6 +193,7 @@ static struct crypto_cipher* crypto_cipher_new_aes_eax(const uint8_t* enc_key,
 
 	self->encrypt = crypto_cipher_aes_eax_encrypt;
 	self->decrypt = crypto_cipher_aes_eax_decrypt;
+	self->encrypt_message = crypto_cipher_aes_eax_encrypt_message;
 
 	return self;
 }
@@ -195,6 +242,25 @@ static ssize_t crypto_cipher_aes256_eax_decrypt(struct crypto_cipher* self,
 	return len;
 }
 
+static bool crypto_cipher_aes256_eax_encrypt_message(
+		const struct crypto_cipher* self, uint64_t index, uint8_t* dst,
+		uint8_t* mac, const uint8_t* src, size_t src_len,
+		const uint8_t* ad, size_t ad_len)
+{
+	struct crypto_aes256_eax eax;
+	memcpy(&eax.ctx, &self->enc_ctx.aes256_eax.ctx, sizeof(eax.ctx));
+
+	uint8_t nonce[16];
+	crypto_eax_message_nonce(nonce, index);
+
+	EAX_SET_NONCE(&eax.ctx, aes256_encrypt, sizeof(nonce), nonce);
+	EAX_UPDATE(&eax.ctx, aes256_encrypt, ad_len, ad);
+	EAX_ENCRYPT(&eax.ctx, aes256_encrypt, src_len, dst, src);
+	EAX_DIGEST(&eax.ctx, aes256_encrypt, mac);
+
+	return true;
+}
+
 static struct crypto_cipher* crypto_cipher_new_aes256_eax(const uint8_t* enc_key,
 		const uint8_t* dec_key)
 {
@@ -209,6 +275,7 @@ static struct crypto_cipher* crypto_cipher_new_aes256_eax(const uint8_t* enc_key
 
 	self->encrypt = crypto_cipher_aes256_eax_encrypt;
 	self->decrypt = crypto_cipher_aes256_eax_decrypt;
+	self->encrypt_message = crypto_cipher_aes256_eax_encrypt_message;
 
 	return self;
 }
@@ -216,19 +283,27 @@ static struct crypto_cipher* crypto_cipher_new_aes256_eax(const uint8_t* enc_key
 struct crypto_cipher* crypto_cipher_new(const uint8_t* enc_key,
 		const uint8_t* dec_key, enum crypto_cipher_type type)
 {
+	struct crypto_cipher* self = NULL;
+
 	switch (type) {
 	case CRYPTO_CIPHER_AES128_ECB:
-		return crypto_cipher_new_aes128_ecb(enc_key, dec_key);
+		self = crypto_cipher_new_aes128_ecb(enc_key, dec_key);
+		break;
 	case CRYPTO_CIPHER_AES_EAX:
-		return crypto_cipher_new_aes_eax(enc_key, dec_key);
+		self = crypto_cipher_new_aes_eax(enc_key, dec_key);
+		break;
 	case CRYPTO_CIPHER_AES256_EAX:
-		return crypto_cipher_new_aes256_eax(enc_key, dec_key);
-	case CRYPTO_CIPHER_INVALID:
+		self = crypto_cipher_new_aes256_eax(enc_key, dec_key);
 		break;
+	case CRYPTO_CIPHER_INVALID:
+		nvnc_log(NVNC_LOG_PANIC, "Invalid type: %d", type);
+		return NULL;
 	}
 
-	nvnc_log(NVNC_LOG_PANIC, "Invalid type: %d", type);
-	return NULL;
+	if (self)
+		self->type = type;
+
+	return self;
 }
 
 void crypto_cipher_del(struct crypto_cipher* self)
@@ -249,3 +324,34 @@ ssize_t crypto_cipher_decrypt(struct crypto_cipher* self, uint8_t* dst,
 {
 	return self->decrypt(self, dst, mac, src, src_len, ad, ad_len);
 }
+
+uint64_t crypto_cipher_reserve_messages(struct crypto_cipher* self, size_t n)
+{
+	uint64_t* count;
+
+	switch (self->type) {
+	case CRYPTO_CIPHER_AES_EAX:
+		count = self->enc_ctx.aes_eax.count;
+		break;
+	case CRYPTO_CIPHER_AES256_EAX:
+		count = self->enc_ctx.aes256_eax.count;
+		break;
+	default:
+		return 0;
+	}
+
+	uint64_t first = count[0];
+	count[0] += n;
+	if (count[0] < first)
+		++count[1];
+
+	return first;
+}
+
+bool crypto_cipher_encrypt_message(const struct crypto_cipher* self,
+		uint64_t index, uint8_t* dst, uint8_t* mac, const uint8_t* src,
+		size_t src_len, const uint8_t* ad, size_t ad_len)
+{
+	return self->encrypt_message(self, index, dst, mac, src, src_len, ad,
+			ad_len);
+}
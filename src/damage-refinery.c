@@ -72,29 +72,45 @@ void damage_refinery_destroy(struct damage_refinery* self)
 	free(self->hashes);
 }
 
-static uint32_t damage_hash_tile(struct damage_refinery* self, uint32_t tx,
-		uint32_t ty, const struct nvnc_frame* buffer)
+static void hash_rect(XXH3_state_t* state, const struct nvnc_frame* buffer,
+		uint32_t x, uint32_t y, uint32_t width, uint32_t height)
 {
 	uint8_t* pixels = buffer->buffer->addr;
 	int bpp = nvnc__pixel_size_from_fourcc(buffer->fourcc_format);
 	int byte_stride = buffer->stride * bpp;
 
-	int x_start = tx * 32;
-	int x_stop = MIN((tx + 1) * 32, self->width);
-	int y_start = ty * 32;
-	int y_stop = MIN((ty + 1) * 32, self->height);
+	int32_t xoff = x * bpp;
 
-	int32_t xoff = x_start * bpp;
-
-	XXH3_64bits_reset(self->state);
-	for (int y = y_start; y < y_stop; ++y) {
-		XXH3_64bits_update(self->state, pixels + xoff + y * byte_stride,
-				bpp * (x_stop - x_start));
+	for (uint32_t row = y; row < y + height; ++row) {
+		XXH3_64bits_update(state, pixels + xoff + row * byte_stride,
+				bpp * width);
 	}
+}
 
+static uint32_t damage_hash_tile(struct damage_refinery* self, uint32_t tx,
+		uint32_t ty, const struct nvnc_frame* buffer)
+{
+	uint32_t x_start = tx * 32;
+	uint32_t x_stop = MIN((tx + 1) * 32, self->width);
+	uint32_t y_start = ty * 32;
+	uint32_t y_stop = MIN((ty + 1) * 32, self->height);
+
+	XXH3_64bits_reset(self->state);
+	hash_rect(self->state, buffer, x_start, y_start, x_stop - x_start,
+			y_stop - y_start);
 	return XXH3_64bits_digest(self->state);
 }
 
+uint64_t damage_hash_rect(const struct nvnc_frame* buffer, uint32_t x,
+		uint32_t y, uint32_t width, uint32_t height, uint64_t seed)
+{
+	XXH3_state_t state;
+	XXH3_INITSTATE(&state);
+	XXH3_64bits_reset_withSeed(&state, seed);
+	hash_rect(&state, buffer, x, y, width, height);
+	return XXH3_64bits_digest(&state);
+}
+
 static uint32_t* damage_tile_hash_ptr(struct damage_refinery* self,
 		uint32_t tx, uint32_t ty)
 {
@@ -25,10 +25,85 @@
 
 #include <assert.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
 #include <pixman.h>
+#include <aml.h>
 
 #define EXPORT __attribute__((visibility("default")))
 
+static void nvnc_display__feed(struct nvnc_display* self, struct nvnc_frame* fb,
+		struct pixman_region16* damage);
+
+static void nvnc_display__free_submission(
+		struct nvnc_display_submission* submission)
+{
+	if (!submission)
+		return;
+
+	pixman_region_fini(&submission->damage);
+	nvnc_frame_unref(submission->fb);
+	free(submission);
+}
+
+static void nvnc_display__on_wakeup(struct aml_handler* handler)
+{
+	struct nvnc_display* self = aml_get_userdata(handler);
+
+	char buf[64];
+	while (read(self->wakeup_fds[0], buf, sizeof(buf)) > 0);
+
+	// Cleared first so that frames submitted from now on wake us up again
+	atomic_store(&self->is_wakeup_pending, false);
+
+	struct nvnc_display_submission* submission =
+		atomic_exchange(&self->mailbox, NULL);
+	if (!submission)
+		return;
+
+	nvnc_display__feed(self, submission->fb, &submission->damage);
+	nvnc_display__free_submission(submission);
+}
+
+static int nvnc_display__init_mailbox(struct nvnc_display* self)
+{
+	if (pipe2(self->wakeup_fds, O_CLOEXEC | O_NONBLOCK) < 0)
+		return -1;
+
+	self->wakeup_handler = aml_handler_new(self->wakeup_fds[0],
+			nvnc_display__on_wakeup, self, NULL);
+	if (!self->wakeup_handler)
+		goto handler_failure;
+
+	return 0;
+
+handler_failure:
+	close(self->wakeup_fds[1]);
+	close(self->wakeup_fds[0]);
+	return -1;
+}
+
+static void nvnc_display__destroy_mailbox(struct nvnc_display* self)
+{
+	aml_unref(self->wakeup_handler);
+	close(self->wakeup_fds[1]);
+	close(self->wakeup_fds[0]);
+
+	nvnc_display__free_submission(atomic_exchange(&self->mailbox, NULL));
+}
+
+int nvnc_display__start_mailbox(struct nvnc_display* self)
+{
+	assert(self->server);
+	return aml_start(self->server->loop, self->wakeup_handler);
+}
+
+void nvnc_display__stop_mailbox(struct nvnc_display* self)
+{
+	assert(self->server);
+	aml_stop(self->server->loop, self->wakeup_handler);
+}
+
 EXPORT
 struct nvnc_display* nvnc_display_new(uint16_t x_pos, uint16_t y_pos)
 {
@@ -39,12 +114,17 @@ struct nvnc_display* nvnc_display_new(uint16_t x_pos, uint16_t y_pos)
 	if (damage_refinery_init(&self->damage_refinery, 0, 0) < 0)
 		goto refinery_failure;
 
+	if (nvnc_display__init_mailbox(self) < 0)
+		goto mailbox_failure;
+
 	self->ref = 1;
 	self->x_pos = x_pos;
 	self->y_pos = y_pos;
 
 	return self;
 
+mailbox_failure:
+	damage_refinery_destroy(&self->damage_refinery);
 refinery_failure:
 	free(self);
 
@@ -55,6 +135,7 @@ static void nvnc__display_free(struct nvnc_display* self)
 {
 	if (self->cleanup_fn)
 		self->cleanup_fn(self->userdata);
+	nvnc_display__destroy_mailbox(self);
 	if (self->buffer) {
 		nvnc_frame_unref(self->buffer);
 	}
@@ -100,15 +181,14 @@ struct nvnc* nvnc_display_get_server(const struct nvnc_display* self)
 	return self->server;
 }
 
-EXPORT
-void nvnc_display_feed_frame(struct nvnc_display* self, struct nvnc_frame* fb)
+static void nvnc_display__feed(struct nvnc_display* self, struct nvnc_frame* fb,
+		struct pixman_region16* damage)
 {
 	DTRACE_PROBE2(neatvnc, nvnc_display_feed_frame, self, fb->pts);
 
 	struct nvnc* server = self->server;
 	assert(server);
 
-	struct pixman_region16* damage = &fb->damage;
 	struct pixman_region16 refined_damage;
 	pixman_region_init(&refined_damage);
 
@@ -171,3 +251,54 @@ void nvnc_display_feed_frame(struct nvnc_display* self, struct nvnc_frame* fb)
 	nvnc__damage_region(self->server, &shifted_damage);
 	pixman_region_fini(&shifted_damage);
 }
+
+EXPORT
+void nvnc_display_feed_frame(struct nvnc_display* self, struct nvnc_frame* fb)
+{
+	nvnc_display__feed(self, fb, &fb->damage);
+}
+
+EXPORT
+void nvnc_display_submit_frame(struct nvnc_display* self,
+		struct nvnc_frame* fb)
+{
+	struct nvnc_display_submission* submission =
+		calloc(1, sizeof(*submission));
+	if (!submission) {
+		nvnc_log(NVNC_LOG_ERROR, "OOM");
+		return;
+	}
+
+	/* The frame may be submitted to displays on other servers at the same
+	 * time, so this display places its own view of it.
+	 */
+	submission->fb = nvnc_frame_new_view(fb);
+	if (!submission->fb) {
+		nvnc_log(NVNC_LOG_ERROR, "OOM");
+		free(submission);
+		return;
+	}
+
+	pixman_region_init(&submission->damage);
+	pixman_region_copy(&submission->damage, &fb->damage);
+
+	/* If the server's loop hasn't picked up the previous frame yet, it is
+	 * replaced, but its damage must still be accounted for.
+	 */
+	struct nvnc_display_submission* old =
+		atomic_exchange(&self->mailbox, NULL);
+	if (old) {
+		pixman_region_union(&submission->damage, &submission->damage,
+				&old->damage);
+		nvnc_display__free_submission(old);
+	}
+
+	old = atomic_exchange(&self->mailbox, submission);
+	assert(!old);
+
+	if (!atomic_exchange(&self->is_wakeup_pending, true)) {
+		char byte = 0;
+		ssize_t rc = write(self->wakeup_fds[1], &byte, 1);
+		(void)rc; // A full pipe means that a wakeup is on its way anyway
+	}
+}
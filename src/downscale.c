@@ -0,0 +1,149 @@
+/*
+ * Copyright (c) 2026 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "downscale.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <libdrm/drm_fourcc.h>
+
+#define MAX_TAPS 8
+#define MAX_PHASES 3
+
+static const struct downscale_ratio supported_ratios[] = {
+	{ 2, 1 },
+	{ 3, 2 },
+	{ 4, 3 },
+	{ 4, 1 },
+	{ 8, 1 },
+};
+
+/* Each destination pixel within a group of q pixels has a fixed set of
+ * source taps relative to the start of the group. Weights are in units of
+ * 1/q source pixels, so they add up to p.
+ */
+struct downscale_taps {
+	int n;
+	int offset[MAX_TAPS];
+	int weight[MAX_TAPS];
+};
+
+bool downscale_find_ratio(struct downscale_ratio* ratio, uint32_t src_size,
+		uint32_t dst_size)
+{
+	for (size_t i = 0; i < sizeof(supported_ratios) /
+			sizeof(supported_ratios[0]); ++i) {
+		const struct downscale_ratio* r = &supported_ratios[i];
+		if ((uint64_t)src_size * r->q == (uint64_t)dst_size * r->p) {
+			*ratio = *r;
+			return true;
+		}
+	}
+	return false;
+}
+
+bool downscale_is_supported_format(uint32_t fourcc)
+{
+	switch (fourcc) {
+	case DRM_FORMAT_XRGB8888:
+	case DRM_FORMAT_ARGB8888:
+	case DRM_FORMAT_XBGR8888:
+	case DRM_FORMAT_ABGR8888:
+	case DRM_FORMAT_RGBX8888:
+	case DRM_FORMAT_RGBA8888:
+	case DRM_FORMAT_BGRX8888:
+	case DRM_FORMAT_BGRA8888:
+		return true;
+	}
+	return false;
+}
+
+static void make_taps(struct downscale_taps taps[static MAX_PHASES],
+		struct downscale_ratio ratio)
+{
+	int p = ratio.p, q = ratio.q;
+
+	for (int i = 0; i < q; ++i) {
+		// The destination pixel covers [start, end) in 1/q units
+		int start = i * p;
+		int end = start + p;
+
+		struct downscale_taps* t = &taps[i];
+		t->n = 0;
+
+		for (int j = start / q; j * q < end; ++j) {
+			int lo = j * q > start ? j * q : start;
+			int hi = (j + 1) * q < end ? (j + 1) * q : end;
+
+			t->offset[t->n] = j;
+			t->weight[t->n] = hi - lo;
+			t->n++;
+		}
+	}
+}
+
+static inline uint32_t average_pixel(const uint32_t* src, int32_t stride,
+		const struct downscale_taps* h, const struct downscale_taps* v,
+		uint32_t recip)
+{
+	uint32_t sum[4] = {};
+
+	for (int ty = 0; ty < v->n; ++ty) {
+		const uint32_t* row = src + v->offset[ty] * stride;
+
+		for (int tx = 0; tx < h->n; ++tx) {
+			uint32_t px = row[h->offset[tx]];
+			uint32_t w = h->weight[tx] * v->weight[ty];
+
+			sum[0] += (px & 0xff) * w;
+			sum[1] += ((px >> 8) & 0xff) * w;
+			sum[2] += ((px >> 16) & 0xff) * w;
+			sum[3] += (px >> 24) * w;
+		}
+	}
+
+	uint32_t result = 0;
+	for (int c = 0; c < 4; ++c)
+		result |= ((sum[c] * recip + (1 << 15)) >> 16) << (c * 8);
+
+	return result;
+}
+
+void downscale32(uint32_t* dst, int32_t dst_stride, const uint32_t* src,
+		int32_t src_stride, struct downscale_ratio h_ratio,
+		struct downscale_ratio v_ratio, const pixman_box16_t* box)
+{
+	struct downscale_taps h_taps[MAX_PHASES], v_taps[MAX_PHASES];
+	make_taps(h_taps, h_ratio);
+	make_taps(v_taps, v_ratio);
+
+	uint32_t divisor = h_ratio.p * v_ratio.p;
+	uint32_t recip = ((1 << 16) + divisor / 2) / divisor;
+
+	for (int y = box->y1; y < box->y2; ++y) {
+		const struct downscale_taps* v = &v_taps[y % v_ratio.q];
+		const uint32_t* src_row = src +
+			(y / v_ratio.q) * v_ratio.p * src_stride;
+		uint32_t* dst_row = dst + y * dst_stride;
+
+		for (int x = box->x1; x < box->x2; ++x) {
+			const struct downscale_taps* h = &h_taps[x % h_ratio.q];
+			const uint32_t* s = src_row + (x / h_ratio.q) * h_ratio.p;
+
+			dst_row[x] = average_pixel(s, src_stride, h, v, recip);
+		}
+	}
+}
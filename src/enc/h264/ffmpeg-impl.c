@@ -443,7 +443,7 @@ static int h264_encoder__schedule_work(struct h264_encoder_ffmpeg* self)
 	self->current_frame_is_keyframe = self->base.next_frame_should_be_keyframe;
 	self->base.next_frame_should_be_keyframe = false;
 
-	return aml_start(aml_get_default(), self->work);
+	return aml_start(self->base.loop, self->work);
 }
 
 static int h264_encoder__encode(struct h264_encoder_ffmpeg* self,
@@ -609,14 +609,15 @@ static int find_render_node(char *node, size_t maxlen) {
 	return r;
 }
 
-static struct h264_encoder* h264_encoder_ffmpeg_create(uint32_t width,
-		uint32_t height, uint32_t format, int quality)
+static struct h264_encoder* h264_encoder_ffmpeg_create(struct aml* loop,
+		uint32_t width, uint32_t height, uint32_t format, int quality)
 {
 	struct h264_encoder_ffmpeg* self = calloc(1, sizeof(*self));
 	if (!self)
 		return NULL;
 
 	self->base.impl = &h264_encoder_ffmpeg_impl;
+	self->base.loop = loop;
 
 	if (vec_init(&self->current_packet, 65536) < 0)
 		goto packet_failure;
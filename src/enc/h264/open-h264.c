@@ -81,7 +81,7 @@ enum open_h264_flags {
 
 // TODO: Add some method to remove contexts when displays are removed
 
-struct encoder* open_h264_new(void);
+struct encoder* open_h264_new(struct executor* executor);
 
 struct encoder_impl encoder_impl_open_h264;
 
@@ -215,13 +215,13 @@ static void open_h264_handle_packet(const void* data, size_t size, uint64_t pts,
 	open_h264_finish_frame(self);
 }
 
-struct encoder* open_h264_new(void)
+struct encoder* open_h264_new(struct executor* executor)
 {
 	struct open_h264* self = calloc(1, sizeof(*self));
 	if (!self)
 		return NULL;
 
-	encoder_init(&self->parent, &encoder_impl_open_h264);
+	encoder_init(&self->parent, &encoder_impl_open_h264, executor);
 
 	self->quality = 6;
 
@@ -240,8 +240,9 @@ static int open_h264_resize(struct open_h264_context* self, struct nvnc_frame* f
 {
 	int quality = 51 - round((50.0 / 9.0) * (float)self->parent->quality);
 
-	struct h264_encoder* encoder = h264_encoder_create(fb->width,
-			fb->height, fb->fourcc_format, quality);
+	struct h264_encoder* encoder = h264_encoder_create(
+			self->parent->parent.loop, fb->width, fb->height,
+			fb->fourcc_format, quality);
 	if (!encoder)
 		return -1;
 
@@ -641,14 +641,15 @@ static int find_capable_device(uint32_t width, uint32_t height)
 	return fd;
 }
 
-static struct h264_encoder* h264_encoder_v4l2m2m_create(uint32_t width,
-		uint32_t height, uint32_t format, int quality)
+static struct h264_encoder* h264_encoder_v4l2m2m_create(struct aml* loop,
+		uint32_t width, uint32_t height, uint32_t format, int quality)
 {
 	struct h264_encoder_v4l2m2m* self = calloc(1, sizeof(*self));
 	if (!self)
 		return NULL;
 
 	self->base.impl = &h264_encoder_v4l2m2m_impl;
+	self->base.loop = loop;
 	self->fd = -1;
 	self->width = width;
 	self->height = height;
@@ -688,7 +689,7 @@ static struct h264_encoder* h264_encoder_v4l2m2m_create(uint32_t width,
 	self->handler = aml_handler_new(self->fd, process_fd_events, self, NULL);
 	aml_set_event_mask(self->handler, AML_EVENT_READ);
 
-	if (aml_start(aml_get_default(), self->handler) < 0) {
+	if (aml_start(self->base.loop, self->handler) < 0) {
 		aml_unref(self->handler);
 		goto failure;
 	}
@@ -717,7 +718,7 @@ static void h264_encoder_v4l2m2m_destroy(struct h264_encoder* base)
 {
 	struct h264_encoder_v4l2m2m* self = (struct h264_encoder_v4l2m2m*)base;
 	claim_all_src_bufs(self);
-	aml_stop(aml_get_default(), self->handler);
+	aml_stop(self->base.loop, self->handler);
 	aml_unref(self->handler);
 	stream_off(self);
 	free_dst_buffers(self);
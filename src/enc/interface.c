@@ -14,16 +14,18 @@
  * PERFORMANCE OF THIS SOFTWARE.
  */
 #include "enc/encoder.h"
+#include "executor.h"
 #include "config.h"
 
 #include <stdlib.h>
 #include <assert.h>
 
-struct encoder* raw_encoder_new(void);
-struct encoder* zrle_encoder_new(void);
-struct encoder* tight_encoder_new(uint16_t width, uint16_t height);
+struct encoder* raw_encoder_new(struct executor* executor);
+struct encoder* zrle_encoder_new(struct executor* executor);
+struct encoder* tight_encoder_new(struct executor* executor,
+		struct tile_cache* tile_cache, uint16_t width, uint16_t height);
 #ifdef ENABLE_OPEN_H264
-struct encoder* open_h264_new(void);
+struct encoder* open_h264_new(struct executor* executor);
 #endif
 
 extern struct encoder_impl encoder_impl_raw;
@@ -33,15 +35,17 @@ extern struct encoder_impl encoder_impl_tight;
 extern struct encoder_impl encoder_impl_open_h264;
 #endif
 
-struct encoder* encoder_new(enum rfb_encodings type, uint16_t width,
-		uint16_t height)
+struct encoder* encoder_new(struct executor* executor,
+		struct tile_cache* tile_cache, enum rfb_encodings type,
+		uint16_t width, uint16_t height)
 {
 	switch (type) {
-	case RFB_ENCODING_RAW: return raw_encoder_new();
-	case RFB_ENCODING_ZRLE: return zrle_encoder_new();
-	case RFB_ENCODING_TIGHT: return tight_encoder_new(width, height);
+	case RFB_ENCODING_RAW: return raw_encoder_new(executor);
+	case RFB_ENCODING_ZRLE: return zrle_encoder_new(executor);
+	case RFB_ENCODING_TIGHT:
+		return tight_encoder_new(executor, tile_cache, width, height);
 #ifdef ENABLE_OPEN_H264
-	case RFB_ENCODING_OPEN_H264: return open_h264_new();
+	case RFB_ENCODING_OPEN_H264: return open_h264_new(executor);
 #endif
 	default: break;
 	}
@@ -49,10 +53,13 @@ struct encoder* encoder_new(enum rfb_encodings type, uint16_t width,
 	return NULL;
 }
 
-void encoder_init(struct encoder* self, struct encoder_impl* impl)
+void encoder_init(struct encoder* self, struct encoder_impl* impl,
+		struct executor* executor)
 {
 	self->ref = 1;
 	self->impl = impl;
+	self->executor = executor;
+	self->loop = executor_get_loop(executor);
 }
 
 enum rfb_encodings encoder_get_type(const struct encoder* self)
@@ -103,6 +110,13 @@ void encoder_set_quality(struct encoder* self, int value)
 		self->impl->set_quality(self, value);
 }
 
+void encoder_set_roi(struct encoder* self, struct pixman_region16* roi,
+		int quality)
+{
+	if (self->impl->set_roi)
+		self->impl->set_roi(self, roi, quality);
+}
+
 int encoder_encode(struct encoder* self, struct nvnc_composite_fb* fb,
 		struct pixman_region16* damage)
 {
@@ -127,3 +141,11 @@ void encoder_reset(struct encoder* self)
 	if (self->impl->reset)
 		self->impl->reset(self);
 }
+
+uint64_t encoder_get_refresh_region(struct encoder* self,
+		struct pixman_region16* dst, uint64_t idle_time)
+{
+	if (self->impl->get_refresh_region)
+		return self->impl->get_refresh_region(self, dst, idle_time);
+	return 0;
+}
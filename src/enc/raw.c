@@ -21,17 +21,16 @@
 #include "pixels.h"
 #include "enc/util.h"
 #include "enc/encoder.h"
+#include "executor.h"
 
 #include <stdlib.h>
 #include <pixman.h>
-#include <aml.h>
 
-struct encoder* raw_encoder_new(void);
+struct encoder* raw_encoder_new(struct executor* executor);
 
 struct raw_encoder {
 	struct encoder encoder;
 	struct rfb_pixel_format output_format;
-	struct aml_work* work;
 };
 
 struct raw_encoder_work {
@@ -90,9 +89,9 @@ static int raw_encode_box(struct raw_encoder_work* ctx, struct vec* dst,
 	return 0;
 }
 
-static void raw_encoder_do_work(struct aml_work* work)
+static void raw_encoder_do_work(void* userdata)
 {
-	struct raw_encoder_work* ctx = aml_get_userdata(work);
+	struct raw_encoder_work* ctx = userdata;
 	int rc __attribute__((unused));
 
 	assert(ctx->composite_fb.n_fbs != 0);
@@ -171,28 +170,36 @@ static void raw_encoder_do_work(struct aml_work* work)
 		pixman_region_fini(&subregions[i]);
 }
 
-static void raw_encoder_on_done(struct aml_work* work)
+static void raw_encoder_work_destroy(struct raw_encoder_work* ctx)
 {
-	struct raw_encoder_work* ctx = aml_get_userdata(work);
+	nvnc_composite_fb_unref(&ctx->composite_fb);
+	pixman_region_fini(&ctx->damage);
+	if (ctx->result)
+		encoded_frame_unref(ctx->result);
+	encoder_unref(&ctx->parent->encoder);
+	free(ctx);
+}
+
+static void raw_encoder_on_done(void* userdata)
+{
+	struct raw_encoder_work* ctx = userdata;
 	struct raw_encoder* self = ctx->parent;
 
 	assert(ctx->result);
 
-	aml_unref(self->work);
-	self->work = NULL;
-
 	ctx->result->metadata = ctx->composite_fb.metadata;
 
 	encoder_finish_frame(&self->encoder, ctx->result);
+	raw_encoder_work_destroy(ctx);
 }
 
-struct encoder* raw_encoder_new(void)
+struct encoder* raw_encoder_new(struct executor* executor)
 {
 	struct raw_encoder* self = calloc(1, sizeof(*self));
 	if (!self)
 		return NULL;
 
-	encoder_init(&self->encoder, &encoder_impl_raw);
+	encoder_init(&self->encoder, &encoder_impl_raw, executor);
 
 	return (struct encoder*)self;
 }
@@ -200,10 +207,6 @@ struct encoder* raw_encoder_new(void)
 static void raw_encoder_destroy(struct encoder* encoder)
 {
 	struct raw_encoder* self = raw_encoder(encoder);
-	if (self->work) {
-		aml_stop(aml_get_default(), self->work);
-		aml_unref(self->work);
-	}
 	free(self);
 }
 
@@ -214,17 +217,6 @@ static void raw_encoder_set_output_format(struct encoder* encoder,
 	memcpy(&self->output_format, pixfmt, sizeof(self->output_format));
 }
 
-static void raw_encoder_work_destroy(void* obj)
-{
-	struct raw_encoder_work* ctx = obj;
-	nvnc_composite_fb_unref(&ctx->composite_fb);
-	pixman_region_fini(&ctx->damage);
-	if (ctx->result)
-		encoded_frame_unref(ctx->result);
-	encoder_unref(&ctx->parent->encoder);
-	free(ctx);
-}
-
 static int raw_encoder_encode(struct encoder* encoder,
 		struct nvnc_composite_fb* fb,
 		struct pixman_region16* damage)
@@ -235,13 +227,6 @@ static int raw_encoder_encode(struct encoder* encoder,
 	if (!ctx)
 		return -1;
 
-	self->work = aml_work_new(raw_encoder_do_work, raw_encoder_on_done,
-			ctx, raw_encoder_work_destroy);
-	if (!self->work) {
-		free(ctx);
-		return -1;
-	}
-
 	encoder_ref(encoder);
 
 	ctx->parent = self;
@@ -250,11 +235,10 @@ static int raw_encoder_encode(struct encoder* encoder,
 			sizeof(ctx->output_format));
 	pixman_region_copy(&ctx->damage, damage);
 
-	int rc = aml_start(aml_get_default(), self->work);
-	if (rc < 0) {
-		aml_unref(self->work);
-		self->work = NULL;
-	}
+	int rc = executor_submit(self->encoder.executor, EXECUTOR_STAGE_ENCODE,
+			raw_encoder_do_work, raw_encoder_on_done, ctx);
+	if (rc < 0)
+		raw_encoder_work_destroy(ctx);
 
 	return rc;
 }
@@ -22,17 +22,21 @@
 #include "enc/util.h"
 #include "frame.h"
 #include "enc/encoder.h"
+#include "executor.h"
+#include "enc/tile-cache.h"
+#include "damage-refinery.h"
 
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <time.h>
+#include <sys/param.h>
 #include <zlib.h>
 #include <pixels.h>
 #include <pthread.h>
 #include <assert.h>
-#include <aml.h>
 #include <libdrm/drm_fourcc.h>
 #ifdef HAVE_JPEG
 #include <turbojpeg.h>
@@ -45,6 +49,9 @@
 #define TIGHT_PNG 0xA0
 #define TIGHT_BASIC 0x00
 
+#define TIGHT_EXPLICIT_FILTER 0x40
+#define TIGHT_FILTER_GRADIENT 0x02
+
 #define TIGHT_STREAM(n) ((n) << 4)
 #define TIGHT_RESET(n) (1 << (n))
 
@@ -52,7 +59,16 @@
 
 #define MAX_TILE_SIZE (2 * TSL * TSL * 4)
 
-struct encoder* tight_encoder_new(uint16_t width, uint16_t height);
+/* The gradient filter is used for tiles where prediction errors are small on
+ * average, i.e. photos and gradients. Tiles that are almost entirely predicted
+ * exactly are flat, and the copy filter does just as well on those.
+ */
+#define GRADIENT_MAX_EXACT_PERCENT 95
+#define GRADIENT_MAX_AVG_ERROR 32
+#define GRADIENT_SAMPLE_ROW_STEP 4
+
+struct encoder* tight_encoder_new(struct executor* executor,
+		struct tile_cache* tile_cache, uint16_t width, uint16_t height);
 
 typedef void (*tight_done_fn)(struct vec* frame, void*);
 
@@ -60,6 +76,10 @@ struct tight_encoder_grid {
 	struct tight_tile* grid;
 	uint32_t width;
 	uint32_t height;
+
+	// Where the tiles were last placed within the frame
+	int x_off, y_off;
+	uint32_t fb_width, fb_height;
 };
 
 struct tight_encoder {
@@ -70,10 +90,15 @@ struct tight_encoder {
 	uint32_t height;
 	int quality;
 
+	struct pixman_region16 roi;
+	int roi_quality;
+
+	struct tile_cache* tile_cache;
+
 	struct tight_encoder_grid grid[NVNC_FB_COMPOSITE_MAX];
 
 	z_stream zs[4];
-	struct aml_work* zs_worker[4];
+	struct tight_zs_worker_ctx* zs_worker[4];
 
 	struct rfb_pixel_format dfmt;
 
@@ -81,6 +106,7 @@ struct tight_encoder {
 	struct nvnc_composite_fb composite_fb;
 
 	uint64_t pts;
+	uint64_t encode_time;
 
 	uint32_t n_rects;
 	uint32_t n_jobs;
@@ -99,8 +125,12 @@ enum tight_tile_state {
 
 struct tight_tile {
 	enum tight_tile_state state;
+	int quality;
+	bool is_lossy;
+	uint64_t encode_time; // µs
 	size_t size;
 	uint8_t type;
+	uint8_t filter;
 	char buffer[MAX_TILE_SIZE];
 };
 
@@ -111,10 +141,17 @@ struct tight_zs_worker_ctx {
 
 struct encoder_impl encoder_impl_tight;
 
-static void do_tight_zs_work(struct aml_work*);
-static void on_tight_zs_work_done(struct aml_work*);
+static void do_tight_zs_work(void*);
+static void on_tight_zs_work_done(void*);
 static int schedule_tight_finish(struct tight_encoder* self);
 
+static uint64_t tight_gettime_us(void)
+{
+	struct timespec ts = { 0 };
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000ULL;
+}
+
 static inline struct tight_encoder* tight_encoder(struct encoder* encoder)
 {
 	assert(encoder->impl == &encoder_impl_tight);
@@ -162,16 +199,8 @@ static int tight_init_zs_worker(struct tight_encoder* self, int index)
 	ctx->encoder = self;
 	ctx->index = index;
 
-	self->zs_worker[index] =
-		aml_work_new(do_tight_zs_work, on_tight_zs_work_done, ctx, free);
-	if (!self->zs_worker[index])
-		goto failure;
-
+	self->zs_worker[index] = ctx;
 	return 0;
-
-failure:
-	free(ctx);
-	return -1;
 }
 
 static void tight_encoder_resize(struct tight_encoder* self)
@@ -210,8 +239,8 @@ static void tight_encoder_resize(struct tight_encoder* self)
 	}
 }
 
-static int tight_encoder_init(struct tight_encoder* self, uint32_t width,
-		uint32_t height)
+static int tight_encoder_init(struct tight_encoder* self,
+		struct tile_cache* tile_cache, uint32_t width, uint32_t height)
 {
 	memset(self, 0, sizeof(*self));
 
@@ -225,7 +254,12 @@ static int tight_encoder_init(struct tight_encoder* self, uint32_t width,
 	tight_init_zs_worker(self, 2);
 	tight_init_zs_worker(self, 3);
 
-	aml_require_workers(aml_get_default(), 1);
+	pixman_region_init(&self->roi);
+
+	// The cache is shared by all clients and is optional
+	self->tile_cache = tile_cache;
+	if (tile_cache)
+		tile_cache_ref(tile_cache);
 
 	self->pts = NVNC_NO_PTS;
 
@@ -234,10 +268,10 @@ static int tight_encoder_init(struct tight_encoder* self, uint32_t width,
 
 static void tight_encoder_destroy(struct tight_encoder* self)
 {
-	aml_unref(self->zs_worker[3]);
-	aml_unref(self->zs_worker[2]);
-	aml_unref(self->zs_worker[1]);
-	aml_unref(self->zs_worker[0]);
+	free(self->zs_worker[3]);
+	free(self->zs_worker[2]);
+	free(self->zs_worker[1]);
+	free(self->zs_worker[0]);
 
 	deflateEnd(&self->zs[3]);
 	deflateEnd(&self->zs[2]);
@@ -246,6 +280,20 @@ static void tight_encoder_destroy(struct tight_encoder* self)
 
 	for (int i = 0; i < NVNC_FB_COMPOSITE_MAX && self->grid[i].grid; ++i)
 		free(self->grid[i].grid);
+
+	pixman_region_fini(&self->roi);
+	tile_cache_unref(self->tile_cache);
+}
+
+static int tight_tile_quality(struct tight_encoder* self,
+		struct pixman_box16* box)
+{
+	if (self->roi_quality <= self->quality ||
+			pixman_region_contains_rectangle(&self->roi, box) ==
+			PIXMAN_REGION_OUT)
+		return self->quality;
+
+	return self->roi_quality;
 }
 
 static int tight_apply_damage(struct tight_encoder* self,
@@ -270,9 +318,12 @@ static int tight_apply_damage(struct tight_encoder* self,
 					= pixman_region_contains_rectangle(damage, &box);
 
 				if (overlap != PIXMAN_REGION_OUT) {
+					struct tight_tile* tile =
+						tight_tile(self, fbi, x, y);
 					++n_damaged;
-					tight_tile(self, fbi, x, y)->state =
-						TIGHT_TILE_DAMAGED;
+					tile->state = TIGHT_TILE_DAMAGED;
+					tile->quality = tight_tile_quality(self,
+							&box);
 				} else {
 					tight_tile(self, fbi, x, y)->state =
 						TIGHT_TILE_READY;
@@ -318,6 +369,65 @@ static int tight_deflate(struct tight_tile* tile, void* src,
 	return 0;
 }
 
+/* Each colour component is replaced by its difference from the prediction
+ * left + up - up_left, as described in doc/vnc-enc-tight.h. Only 24 bit
+ * cpixels are handled, where each byte is an 8 bit component.
+ */
+static void tight_apply_gradient24(uint8_t* restrict dst,
+		const uint8_t* restrict row, const uint8_t* restrict prev_row,
+		uint32_t width)
+{
+	for (int c = 0; c < 3; ++c) {
+		int left = 0;
+		int up_left = 0;
+
+		for (uint32_t x = 0; x < width; ++x) {
+			int value = row[x * 3 + c];
+			int up = prev_row ? prev_row[x * 3 + c] : 0;
+
+			int prediction = left + up - up_left;
+			if (prediction < 0)
+				prediction = 0;
+			else if (prediction > 255)
+				prediction = 255;
+
+			dst[x * 3 + c] = value - prediction;
+
+			left = value;
+			up_left = up;
+		}
+	}
+}
+
+static bool tight_is_gradient_worthwhile(const uint8_t* pixels,
+		uint32_t width, uint32_t height)
+{
+	uint8_t residual[TSL * 3];
+	uint32_t n_samples = 0;
+	uint32_t n_exact = 0;
+	uint32_t error = 0;
+
+	for (uint32_t y = 1; y < height; y += GRADIENT_SAMPLE_ROW_STEP) {
+		const uint8_t* row = pixels + y * width * 3;
+		tight_apply_gradient24(residual, row, row - width * 3, width);
+
+		// The first pixel has no left neighbour, so it's skipped
+		for (uint32_t i = 3; i < width * 3; ++i) {
+			int8_t diff = residual[i];
+			++n_samples;
+			if (diff == 0)
+				++n_exact;
+			else
+				error += abs(diff);
+		}
+	}
+
+	if (n_samples == 0 || n_exact * 100 > n_samples * GRADIENT_MAX_EXACT_PERCENT)
+		return false;
+
+	return error < GRADIENT_MAX_AVG_ERROR * (n_samples - n_exact);
+}
+
 static void tight_encode_tile_basic(struct tight_encoder* self,
 		struct tight_tile* tile, int fb_index, uint32_t x,
 		uint32_t y_start, uint32_t width, uint32_t height, int zs_index)
@@ -327,7 +437,9 @@ static void tight_encode_tile_basic(struct tight_encoder* self,
 
 	int bytes_per_cpixel = nvnc__calc_bytes_per_cpixel(&self->dfmt);
 	assert(bytes_per_cpixel <= 4);
-	uint8_t row[TSL * 4];
+	uint8_t pixels[TSL * TSL * 4];
+	uint8_t residual[TSL * TSL * 3];
+	uint32_t row_len = bytes_per_cpixel * width;
 
 	struct rfb_pixel_format cfmt = { 0 };
 	if (bytes_per_cpixel == 3)
@@ -341,17 +453,31 @@ static void tight_encode_tile_basic(struct tight_encoder* self,
 	int32_t byte_stride = nvnc_frame_get_stride(fb) * bpp;
 	int32_t xoff = x * bpp;
 	// TODO: Limit width and hight to the sides
-	for (uint32_t y = y_start; y < y_start + height; ++y) {
-		uint8_t* img = addr + xoff + y * byte_stride;
-		pixel_to_cpixel(row, &cfmt, img, &self->sfmt[fb_index],
-				bytes_per_cpixel, width);
-
-		// TODO What to do if the buffer fills up?
-		if (tight_deflate(tile, row, bytes_per_cpixel * width,
-				zs, y == y_start + height - 1) < 0)
-			abort();
+	for (uint32_t y = 0; y < height; ++y) {
+		uint8_t* img = addr + xoff + (y_start + y) * byte_stride;
+		pixel_to_cpixel(pixels + y * row_len, &cfmt, img,
+				&self->sfmt[fb_index], bytes_per_cpixel, width);
+	}
+
+	uint8_t* data = pixels;
+
+	if (bytes_per_cpixel == 3 &&
+			tight_is_gradient_worthwhile(pixels, width, height)) {
+		tile->type |= TIGHT_EXPLICIT_FILTER;
+		tile->filter = TIGHT_FILTER_GRADIENT;
+
+		for (uint32_t y = 0; y < height; ++y)
+			tight_apply_gradient24(residual + y * row_len,
+					pixels + y * row_len,
+					y > 0 ? pixels + (y - 1) * row_len : NULL,
+					width);
+
+		data = residual;
 	}
 
+	// TODO What to do if the buffer fills up?
+	if (tight_deflate(tile, data, row_len * height, zs, true) < 0)
+		abort();
 }
 
 #ifdef HAVE_JPEG
@@ -379,6 +505,19 @@ static enum TJPF tight_get_jpeg_pixfmt(uint32_t fourcc)
 	return TJPF_UNKNOWN;
 }
 
+/* JPEG tiles do not depend on any stream state, so identical content that was
+ * encoded with identical parameters yields identical output.
+ */
+static uint64_t tight_jpeg_cache_key(struct nvnc_frame* fb, uint32_t x,
+		uint32_t y, uint32_t width, uint32_t height, int quality)
+{
+	uint64_t seed = nvnc_frame_get_fourcc_format(fb) |
+		(uint64_t)quality << 32 |
+		(uint64_t)width << 40 |
+		(uint64_t)height << 48;
+	return damage_hash_rect(fb, x, y, width, height, seed);
+}
+
 static int tight_encode_tile_jpeg(struct tight_encoder* self,
 		struct tight_tile* tile, int fb_index, uint32_t x, uint32_t y,
 		uint32_t width, uint32_t height)
@@ -388,7 +527,7 @@ static int tight_encode_tile_jpeg(struct tight_encoder* self,
 	unsigned char* buffer = NULL;
 	unsigned long size = 0;
 
-	int quality = 11 * self->quality + 1;
+	int quality = 11 * tile->quality + 1;
 
 	struct nvnc_frame* fb = self->composite_fb.fbs[fb_index];
 	uint32_t fourcc = nvnc_frame_get_fourcc_format(fb);
@@ -396,6 +535,19 @@ static int tight_encode_tile_jpeg(struct tight_encoder* self,
 	if (tjfmt == TJPF_UNKNOWN)
 		return -1;
 
+	uint64_t cache_key = 0;
+	if (self->tile_cache) {
+		cache_key = tight_jpeg_cache_key(fb, x, y, width, height,
+				tile->quality);
+
+		ssize_t cached_size = tile_cache_lookup(self->tile_cache,
+				cache_key, tile->buffer, MAX_TILE_SIZE);
+		if (cached_size >= 0) {
+			tile->size = cached_size;
+			return 0;
+		}
+	}
+
 	tjhandle handle = tjInitCompress();
 	if (!handle)
 		return -1;
@@ -406,7 +558,7 @@ static int tight_encode_tile_jpeg(struct tight_encoder* self,
 	int32_t xoff = x * bpp;
 	uint8_t* img = addr + xoff + y * byte_stride;
 
-	enum TJSAMP subsampling = (self->quality == 9) ? TJSAMP_444 : TJSAMP_420;
+	enum TJSAMP subsampling = (tile->quality == 9) ? TJSAMP_444 : TJSAMP_420;
 
 	int rc = -1;
 	rc = tjCompress2(handle, img, width, byte_stride, height, tjfmt, &buffer,
@@ -425,6 +577,9 @@ static int tight_encode_tile_jpeg(struct tight_encoder* self,
 	memcpy(tile->buffer, buffer, size);
 	tile->size = size;
 
+	if (self->tile_cache)
+		tile_cache_insert(self->tile_cache, cache_key, buffer, size);
+
 	rc = 0;
 	tjFree(buffer);
 failure:
@@ -448,7 +603,7 @@ static void tight_encode_tile(struct tight_encoder* self, int fb_index,
 	tile->size = 0;
 
 #ifdef HAVE_JPEG
-	if (self->quality >= 10) {
+	if (tile->quality >= 10) {
 		tight_encode_tile_basic(self, tile, fb_index, x, y, width,
 				height, gx % 4);
 	} else {
@@ -459,12 +614,14 @@ static void tight_encode_tile(struct tight_encoder* self, int fb_index,
 	tight_encode_tile_basic(self, tile, fb_index, x, y, width, height, gx % 4);
 #endif
 
+	tile->is_lossy = tile->type == TIGHT_JPEG;
+	tile->encode_time = self->encode_time;
 	tile->state = TIGHT_TILE_ENCODED;
 }
 
-static void do_tight_zs_work(struct aml_work* work)
+static void do_tight_zs_work(void* userdata)
 {
-	struct tight_zs_worker_ctx* ctx = aml_get_userdata(work);
+	struct tight_zs_worker_ctx* ctx = userdata;
 	struct tight_encoder* self = ctx->encoder;
 	int index = ctx->index;
 
@@ -475,9 +632,9 @@ static void do_tight_zs_work(struct aml_work* work)
 					tight_encode_tile(self, fbi, x, y);
 }
 
-static void on_tight_zs_work_done(struct aml_work* obj)
+static void on_tight_zs_work_done(void* userdata)
 {
-	struct tight_zs_worker_ctx* ctx = aml_get_userdata(obj);
+	struct tight_zs_worker_ctx* ctx = userdata;
 	struct tight_encoder* self = ctx->encoder;
 
 	if (--self->n_jobs == 0) {
@@ -491,7 +648,9 @@ static int tight_schedule_zs_work(struct tight_encoder* self, int index)
 {
 	encoder_ref(&self->encoder);
 
-	int rc = aml_start(aml_get_default(), self->zs_worker[index]);
+	int rc = executor_submit(self->encoder.executor, EXECUTOR_STAGE_ENCODE,
+			do_tight_zs_work, on_tight_zs_work_done,
+			self->zs_worker[index]);
 	if (rc >= 0)
 		++self->n_jobs;
 	else
@@ -528,6 +687,8 @@ static void tight_finish_tile(struct tight_encoder* self,
 			width, height);
 
 	vec_append(&self->dst, &tile->type, sizeof(tile->type));
+	if (tile->type & TIGHT_EXPLICIT_FILTER)
+		vec_append(&self->dst, &tile->filter, sizeof(tile->filter));
 	tight_encode_size(&self->dst, tile->size);
 	vec_append(&self->dst, tile->buffer, tile->size);
 
@@ -544,15 +705,15 @@ static void tight_finish(struct tight_encoder* self)
 					tight_finish_tile(self, fbi, x, y);
 }
 
-static void do_tight_finish(struct aml_work* work)
+static void do_tight_finish(void* userdata)
 {
-	struct tight_encoder* self = aml_get_userdata(work);
+	struct tight_encoder* self = userdata;
 	tight_finish(self);
 }
 
-static void on_tight_finished(struct aml_work* work)
+static void on_tight_finished(void* userdata)
 {
-	struct tight_encoder* self = aml_get_userdata(work);
+	struct tight_encoder* self = userdata;
 
 	struct nvnc_frame_metadata* metadata = self->composite_fb.metadata;
 	nvnc_frame_metadata_ref(metadata);
@@ -579,30 +740,27 @@ static int schedule_tight_finish(struct tight_encoder* self)
 {
 	encoder_ref(&self->encoder);
 
-	struct aml_work* work = aml_work_new(do_tight_finish, on_tight_finished,
-			self, NULL);
-	if (!work) {
+	int rc = executor_submit(self->encoder.executor, EXECUTOR_STAGE_ENCODE,
+			do_tight_finish, on_tight_finished, self);
+	if (rc < 0)
 		encoder_unref(&self->encoder);
-		return -1;
-	}
 
-	int rc = aml_start(aml_get_default(), work);
-	aml_unref(work);
 	return rc;
 }
 
-struct encoder* tight_encoder_new(uint16_t width, uint16_t height)
+struct encoder* tight_encoder_new(struct executor* executor,
+		struct tile_cache* tile_cache, uint16_t width, uint16_t height)
 {
 	struct tight_encoder* self = calloc(1, sizeof(*self));
 	if (!self)
 		return NULL;
 
-	if (tight_encoder_init(self, width, height) < 0) {
+	if (tight_encoder_init(self, tile_cache, width, height) < 0) {
 		free(self);
 		return NULL;
 	}
 
-	encoder_init(&self->encoder, &encoder_impl_tight);
+	encoder_init(&self->encoder, &encoder_impl_tight, executor);
 
 	return (struct encoder*)self;
 }
@@ -626,6 +784,14 @@ static void tight_encoder_set_quality(struct encoder* encoder, int value)
 	self->quality = value;
 }
 
+static void tight_encoder_set_roi(struct encoder* encoder,
+		struct pixman_region16* roi, int quality)
+{
+	struct tight_encoder* self = tight_encoder(encoder);
+	pixman_region_copy(&self->roi, roi);
+	self->roi_quality = quality;
+}
+
 static int tight_encoder_encode(struct encoder* encoder,
 		struct nvnc_composite_fb* composite_fb,
 		struct pixman_region16* damage)
@@ -644,9 +810,19 @@ static int tight_encoder_encode(struct encoder* encoder,
 
 	nvnc_composite_fb_copy(&self->composite_fb, composite_fb);
 	self->pts = nvnc_composite_fb_pts(composite_fb);
+	self->encode_time = tight_gettime_us();
 
 	tight_encoder_resize(self);
 
+	for (int i = 0; i < composite_fb->n_fbs; ++i) {
+		struct nvnc_frame* fb = composite_fb->fbs[i];
+		struct tight_encoder_grid* grid = &self->grid[i];
+		grid->x_off = fb->x_off;
+		grid->y_off = fb->y_off;
+		grid->fb_width = fb->width;
+		grid->fb_height = fb->height;
+	}
+
 	rc = nvnc_composite_fb_map(composite_fb);
 	nvnc_assert(rc == 0, "Failed to map input buffer");
 
@@ -664,9 +840,49 @@ static int tight_encoder_encode(struct encoder* encoder,
 	return 0;
 }
 
+static uint64_t tight_encoder_get_refresh_region(struct encoder* encoder,
+		struct pixman_region16* dst, uint64_t idle_time)
+{
+	struct tight_encoder* self = tight_encoder(encoder);
+	uint64_t now = tight_gettime_us();
+	uint64_t next = 0;
+
+	for (int fbi = 0; fbi < self->last_n_fbs; ++fbi) {
+		struct tight_encoder_grid* grid = &self->grid[fbi];
+		if (!grid->grid)
+			continue;
+
+		for (uint32_t y = 0; y < grid->height; ++y)
+			for (uint32_t x = 0; x < grid->width; ++x) {
+				struct tight_tile* tile = tight_tile(self, fbi,
+						x, y);
+				if (!tile->is_lossy)
+					continue;
+
+				uint64_t age = now - tile->encode_time;
+				if (age < idle_time) {
+					uint64_t remaining = idle_time - age;
+					if (next == 0 || remaining < next)
+						next = remaining;
+					continue;
+				}
+
+				pixman_region_union_rect(dst, dst,
+						grid->x_off + x * TSL,
+						grid->y_off + y * TSL,
+						MIN(TSL, grid->fb_width - x * TSL),
+						MIN(TSL, grid->fb_height - y * TSL));
+			}
+	}
+
+	return next;
+}
+
 struct encoder_impl encoder_impl_tight = {
 	.destroy = tight_encoder_destroy_wrapper,
 	.set_output_format = tight_encoder_set_output_format,
 	.set_quality = tight_encoder_set_quality,
+	.set_roi = tight_encoder_set_roi,
 	.encode = tight_encoder_encode,
+	.get_refresh_region = tight_encoder_get_refresh_region,
 };
@@ -0,0 +1,160 @@
+/*
+ * Copyright (c) 2026 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include "enc/tile-cache.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/queue.h>
+
+#define N_BUCKETS 4096
+
+struct tile_cache_entry {
+	uint64_t key;
+	size_t size;
+	LIST_ENTRY(tile_cache_entry) bucket_link;
+	TAILQ_ENTRY(tile_cache_entry) lru_link;
+	uint8_t data[];
+};
+
+LIST_HEAD(tile_cache_bucket, tile_cache_entry);
+TAILQ_HEAD(tile_cache_lru, tile_cache_entry);
+
+struct tile_cache {
+	int ref;
+	pthread_mutex_t mutex;
+	size_t max_bytes;
+	size_t n_bytes;
+
+	// Most recently used first
+	struct tile_cache_lru lru;
+	struct tile_cache_bucket buckets[N_BUCKETS];
+};
+
+struct tile_cache* tile_cache_create(size_t max_bytes)
+{
+	struct tile_cache* self = calloc(1, sizeof(*self));
+	if (!self)
+		return NULL;
+
+	self->ref = 1;
+	pthread_mutex_init(&self->mutex, NULL);
+	self->max_bytes = max_bytes;
+	TAILQ_INIT(&self->lru);
+
+	for (int i = 0; i < N_BUCKETS; ++i)
+		LIST_INIT(&self->buckets[i]);
+
+	return self;
+}
+
+static void tile_cache_remove(struct tile_cache* self,
+		struct tile_cache_entry* entry)
+{
+	LIST_REMOVE(entry, bucket_link);
+	TAILQ_REMOVE(&self->lru, entry, lru_link);
+	self->n_bytes -= entry->size;
+	free(entry);
+}
+
+static void tile_cache_destroy(struct tile_cache* self)
+{
+	while (!TAILQ_EMPTY(&self->lru))
+		tile_cache_remove(self, TAILQ_FIRST(&self->lru));
+
+	pthread_mutex_destroy(&self->mutex);
+	free(self);
+}
+
+void tile_cache_ref(struct tile_cache* self)
+{
+	self->ref++;
+}
+
+void tile_cache_unref(struct tile_cache* self)
+{
+	if (self && --self->ref == 0)
+		tile_cache_destroy(self);
+}
+
+static struct tile_cache_bucket* tile_cache_bucket(struct tile_cache* self,
+		uint64_t key)
+{
+	return &self->buckets[key % N_BUCKETS];
+}
+
+static struct tile_cache_entry* tile_cache_find(struct tile_cache* self,
+		uint64_t key)
+{
+	struct tile_cache_entry* entry;
+	LIST_FOREACH(entry, tile_cache_bucket(self, key), bucket_link)
+		if (entry->key == key)
+			return entry;
+	return NULL;
+}
+
+ssize_t tile_cache_lookup(struct tile_cache* self, uint64_t key, void* dst,
+		size_t max_size)
+{
+	ssize_t result = -1;
+
+	pthread_mutex_lock(&self->mutex);
+
+	struct tile_cache_entry* entry = tile_cache_find(self, key);
+	if (entry && entry->size <= max_size) {
+		TAILQ_REMOVE(&self->lru, entry, lru_link);
+		TAILQ_INSERT_HEAD(&self->lru, entry, lru_link);
+
+		memcpy(dst, entry->data, entry->size);
+		result = entry->size;
+	}
+
+	pthread_mutex_unlock(&self->mutex);
+	return result;
+}
+
+void tile_cache_insert(struct tile_cache* self, uint64_t key,
+		const void* data, size_t size)
+{
+	if (size > self->max_bytes)
+		return;
+
+	struct tile_cache_entry* entry = malloc(sizeof(*entry) + size);
+	if (!entry)
+		return;
+
+	entry->key = key;
+	entry->size = size;
+	memcpy(entry->data, data, size);
+
+	pthread_mutex_lock(&self->mutex);
+
+	// Another thread may have encoded the same content in the meantime
+	struct tile_cache_entry* old = tile_cache_find(self, key);
+	if (old)
+		tile_cache_remove(self, old);
+
+	while (self->n_bytes + size > self->max_bytes)
+		tile_cache_remove(self, TAILQ_LAST(&self->lru, tile_cache_lru));
+
+	LIST_INSERT_HEAD(tile_cache_bucket(self, key), entry, bucket_link);
+	TAILQ_INSERT_HEAD(&self->lru, entry, lru_link);
+	self->n_bytes += size;
+
+	pthread_mutex_unlock(&self->mutex);
+}
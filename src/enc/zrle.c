@@ -21,22 +21,24 @@
 #include "frame.h"
 #include "enc/util.h"
 #include "enc/encoder.h"
+#include "enc/zrle.h"
 #include "parallel-deflate.h"
+#include "executor.h"
 
 #include <stdint.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
 #include <assert.h>
 #include <pixman.h>
-#include <aml.h>
 #include <zlib.h>
 
 #define TILE_LENGTH 64
 
 #define UDIV_UP(a, b) (((a) + (b) - 1) / (b))
 
-struct encoder* zrle_encoder_new(void);
+struct encoder* zrle_encoder_new(struct executor* executor);
 
 struct zrle_encoder {
 	struct encoder encoder;
@@ -50,8 +52,6 @@ struct zrle_encoder {
 	int n_rects;
 
 	struct parallel_deflate* zs;
-
-	struct aml_work* work;
 };
 
 struct encoder_impl encoder_impl_zrle;
@@ -62,62 +62,178 @@ static inline struct zrle_encoder* zrle_encoder(struct encoder* encoder)
 	return (struct zrle_encoder*)encoder;
 }
 
-static inline int find_colour_in_palette(uint8_t* palette, int len,
-		const uint8_t* colour, int bpp)
+#define MAX_PALETTE_SIZE 127
+#define MAX_PACKED_PALETTE_SIZE 16
+#define PALETTE_HASH_SIZE 256 // power of two, more than twice the palette
+
+/* Everything needed to estimate the size of each subencoding for a tile, which
+ * is gathered in one pass over the pixels.
+ */
+struct zrle_tile_stats {
+	int palette_size; // 0 if there are too many colours
+	uint32_t palette[MAX_PALETTE_SIZE];
+	uint8_t indices[TILE_LENGTH * TILE_LENGTH];
+	size_t n_runs;
+	size_t n_single_runs;
+	size_t run_length_bytes;
+};
+
+struct zrle_palette_hash {
+	uint32_t colour[PALETTE_HASH_SIZE];
+	int16_t index[PALETTE_HASH_SIZE];
+};
+
+static inline uint32_t zrle_read_pixel(const uint8_t* src, int bpp)
 {
-	for (int i = 0; i < len; ++i)
-		if (memcmp(palette + i * bpp, colour, bpp) == 0)
-			return i;
+	uint32_t value = 0;
+	memcpy(&value, src, bpp);
+	return value;
+}
+
+// Returns -1 if the palette is full
+static inline int zrle_palette_lookup(struct zrle_palette_hash* hash,
+		struct zrle_tile_stats* stats, uint32_t colour)
+{
+	uint32_t slot = (colour * 2654435761u) >> 24;
+
+	for (;; slot = (slot + 1) & (PALETTE_HASH_SIZE - 1)) {
+		if (hash->index[slot] < 0)
+			break;
+		if (hash->colour[slot] == colour)
+			return hash->index[slot];
+	}
+
+	if (stats->palette_size >= MAX_PALETTE_SIZE)
+		return -1;
+
+	int index = stats->palette_size++;
+	hash->colour[slot] = colour;
+	hash->index[slot] = index;
+	stats->palette[index] = colour;
+	return index;
+}
 
-	return -1;
+static inline size_t zrle_run_length_size(size_t run_length)
+{
+	return (run_length - 1) / 255 + 1;
 }
 
-static int zrle_get_tile_palette(uint8_t* palette, const uint8_t* src,
-		const int src_bpp, size_t length)
+static void zrle_analyse_tile(struct zrle_tile_stats* stats,
+		const uint8_t* src, int src_bpp, size_t length)
 {
-	int n = 0;
+	struct zrle_palette_hash hash;
+	memset(hash.index, -1, sizeof(hash.index));
 
-	/* TODO: Maybe ignore the alpha channel */
-	memcpy(palette + (n++ * src_bpp), src, src_bpp);
+	stats->palette_size = 0;
+	stats->n_runs = 0;
+	stats->n_single_runs = 0;
+	stats->run_length_bytes = 0;
+
+	bool has_palette = true;
+	uint32_t prev = zrle_read_pixel(src, src_bpp);
+	size_t run_length = 0;
 
 	for (size_t i = 0; i < length; ++i) {
-		const uint8_t* colour_addr = src + i * src_bpp;
+		uint32_t colour = zrle_read_pixel(src + i * src_bpp, src_bpp);
+
+		if (has_palette) {
+			int index = zrle_palette_lookup(&hash, stats, colour);
+			if (index >= 0)
+				stats->indices[i] = index;
+			else
+				has_palette = false;
+		}
 
-		if (find_colour_in_palette(palette, n, colour_addr, src_bpp) < 0) {
-			if (n >= 16)
-				return -1;
+		if (colour == prev && i != 0) {
+			run_length++;
+			continue;
+		}
 
-			memcpy(palette + (n++ * src_bpp), colour_addr, src_bpp);
+		if (run_length > 0) {
+			stats->n_runs++;
+			stats->n_single_runs += run_length == 1;
+			stats->run_length_bytes += zrle_run_length_size(run_length);
 		}
+
+		prev = colour;
+		run_length = 1;
 	}
 
-	return n;
+	stats->n_runs++;
+	stats->n_single_runs += run_length == 1;
+	stats->run_length_bytes += zrle_run_length_size(run_length);
+
+	if (!has_palette)
+		stats->palette_size = 0;
 }
 
-static void zrle_encode_unichrome_tile(struct vec* dst,
-		const struct rfb_pixel_format* dst_fmt,
-		uint8_t* colour,
-		const struct rfb_pixel_format* src_fmt)
+static int zrle_packed_bits(int palette_size)
 {
-	int bytes_per_cpixel = nvnc__calc_bytes_per_cpixel(dst_fmt);
-
-	vec_fast_append_8(dst, 1);
+	return palette_size <= 2 ? 1 : palette_size <= 4 ? 2 : 4;
+}
 
-	pixel_to_cpixel(((uint8_t*)dst->data) + 1, dst_fmt, colour, src_fmt,
-			bytes_per_cpixel, 1);
+static size_t zrle_estimate_size(const struct zrle_tile_stats* stats,
+		enum zrle_subencoding subencoding, int bytes_per_cpixel,
+		int width, int height)
+{
+	size_t palette_bytes = stats->palette_size * bytes_per_cpixel;
+
+	switch (subencoding) {
+	case ZRLE_RAW:
+		return 1 + (size_t)bytes_per_cpixel * width * height;
+	case ZRLE_SOLID:
+		return 1 + bytes_per_cpixel;
+	case ZRLE_PACKED_PALETTE:;
+		int bits = zrle_packed_bits(stats->palette_size);
+		return 1 + palette_bytes +
+			(size_t)height * UDIV_UP(width * bits, 8);
+	case ZRLE_PLAIN_RLE:
+		return 1 + stats->n_runs * bytes_per_cpixel +
+			stats->run_length_bytes;
+	case ZRLE_PALETTE_RLE:
+		// Runs of one are just the index
+		return 1 + palette_bytes + stats->n_runs +
+			stats->run_length_bytes - stats->n_single_runs;
+	}
 
-	dst->len += bytes_per_cpixel;
+	abort();
+	return 0;
 }
 
-static void encode_run_length(struct vec* dst, uint8_t index, int run_length)
+static enum zrle_subencoding zrle_choose_subencoding(
+		const struct zrle_tile_stats* stats, int bytes_per_cpixel,
+		int width, int height)
 {
-	if (run_length == 1) {
-		vec_fast_append_8(dst, index);
-		return;
+	if (stats->palette_size == 1)
+		return ZRLE_SOLID;
+
+	enum zrle_subencoding candidates[4];
+	int n_candidates = 0;
+
+	candidates[n_candidates++] = ZRLE_RAW;
+	candidates[n_candidates++] = ZRLE_PLAIN_RLE;
+	if (stats->palette_size > 1) {
+		candidates[n_candidates++] = ZRLE_PALETTE_RLE;
+		if (stats->palette_size <= MAX_PACKED_PALETTE_SIZE)
+			candidates[n_candidates++] = ZRLE_PACKED_PALETTE;
+	}
+
+	enum zrle_subencoding best = ZRLE_RAW;
+	size_t best_size = SIZE_MAX;
+	for (int i = 0; i < n_candidates; ++i) {
+		size_t size = zrle_estimate_size(stats, candidates[i],
+				bytes_per_cpixel, width, height);
+		if (size < best_size) {
+			best = candidates[i];
+			best_size = size;
+		}
 	}
 
-	vec_fast_append_8(dst, index | 128);
+	return best;
+}
 
+static void encode_run_length(struct vec* dst, size_t run_length)
+{
 	while (run_length > 255) {
 		vec_fast_append_8(dst, 255);
 		run_length -= 255;
@@ -126,45 +242,127 @@ static void encode_run_length(struct vec* dst, uint8_t index, int run_length)
 	vec_fast_append_8(dst, run_length - 1);
 }
 
-static void zrle_encode_packed_tile(struct vec* dst,
+static void zrle_append_palette(struct vec* dst,
 		const struct rfb_pixel_format* dst_fmt,
-		const uint8_t* src,
-		const struct rfb_pixel_format* src_fmt,
-		size_t length, uint8_t* palette,
-		int palette_size)
+		const struct zrle_tile_stats* stats,
+		const struct rfb_pixel_format* src_fmt, uint8_t* cpalette)
 {
 	int bytes_per_cpixel = nvnc__calc_bytes_per_cpixel(dst_fmt);
 	int src_bpp = src_fmt->bits_per_pixel / 8;
 
-	uint8_t cpalette[16 * 4];
-	pixel_to_cpixel(cpalette, dst_fmt, palette, src_fmt,
-			bytes_per_cpixel, palette_size);
+	uint8_t palette[MAX_PALETTE_SIZE * 4];
+	for (int i = 0; i < stats->palette_size; ++i)
+		memcpy(palette + i * src_bpp, &stats->palette[i], src_bpp);
 
-	vec_fast_append_8(dst, 128 | palette_size);
+	pixel_to_cpixel(cpalette, dst_fmt, palette, src_fmt, bytes_per_cpixel,
+			stats->palette_size);
 
-	vec_append(dst, cpalette, palette_size * bytes_per_cpixel);
+	vec_append(dst, cpalette, stats->palette_size * bytes_per_cpixel);
+}
 
-	int index;
-	int run_length = 1;
+static void zrle_encode_packed_palette_tile(struct vec* dst,
+		const struct rfb_pixel_format* dst_fmt,
+		const struct zrle_tile_stats* stats,
+		const struct rfb_pixel_format* src_fmt, int width, int height)
+{
+	uint8_t cpalette[MAX_PALETTE_SIZE * 4];
 
-	for (size_t i = 1; i < length; ++i) {
-		if (memcmp(src + i * src_bpp, src + (i - 1) * src_bpp, src_bpp) == 0) {
-			run_length++;
+	vec_fast_append_8(dst, stats->palette_size);
+	zrle_append_palette(dst, dst_fmt, stats, src_fmt, cpalette);
+
+	int bits = zrle_packed_bits(stats->palette_size);
+
+	// Pixels are packed from the most significant bit and rows are padded
+	for (int y = 0; y < height; ++y) {
+		const uint8_t* row = stats->indices + y * width;
+		uint8_t byte = 0;
+		int shift = 8;
+
+		for (int x = 0; x < width; ++x) {
+			shift -= bits;
+			byte |= row[x] << shift;
+
+			if (shift == 0) {
+				vec_fast_append_8(dst, byte);
+				byte = 0;
+				shift = 8;
+			}
+		}
+
+		if (shift != 8)
+			vec_fast_append_8(dst, byte);
+	}
+}
+
+static void zrle_encode_palette_rle_tile(struct vec* dst,
+		const struct rfb_pixel_format* dst_fmt,
+		const struct zrle_tile_stats* stats,
+		const struct rfb_pixel_format* src_fmt, size_t length)
+{
+	uint8_t cpalette[MAX_PALETTE_SIZE * 4];
+
+	vec_fast_append_8(dst, ZRLE_PLAIN_RLE | stats->palette_size);
+	zrle_append_palette(dst, dst_fmt, stats, src_fmt, cpalette);
+
+	size_t start = 0;
+	for (size_t i = 1; i <= length; ++i) {
+		if (i < length && stats->indices[i] == stats->indices[start])
 			continue;
+
+		size_t run_length = i - start;
+		uint8_t index = stats->indices[start];
+
+		if (run_length == 1) {
+			vec_fast_append_8(dst, index);
+		} else {
+			vec_fast_append_8(dst, index | 128);
+			encode_run_length(dst, run_length);
 		}
 
-		index = find_colour_in_palette(palette, palette_size, src + (i - 1) * src_bpp, src_bpp);
-		encode_run_length(dst, index, run_length);
-		run_length = 1;
+		start = i;
 	}
+}
 
-	if (run_length > 0) {
-		index = find_colour_in_palette(palette, palette_size,
-				src + (length - 1) * src_bpp, src_bpp);
-		encode_run_length(dst, index, run_length);
+static void zrle_encode_plain_rle_tile(struct vec* dst,
+		const struct rfb_pixel_format* dst_fmt, const uint8_t* src,
+		const struct rfb_pixel_format* src_fmt, size_t length)
+{
+	int bytes_per_cpixel = nvnc__calc_bytes_per_cpixel(dst_fmt);
+	int src_bpp = src_fmt->bits_per_pixel / 8;
+
+	vec_fast_append_8(dst, ZRLE_PLAIN_RLE);
+
+	size_t start = 0;
+	for (size_t i = 1; i <= length; ++i) {
+		if (i < length && memcmp(src + i * src_bpp,
+					src + start * src_bpp, src_bpp) == 0)
+			continue;
+
+		pixel_to_cpixel(((uint8_t*)dst->data) + dst->len, dst_fmt,
+				src + start * src_bpp, src_fmt,
+				bytes_per_cpixel, 1);
+		dst->len += bytes_per_cpixel;
+
+		encode_run_length(dst, i - start);
+		start = i;
 	}
 }
 
+static void zrle_encode_unichrome_tile(struct vec* dst,
+		const struct rfb_pixel_format* dst_fmt,
+		const uint8_t* colour,
+		const struct rfb_pixel_format* src_fmt)
+{
+	int bytes_per_cpixel = nvnc__calc_bytes_per_cpixel(dst_fmt);
+
+	vec_fast_append_8(dst, ZRLE_SOLID);
+
+	pixel_to_cpixel(((uint8_t*)dst->data) + 1, dst_fmt, colour, src_fmt,
+			bytes_per_cpixel, 1);
+
+	dst->len += bytes_per_cpixel;
+}
+
 static void zrle_copy_tile(uint8_t* tile, const uint8_t* src, int src_bpp,
 		int stride, int width, int height)
 {
@@ -173,42 +371,82 @@ static void zrle_copy_tile(uint8_t* tile, const uint8_t* src, int src_bpp,
 		memcpy(tile + y * width * src_bpp, src + y * byte_stride, width * src_bpp);
 }
 
-static void zrle_encode_tile(struct vec* dst,
+size_t zrle_estimate_tile_size(const uint8_t* src,
 		const struct rfb_pixel_format* dst_fmt,
-		const uint8_t* src,
-		const struct rfb_pixel_format* src_fmt,
-		size_t length)
+		const struct rfb_pixel_format* src_fmt, int width, int height,
+		enum zrle_subencoding subencoding)
 {
 	int bytes_per_cpixel = nvnc__calc_bytes_per_cpixel(dst_fmt);
 	int src_bpp = src_fmt->bits_per_pixel / 8;
-	vec_clear(dst);
-
-	uint8_t palette[16 * 4];
-	int palette_size = zrle_get_tile_palette(palette, src, src_bpp, length);
 
-	if (palette_size == 1) {
-		zrle_encode_unichrome_tile(dst, dst_fmt, &palette[0], src_fmt);
-		return;
+	struct zrle_tile_stats stats;
+	zrle_analyse_tile(&stats, src, src_bpp, width * height);
+
+	switch (subencoding) {
+	case ZRLE_SOLID:
+		if (stats.palette_size != 1)
+			return 0;
+		break;
+	case ZRLE_PACKED_PALETTE:
+		if (stats.palette_size < 2 ||
+				stats.palette_size > MAX_PACKED_PALETTE_SIZE)
+			return 0;
+		break;
+	case ZRLE_PALETTE_RLE:
+		if (stats.palette_size < 2)
+			return 0;
+		break;
+	case ZRLE_PLAIN_RLE:
+	case ZRLE_RAW:
+		break;
 	}
 
-	if (palette_size > 1) {
-		int len_before = dst->len;
-		zrle_encode_packed_tile(dst, dst_fmt, src, src_fmt,
-				length, palette, palette_size);
+	return zrle_estimate_size(&stats, subencoding, bytes_per_cpixel, width,
+			height);
+}
 
-		if (dst->len - len_before <= 1 + bytes_per_cpixel * length)
-			return;
+enum zrle_subencoding zrle_encode_tile(struct vec* dst,
+		const struct rfb_pixel_format* dst_fmt,
+		const uint8_t* src,
+		const struct rfb_pixel_format* src_fmt,
+		int width, int height)
+{
+	int bytes_per_cpixel = nvnc__calc_bytes_per_cpixel(dst_fmt);
+	int src_bpp = src_fmt->bits_per_pixel / 8;
+	size_t length = width * height;
+	vec_clear(dst);
 
-		// If a packed tile is bigger, we don't want to use it.
-		dst->len = len_before;
+	struct zrle_tile_stats stats;
+	zrle_analyse_tile(&stats, src, src_bpp, length);
+
+	enum zrle_subencoding subencoding = zrle_choose_subencoding(&stats,
+			bytes_per_cpixel, width, height);
+
+	switch (subencoding) {
+	case ZRLE_SOLID:
+		zrle_encode_unichrome_tile(dst, dst_fmt, src, src_fmt);
+		break;
+	case ZRLE_PACKED_PALETTE:
+		zrle_encode_packed_palette_tile(dst, dst_fmt, &stats, src_fmt,
+				width, height);
+		break;
+	case ZRLE_PALETTE_RLE:
+		zrle_encode_palette_rle_tile(dst, dst_fmt, &stats, src_fmt,
+				length);
+		break;
+	case ZRLE_PLAIN_RLE:
+		zrle_encode_plain_rle_tile(dst, dst_fmt, src, src_fmt, length);
+		break;
+	case ZRLE_RAW:
+		vec_fast_append_8(dst, ZRLE_RAW);
+		pixel_to_cpixel(((uint8_t*)dst->data) + 1, dst_fmt,
+				(uint8_t*)src, src_fmt, bytes_per_cpixel,
+				length);
+		dst->len += bytes_per_cpixel * length;
+		break;
 	}
 
-	vec_fast_append_8(dst, 0);
-
-	pixel_to_cpixel(((uint8_t*)dst->data) + 1, dst_fmt, (uint8_t*)src, src_fmt,
-			bytes_per_cpixel, length);
-
-	dst->len += bytes_per_cpixel * length;
+	return subencoding;
 }
 
 static int zrle_encode_box(struct zrle_encoder* self, struct vec* out,
@@ -230,7 +468,7 @@ static int zrle_encode_box(struct zrle_encoder* self, struct vec* out,
 		goto failure;
 
 	if (vec_init(&in, 1 + bytes_per_cpixel * TILE_LENGTH * TILE_LENGTH +
-				16 * 4) < 0)
+				MAX_PALETTE_SIZE * 4) < 0)
 		goto failure;
 
 	r = nvnc__encode_rect_head(out, RFB_ENCODING_ZRLE, x_pos + x, y_pos + y,
@@ -261,8 +499,8 @@ static int zrle_encode_box(struct zrle_encoder* self, struct vec* out,
 				((uint8_t*)fb->buffer->addr) + x_off + y_off, src_bpp,
 				stride, tile_width, tile_height);
 
-		zrle_encode_tile(&in, dst_fmt, tile, src_fmt,
-				tile_width * tile_height);
+		zrle_encode_tile(&in, dst_fmt, tile, src_fmt, tile_width,
+				tile_height);
 
 		parallel_deflate_feed(self->zs, out, in.data, in.len);
 	}
@@ -351,9 +589,9 @@ static int zrle_encoder_alloc_output_buffer(struct zrle_encoder* self,
 	return vec_init(dst, buffer_size);
 }
 
-static void zrle_encoder_do_work(struct aml_work* work)
+static void zrle_encoder_do_work(void* userdata)
 {
-	struct zrle_encoder* self = aml_get_userdata(work);
+	struct zrle_encoder* self = userdata;
 	int rc;
 
 	struct nvnc_composite_fb* cfb = &self->current_fb;
@@ -392,9 +630,9 @@ static void zrle_encoder_do_work(struct aml_work* work)
 		pixman_region_fini(&subregions[i]);
 }
 
-static void zrle_encoder_on_done(struct aml_work* work)
+static void zrle_encoder_on_done(void* userdata)
 {
-	struct zrle_encoder* self = aml_get_userdata(work);
+	struct zrle_encoder* self = userdata;
 
 	assert(self->current_result);
 
@@ -409,9 +647,6 @@ static void zrle_encoder_on_done(struct aml_work* work)
 	struct encoded_frame* result = self->current_result;
 	self->current_result = NULL;
 
-	aml_unref(self->work);
-	self->work = NULL;
-
 	result->metadata = metadata;
 
 	encoder_finish_frame(&self->encoder, result);
@@ -421,28 +656,26 @@ static void zrle_encoder_on_done(struct aml_work* work)
 	encoder_unref(&self->encoder);
 }
 
-struct encoder* zrle_encoder_new(void)
+struct encoder* zrle_encoder_new(struct executor* executor)
 {
 	struct zrle_encoder* self = calloc(1, sizeof(*self));
 	if (!self)
 		return NULL;
 
-	encoder_init(&self->encoder, &encoder_impl_zrle);
+	encoder_init(&self->encoder, &encoder_impl_zrle, executor);
 
 	int level = 1;
 	int window_bits = -15;
 	int mem_level = 9;
 	int strategy = Z_DEFAULT_STRATEGY;
 
-	self->zs = parallel_deflate_new(level, window_bits, mem_level,
-			strategy);
+	self->zs = parallel_deflate_new(executor, level, window_bits,
+			mem_level, strategy);
 	if (!self->zs)
 		goto deflate_failure;
 
 	pixman_region_init(&self->current_damage);
 
-	aml_require_workers(aml_get_default(), 2);
-
 	return (struct encoder*)self;
 
 deflate_failure:
@@ -455,8 +688,6 @@ static void zrle_encoder_destroy(struct encoder* encoder)
 	struct zrle_encoder* self = zrle_encoder(encoder);
 	pixman_region_fini(&self->current_damage);
 	parallel_deflate_destroy(self->zs);
-	if (self->work)
-		aml_unref(self->work);
 	if (self->current_result)
 		encoded_frame_unref(self->current_result);
 	free(self);
@@ -476,17 +707,13 @@ static int zrle_encoder_encode(struct encoder* encoder,
 
 	assert(self->current_fb.n_fbs == 0);
 
-	self->work = aml_work_new(zrle_encoder_do_work, zrle_encoder_on_done,
-			self, NULL);
-	if (!self->work)
-		return -1;
-
 	nvnc_composite_fb_copy(&self->current_fb, fb);
 	pixman_region_copy(&self->current_damage, damage);
 
 	encoder_ref(&self->encoder);
 
-	int rc = aml_start(aml_get_default(), self->work);
+	int rc = executor_submit(self->encoder.executor, EXECUTOR_STAGE_ENCODE,
+			zrle_encoder_do_work, zrle_encoder_on_done, self);
 	nvnc_assert(rc == 0, "Failed to start encoding job");
 
 	return rc;
@@ -0,0 +1,200 @@
+/*
+ * Copyright (c) 2026 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "encoding-policy.h"
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <assert.h>
+
+#define SMOOTHING 0.25
+
+// A challenger must be estimated to be this much faster than the current
+// encoding for SWITCH_HOLD consecutive frames before we switch to it.
+#define SWITCH_MARGIN 1.25
+#define SWITCH_HOLD 16
+
+enum encoding_policy_slot {
+	SLOT_RAW = 0,
+	SLOT_TIGHT,
+	SLOT_ZRLE,
+	SLOT_OPEN_H264,
+	SLOT_COUNT
+};
+
+struct encoding_stats {
+	double bytes_per_pixel;
+	double us_per_pixel;
+	bool is_measured;
+};
+
+struct encoding_prior {
+	double size_ratio; // relative to raw
+	double us_per_pixel;
+};
+
+struct encoding_policy {
+	struct encoding_stats stats[SLOT_COUNT];
+	enum rfb_encodings current;
+	bool has_current;
+	enum rfb_encodings challenger;
+	int n_challenger_votes;
+};
+
+/* Rough starting points for encodings that have not been used yet. These get
+ * replaced by measurements as soon as the encoding has produced a frame.
+ */
+static const struct encoding_prior priors[SLOT_COUNT] = {
+	[SLOT_RAW] = { .size_ratio = 1.0, .us_per_pixel = 0.001 },
+	[SLOT_TIGHT] = { .size_ratio = 0.2, .us_per_pixel = 0.01 },
+	[SLOT_ZRLE] = { .size_ratio = 0.25, .us_per_pixel = 0.015 },
+	[SLOT_OPEN_H264] = { .size_ratio = 0.02, .us_per_pixel = 0.005 },
+};
+
+static int encoding_to_slot(enum rfb_encodings encoding)
+{
+	switch (encoding) {
+	case RFB_ENCODING_RAW: return SLOT_RAW;
+	case RFB_ENCODING_TIGHT: return SLOT_TIGHT;
+	case RFB_ENCODING_ZRLE: return SLOT_ZRLE;
+	case RFB_ENCODING_OPEN_H264: return SLOT_OPEN_H264;
+	default:;
+	}
+	return -1;
+}
+
+struct encoding_policy* encoding_policy_create(void)
+{
+	return calloc(1, sizeof(struct encoding_policy));
+}
+
+void encoding_policy_destroy(struct encoding_policy* self)
+{
+	free(self);
+}
+
+static double smooth(double old, double sample, bool is_measured)
+{
+	return is_measured ? old + SMOOTHING * (sample - old) : sample;
+}
+
+void encoding_policy_feed(struct encoding_policy* self,
+		enum rfb_encodings encoding, uint32_t n_bytes, uint32_t n_pixels,
+		uint32_t encode_time)
+{
+	int slot = encoding_to_slot(encoding);
+	if (slot < 0 || n_pixels == 0)
+		return;
+
+	struct encoding_stats* stats = &self->stats[slot];
+
+	stats->bytes_per_pixel = smooth(stats->bytes_per_pixel,
+			(double)n_bytes / n_pixels, stats->is_measured);
+	stats->us_per_pixel = smooth(stats->us_per_pixel,
+			(double)encode_time / n_pixels, stats->is_measured);
+	stats->is_measured = true;
+}
+
+/* Encoders that ignore damage, such as H.264, always encode the whole frame.
+ */
+static uint32_t encoded_area(int slot,
+		const struct encoding_policy_input* input)
+{
+	return slot == SLOT_OPEN_H264 ? input->n_pixels :
+		input->n_damaged_pixels;
+}
+
+/* Estimated time from the start of encoding until the frame has been
+ * transmitted, in µs. The round-trip time is the same for all encodings, so
+ * it is left out.
+ */
+static double estimate_frame_time(const struct encoding_policy* self,
+		enum rfb_encodings encoding,
+		const struct encoding_policy_input* input)
+{
+	int slot = encoding_to_slot(encoding);
+	const struct encoding_stats* stats = &self->stats[slot];
+
+	double bytes_per_pixel = stats->is_measured ? stats->bytes_per_pixel :
+		priors[slot].size_ratio * input->bytes_per_pixel;
+	double us_per_pixel = stats->is_measured ? stats->us_per_pixel :
+		priors[slot].us_per_pixel;
+
+	uint32_t n_pixels = encoded_area(slot, input);
+	double n_bytes = bytes_per_pixel * n_pixels;
+	double encode_time = us_per_pixel * n_pixels;
+	return encode_time + n_bytes * 1e6 / input->bandwidth;
+}
+
+static bool is_candidate(enum rfb_encodings encoding,
+		const enum rfb_encodings* candidates, size_t n_candidates)
+{
+	for (size_t i = 0; i < n_candidates; ++i)
+		if (candidates[i] == encoding)
+			return true;
+	return false;
+}
+
+enum rfb_encodings encoding_policy_choose(struct encoding_policy* self,
+		const enum rfb_encodings* candidates, size_t n_candidates,
+		const struct encoding_policy_input* input)
+{
+	assert(n_candidates > 0);
+
+	if (!self->has_current || !is_candidate(self->current, candidates,
+				n_candidates)) {
+		self->current = candidates[0];
+		self->has_current = true;
+		self->n_challenger_votes = 0;
+	}
+
+	// Without a bandwidth estimate, stick with the client's preference
+	if (input->bandwidth <= 0 || input->n_pixels == 0)
+		return self->current;
+
+	enum rfb_encodings best = self->current;
+	double best_time = estimate_frame_time(self, best, input);
+	double current_time = best_time;
+
+	for (size_t i = 0; i < n_candidates; ++i) {
+		if (encoding_to_slot(candidates[i]) < 0)
+			continue;
+
+		double time = estimate_frame_time(self, candidates[i], input);
+		if (time < best_time) {
+			best = candidates[i];
+			best_time = time;
+		}
+	}
+
+	if (best == self->current ||
+			best_time * SWITCH_MARGIN > current_time) {
+		self->n_challenger_votes = 0;
+		return self->current;
+	}
+
+	if (best != self->challenger) {
+		self->challenger = best;
+		self->n_challenger_votes = 0;
+	}
+
+	if (++self->n_challenger_votes >= SWITCH_HOLD) {
+		self->current = best;
+		self->n_challenger_votes = 0;
+	}
+
+	return self->current;
+}
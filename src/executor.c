@@ -0,0 +1,597 @@
+/*
+ * Copyright (c) 2026 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include "executor.h"
+#include "sys/queue.h"
+#include "neatvnc.h"
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <aml.h>
+
+#define MAX_CPUS 1024
+
+struct executor_job {
+	struct executor* owner;
+	enum executor_stage stage;
+	executor_fn work_fn;
+	executor_fn done_fn;
+	void* userdata;
+	TAILQ_ENTRY(executor_job) link;
+};
+
+TAILQ_HEAD(executor_job_queue, executor_job);
+
+struct executor_worker {
+	struct executor_pool* pool;
+	pthread_t thread;
+	enum executor_stage home;
+	int cpu; // negative if not pinned to a single CPU
+};
+
+struct executor_config {
+	int n_workers;
+
+	int cpus[MAX_CPUS];
+	int n_cpus;
+	bool is_pinned_per_worker;
+};
+
+/* The worker threads and their queues. Executors that keep the default
+ * configuration share one pool, so that a process with many servers does not
+ * end up with many times more workers than there are CPUs.
+ */
+struct executor_pool {
+	int ref;
+	struct executor_config config;
+
+	struct executor_worker* workers;
+	int n_workers;
+	bool is_stopping;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	pthread_cond_t drained;
+	struct executor_job_queue queues[EXECUTOR_STAGE_COUNT];
+};
+
+struct executor {
+	struct aml* loop;
+
+	struct executor_config config;
+	bool is_configured;
+
+	// Set on the first submission, after which the configuration is fixed
+	_Atomic(struct executor_pool*) pool;
+
+	/* Finished jobs wait here until the loop picks them up. A byte written
+	 * to the pipe wakes up the loop. These are protected by the mutex of
+	 * the pool.
+	 */
+	struct executor_job_queue done;
+	int n_pending;
+	bool is_wakeup_pending;
+	int wakeup_fds[2];
+	struct aml_handler* wakeup_handler;
+};
+
+static pthread_mutex_t shared_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct executor_pool* shared_pool = NULL;
+
+static void executor_run_done(struct executor_job_queue* queue)
+{
+	while (!TAILQ_EMPTY(queue)) {
+		struct executor_job* job = TAILQ_FIRST(queue);
+		TAILQ_REMOVE(queue, job, link);
+
+		job->done_fn(job->userdata);
+		free(job);
+	}
+}
+
+static void executor_on_wakeup(struct aml_handler* handler)
+{
+	struct executor* self = aml_get_userdata(handler);
+	struct executor_pool* pool = atomic_load(&self->pool);
+
+	char buf[64];
+	while (read(self->wakeup_fds[0], buf, sizeof(buf)) > 0);
+
+	if (!pool)
+		return;
+
+	struct executor_job_queue done = TAILQ_HEAD_INITIALIZER(done);
+
+	pthread_mutex_lock(&pool->mutex);
+	TAILQ_CONCAT(&done, &self->done, link);
+	self->is_wakeup_pending = false;
+	pthread_mutex_unlock(&pool->mutex);
+
+	executor_run_done(&done);
+}
+
+static void executor_config_init(struct executor_config* config)
+{
+	long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	config->n_workers = n_cpus > 0 ? n_cpus : 1;
+	if (config->n_workers < EXECUTOR_STAGE_COUNT)
+		config->n_workers = EXECUTOR_STAGE_COUNT;
+}
+
+struct executor* executor_new(struct aml* loop)
+{
+	struct executor* self = calloc(1, sizeof(*self));
+	if (!self)
+		return NULL;
+
+	self->loop = loop;
+	executor_config_init(&self->config);
+	TAILQ_INIT(&self->done);
+
+	if (pipe2(self->wakeup_fds, O_CLOEXEC | O_NONBLOCK) < 0)
+		goto pipe_failure;
+
+	self->wakeup_handler = aml_handler_new(self->wakeup_fds[0],
+			executor_on_wakeup, self, NULL);
+	if (!self->wakeup_handler)
+		goto handler_failure;
+
+	if (aml_start(loop, self->wakeup_handler) < 0)
+		goto start_failure;
+
+	return self;
+
+start_failure:
+	aml_unref(self->wakeup_handler);
+handler_failure:
+	close(self->wakeup_fds[1]);
+	close(self->wakeup_fds[0]);
+pipe_failure:
+	free(self);
+	return NULL;
+}
+
+static void executor_pool_stop_workers(struct executor_pool* pool, int n)
+{
+	pthread_mutex_lock(&pool->mutex);
+	pool->is_stopping = true;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->mutex);
+
+	for (int i = 0; i < n; ++i)
+		pthread_join(pool->workers[i].thread, NULL);
+}
+
+static void executor_pool_destroy(struct executor_pool* pool)
+{
+	// Executors wait for their own jobs, so there is nothing left to run
+	executor_pool_stop_workers(pool, pool->n_workers);
+
+	free(pool->workers);
+	pthread_cond_destroy(&pool->drained);
+	pthread_cond_destroy(&pool->cond);
+	pthread_mutex_destroy(&pool->mutex);
+	free(pool);
+}
+
+static void executor_pool_unref(struct executor_pool* pool, bool is_shared)
+{
+	if (!is_shared) {
+		executor_pool_destroy(pool);
+		return;
+	}
+
+	pthread_mutex_lock(&shared_pool_mutex);
+	bool is_last = --pool->ref == 0;
+	if (is_last)
+		shared_pool = NULL;
+	pthread_mutex_unlock(&shared_pool_mutex);
+
+	if (is_last)
+		executor_pool_destroy(pool);
+}
+
+void executor_destroy(struct executor* self)
+{
+	if (!self)
+		return;
+
+	struct executor_pool* pool = atomic_load(&self->pool);
+	if (pool) {
+		/* All jobs that were submitted are run to completion, including
+		 * any that are submitted by the completion callbacks.
+		 */
+		pthread_mutex_lock(&pool->mutex);
+		for (;;) {
+			while (self->n_pending > 0)
+				pthread_cond_wait(&pool->drained, &pool->mutex);
+
+			if (TAILQ_EMPTY(&self->done))
+				break;
+
+			struct executor_job_queue done =
+				TAILQ_HEAD_INITIALIZER(done);
+			TAILQ_CONCAT(&done, &self->done, link);
+
+			pthread_mutex_unlock(&pool->mutex);
+			executor_run_done(&done);
+			pthread_mutex_lock(&pool->mutex);
+		}
+		pthread_mutex_unlock(&pool->mutex);
+
+		executor_pool_unref(pool, !self->is_configured);
+	}
+
+	aml_stop(self->loop, self->wakeup_handler);
+	aml_unref(self->wakeup_handler);
+	close(self->wakeup_fds[1]);
+	close(self->wakeup_fds[0]);
+
+	free(self);
+}
+
+struct aml* executor_get_loop(const struct executor* self)
+{
+	return self->loop;
+}
+
+int executor_set_worker_count(struct executor* self, int n)
+{
+	if (atomic_load(&self->pool))
+		return -1;
+
+	self->config.n_workers = n > EXECUTOR_STAGE_COUNT ?
+		n : EXECUTOR_STAGE_COUNT;
+	self->is_configured = true;
+	return 0;
+}
+
+int executor_set_cpus(struct executor* self, const int* cpus, size_t n)
+{
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+	if (atomic_load(&self->pool) || n > MAX_CPUS)
+		return -1;
+
+	for (size_t i = 0; i < n; ++i)
+		if (cpus[i] < 0 || cpus[i] >= CPU_SETSIZE)
+			return -1;
+
+	memcpy(self->config.cpus, cpus, n * sizeof(*cpus));
+	self->config.n_cpus = n;
+	self->config.is_pinned_per_worker = true;
+	self->is_configured = true;
+	return 0;
+#else
+	return -1;
+#endif
+}
+
+#if defined(HAVE_PTHREAD_SETAFFINITY_NP) && defined(__linux__)
+// Parses lists such as "0-3,8-11"
+static int parse_cpu_list(int* dst, int max, FILE* stream)
+{
+	int n = 0;
+	int first, last;
+	char sep;
+
+	while (fscanf(stream, "%d", &first) == 1) {
+		last = first;
+
+		if (fscanf(stream, "%c", &sep) == 1 && sep == '-') {
+			if (fscanf(stream, "%d", &last) != 1)
+				return -1;
+			if (fscanf(stream, "%c", &sep) != 1)
+				sep = '\n';
+		}
+
+		for (int cpu = first; cpu <= last; ++cpu) {
+			if (n >= max || cpu >= CPU_SETSIZE)
+				return -1;
+			dst[n++] = cpu;
+		}
+
+		if (sep != ',')
+			break;
+	}
+
+	return n;
+}
+#endif
+
+int executor_set_numa_node(struct executor* self, int node)
+{
+#if defined(HAVE_PTHREAD_SETAFFINITY_NP) && defined(__linux__)
+	if (atomic_load(&self->pool) || node < 0)
+		return -1;
+
+	char path[256];
+	snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+			node);
+
+	FILE* stream = fopen(path, "r");
+	if (!stream) {
+		nvnc_log(NVNC_LOG_WARNING, "Failed to open %s: %m", path);
+		return -1;
+	}
+
+	struct executor_config* config = &self->config;
+	int n = parse_cpu_list(config->cpus, MAX_CPUS, stream);
+	fclose(stream);
+
+	if (n <= 0) {
+		nvnc_log(NVNC_LOG_WARNING, "Failed to parse CPU list of NUMA node %d",
+				node);
+		config->n_cpus = 0;
+		return -1;
+	}
+
+	config->n_cpus = n;
+	config->is_pinned_per_worker = false;
+	self->is_configured = true;
+	return 0;
+#else
+	return -1;
+#endif
+}
+
+static void executor_worker_set_affinity(struct executor_worker* worker)
+{
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+	const struct executor_config* config = &worker->pool->config;
+	if (config->n_cpus == 0)
+		return;
+
+	cpu_set_t set;
+	CPU_ZERO(&set);
+
+	if (worker->cpu >= 0)
+		CPU_SET(worker->cpu, &set);
+	else
+		for (int i = 0; i < config->n_cpus; ++i)
+			CPU_SET(config->cpus[i], &set);
+
+	int rc = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	if (rc != 0)
+		nvnc_log(NVNC_LOG_WARNING, "Failed to set worker affinity: %s",
+				strerror(rc));
+#endif
+}
+
+static bool executor_worker_may_take(const struct executor_worker* worker,
+		enum executor_stage stage)
+{
+	/* Encoding jobs may block while waiting for compression jobs, so the
+	 * workers that are dedicated to compression must never pick them up.
+	 * Otherwise, all workers could end up waiting for each other.
+	 */
+	return !(worker->home == EXECUTOR_STAGE_COMPRESS &&
+			stage == EXECUTOR_STAGE_ENCODE);
+}
+
+// Must be called with the mutex held
+static struct executor_job* executor_worker_take(
+		struct executor_worker* worker)
+{
+	struct executor_pool* pool = worker->pool;
+	struct executor_job_queue* queue = &pool->queues[worker->home];
+
+	if (TAILQ_EMPTY(queue)) {
+		// Steal from other stages in the order of priority
+		queue = NULL;
+
+		for (int i = 0; i < EXECUTOR_STAGE_COUNT; ++i)
+			if (!TAILQ_EMPTY(&pool->queues[i]) &&
+					executor_worker_may_take(worker, i)) {
+				queue = &pool->queues[i];
+				break;
+			}
+
+		if (!queue)
+			return NULL;
+	}
+
+	struct executor_job* job = TAILQ_FIRST(queue);
+	TAILQ_REMOVE(queue, job, link);
+	return job;
+}
+
+// Must be called with the mutex of the pool held
+static void executor_finish_job(struct executor_pool* pool,
+		struct executor_job* job)
+{
+	struct executor* self = job->owner;
+
+	if (--self->n_pending == 0)
+		pthread_cond_broadcast(&pool->drained);
+
+	if (!job->done_fn) {
+		free(job);
+		return;
+	}
+
+	TAILQ_INSERT_TAIL(&self->done, job, link);
+
+	if (!self->is_wakeup_pending) {
+		self->is_wakeup_pending = true;
+
+		char byte = 0;
+		ssize_t rc = write(self->wakeup_fds[1], &byte, 1);
+		(void)rc; // A full pipe means that a wakeup is on its way anyway
+	}
+}
+
+static void* executor_worker_run(void* arg)
+{
+	struct executor_worker* worker = arg;
+	struct executor_pool* pool = worker->pool;
+
+	executor_worker_set_affinity(worker);
+
+	pthread_mutex_lock(&pool->mutex);
+
+	for (;;) {
+		struct executor_job* job = executor_worker_take(worker);
+		if (!job) {
+			if (pool->is_stopping)
+				break;
+
+			pthread_cond_wait(&pool->cond, &pool->mutex);
+			continue;
+		}
+
+		pthread_mutex_unlock(&pool->mutex);
+
+		if (job->work_fn)
+			job->work_fn(job->userdata);
+
+		pthread_mutex_lock(&pool->mutex);
+		executor_finish_job(pool, job);
+	}
+
+	pthread_mutex_unlock(&pool->mutex);
+	return NULL;
+}
+
+/* Either all workers are started or none are. With fewer workers than
+ * configured, some stage could be left without a worker that gives it
+ * priority, and nothing would ever take its jobs if that stage is compression.
+ */
+static struct executor_pool* executor_pool_new(
+		const struct executor_config* config)
+{
+	struct executor_pool* pool = calloc(1, sizeof(*pool));
+	if (!pool)
+		return NULL;
+
+	pool->ref = 1;
+	memcpy(&pool->config, config, sizeof(pool->config));
+
+	for (int i = 0; i < EXECUTOR_STAGE_COUNT; ++i)
+		TAILQ_INIT(&pool->queues[i]);
+
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+	pthread_cond_init(&pool->drained, NULL);
+
+	pool->workers = calloc(config->n_workers, sizeof(*pool->workers));
+	if (!pool->workers)
+		goto failure;
+
+	for (int i = 0; i < config->n_workers; ++i) {
+		struct executor_worker* worker = &pool->workers[i];
+		worker->pool = pool;
+		worker->home = i % EXECUTOR_STAGE_COUNT;
+		worker->cpu = config->is_pinned_per_worker && config->n_cpus > 0 ?
+			config->cpus[i % config->n_cpus] : -1;
+
+		if (pthread_create(&worker->thread, NULL, executor_worker_run,
+					worker) != 0) {
+			nvnc_log(NVNC_LOG_ERROR, "Failed to start worker thread");
+			executor_pool_stop_workers(pool, i);
+			goto failure;
+		}
+	}
+
+	pool->n_workers = config->n_workers;
+	return pool;
+
+failure:
+	free(pool->workers);
+	pthread_cond_destroy(&pool->drained);
+	pthread_cond_destroy(&pool->cond);
+	pthread_mutex_destroy(&pool->mutex);
+	free(pool);
+	return NULL;
+}
+
+static struct executor_pool* executor_get_shared_pool(
+		const struct executor_config* config)
+{
+	pthread_mutex_lock(&shared_pool_mutex);
+
+	if (shared_pool)
+		shared_pool->ref++;
+	else
+		shared_pool = executor_pool_new(config);
+
+	struct executor_pool* pool = shared_pool;
+	pthread_mutex_unlock(&shared_pool_mutex);
+	return pool;
+}
+
+static struct executor_pool* executor_get_pool(struct executor* self)
+{
+	struct executor_pool* pool = atomic_load(&self->pool);
+	if (pool)
+		return pool;
+
+	pool = self->is_configured ? executor_pool_new(&self->config) :
+		executor_get_shared_pool(&self->config);
+	if (!pool)
+		return NULL;
+
+	// Another thread may have got here first
+	struct executor_pool* expected = NULL;
+	if (!atomic_compare_exchange_strong(&self->pool, &expected, pool)) {
+		executor_pool_unref(pool, !self->is_configured);
+		return expected;
+	}
+
+	return pool;
+}
+
+int executor_submit(struct executor* self, enum executor_stage stage,
+		executor_fn work_fn, executor_fn done_fn, void* userdata)
+{
+	assert(stage < EXECUTOR_STAGE_COUNT);
+
+	struct executor_pool* pool = executor_get_pool(self);
+	if (!pool)
+		return -1;
+
+	struct executor_job* job = calloc(1, sizeof(*job));
+	if (!job)
+		return -1;
+
+	job->owner = self;
+	job->stage = stage;
+	job->work_fn = work_fn;
+	job->done_fn = done_fn;
+	job->userdata = userdata;
+
+	pthread_mutex_lock(&pool->mutex);
+
+	self->n_pending++;
+	TAILQ_INSERT_TAIL(&pool->queues[stage], job, link);
+
+	/* Workers only wait when there is nothing that they may take, and they
+	 * do not all serve the same queues, so all of them need to check.
+	 */
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->mutex);
+
+	return 0;
+}
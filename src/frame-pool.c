@@ -20,11 +20,12 @@
 #include "neatvnc.h"
 
 #include <stdlib.h>
+#include <stdatomic.h>
 
 #define EXPORT __attribute__((visibility("default")))
 
 struct nvnc_frame_pool {
-	int ref;
+	atomic_int ref;
 
 	struct nvnc_buffer_pool* buffer_pool;
 
@@ -32,6 +33,8 @@ struct nvnc_frame_pool {
 	uint16_t height;
 	int32_t stride;
 	uint32_t fourcc_format;
+
+	enum nvnc_buffer_alloc_flags alloc_flags;
 };
 
 static struct nvnc_buffer* fb_pool_buffer_alloc(
@@ -40,7 +43,7 @@ static struct nvnc_buffer* fb_pool_buffer_alloc(
 	struct nvnc_frame_pool* self = nvnc_buffer_pool_get_userdata(pool);
 	uint32_t bpp = nvnc__pixel_size_from_fourcc(self->fourcc_format);
 	size_t size = (size_t)self->height * self->stride * bpp;
-	return nvnc_buffer_new(size);
+	return nvnc_buffer_new_with_flags(size, self->alloc_flags);
 }
 
 EXPORT
@@ -95,6 +98,21 @@ bool nvnc_frame_pool_resize(struct nvnc_frame_pool* self, uint16_t width,
 	return true;
 }
 
+EXPORT
+void nvnc_frame_pool_set_alloc_flags(struct nvnc_frame_pool* self,
+		enum nvnc_buffer_alloc_flags flags)
+{
+	if (flags == self->alloc_flags)
+		return;
+
+	self->alloc_flags = flags;
+
+	// Start over with a new pool so that no buffers are reused
+	nvnc_buffer_pool_unref(self->buffer_pool);
+	self->buffer_pool = nvnc_buffer_pool_new(fb_pool_buffer_alloc);
+	nvnc_buffer_pool_set_userdata(self->buffer_pool, self, NULL);
+}
+
 EXPORT
 void nvnc_frame_pool_ref(struct nvnc_frame_pool* self)
 {
@@ -84,6 +84,33 @@ struct nvnc_frame* nvnc_frame_from_buffer(struct nvnc_buffer* buffer, uint16_t w
 	return fb;
 }
 
+/* A view shares the buffer of its parent, but has its own position and logical
+ * size, so that the same frame can be placed differently on several displays.
+ */
+struct nvnc_frame* nvnc_frame_new_view(struct nvnc_frame* parent)
+{
+	struct nvnc_frame* fb = nvnc_frame_from_buffer(parent->buffer,
+			parent->width, parent->height, parent->fourcc_format,
+			parent->stride);
+	if (!fb)
+		return NULL;
+
+	fb->parent = parent;
+	nvnc_frame_ref(parent);
+
+	// The parent's cleanup function runs when the parent is freed
+	fb->userdata = parent->userdata;
+	fb->x_off = parent->x_off;
+	fb->y_off = parent->y_off;
+	fb->logical_width = parent->logical_width;
+	fb->logical_height = parent->logical_height;
+	fb->transform = parent->transform;
+	fb->pts = parent->pts;
+	pixman_region_copy(&fb->damage, &parent->damage);
+
+	return fb;
+}
+
 EXPORT
 struct nvnc_frame* nvnc_frame_from_raw(void* buffer, uint16_t width, uint16_t height,
 		uint32_t fourcc_format, int32_t stride)
@@ -231,6 +258,7 @@ static void nvnc__fb_free(struct nvnc_frame* fb)
 
 	nvnc_buffer_unref(fb->buffer);
 	pixman_region_fini(&fb->damage);
+	nvnc_frame_unref(fb->parent);
 	free(fb);
 }
 
@@ -18,11 +18,11 @@
 #include "vec.h"
 #include "sys/queue.h"
 #include "neatvnc.h"
+#include "executor.h"
 
 #include <stdlib.h>
 #include <stdbool.h>
 #include <assert.h>
-#include <aml.h>
 #include <zlib.h>
 #include <string.h>
 #include <arpa/inet.h>
@@ -44,6 +44,7 @@ struct output_chunk {
 TAILQ_HEAD(output_chunk_list, output_chunk);
 
 struct parallel_deflate {
+	struct executor* executor;
 	int level, window_bits, mem_level, strategy;
 	uint32_t seq;
 	uint32_t start_seq;
@@ -72,8 +73,8 @@ static void output_chunk_list_unlock(struct parallel_deflate* self)
 	pthread_mutex_unlock(&self->output_chunk_mutex);
 }
 
-struct parallel_deflate* parallel_deflate_new(int level, int window_bits,
-		int mem_level, int strategy)
+struct parallel_deflate* parallel_deflate_new(struct executor* executor,
+		int level, int window_bits, int mem_level, int strategy)
 {
 	struct parallel_deflate* self = calloc(1, sizeof(*self));
 	if (!self)
@@ -81,6 +82,7 @@ struct parallel_deflate* parallel_deflate_new(int level, int window_bits,
 
 	assert(window_bits < 0);
 
+	self->executor = executor;
 	self->level = level;
 	self->window_bits = window_bits;
 	self->mem_level = mem_level;
@@ -173,9 +175,9 @@ static bool consolidate_complete_chunk_segments(struct parallel_deflate* self,
 	return have_end_chunk;
 }
 
-static void do_work(struct aml_work* work)
+static void do_work(void* userdata)
 {
-	struct deflate_job* job = aml_get_userdata(work);
+	struct deflate_job* job = userdata;
 	struct parallel_deflate* self = job->parent;
 
 	// TODO: Maintain 32K input window for dictionary
@@ -219,10 +221,9 @@ static void schedule_deflate_job(struct parallel_deflate* self,
 	vec_init(&job->input, len);
 	vec_append(&job->input, input, len);
 
-	struct aml_work* work = aml_work_new(do_work, NULL, job,
-			deflate_job_destroy);
-	aml_start(aml_get_default(), work);
-	aml_unref(work);
+	rc = executor_submit(self->executor, EXECUTOR_STAGE_COMPRESS,
+			do_work, deflate_job_destroy, job);
+	nvnc_assert(rc == 0, "Failed to start deflate job");
 }
 
 void parallel_deflate_feed(struct parallel_deflate* self, struct vec* out,
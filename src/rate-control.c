@@ -0,0 +1,149 @@
+/*
+ * Copyright (c) 2026 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "rate-control.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <assert.h>
+#include <tgmath.h>
+
+#define MAX_DELAY 33.333e-3 // s
+#define SIZE_SMOOTHING 0.25
+
+// Assumed growth in encoded size per quality level for levels that have not
+// been measured yet.
+#define LEVEL_SIZE_RATIO 1.2
+
+// Stepping up requires this much headroom in the budget
+#define UPGRADE_HEADROOM 1.25
+
+// Number of consecutive frames with headroom before stepping up
+#define UPGRADE_HOLD 8
+
+struct rate_control {
+	double bytes_per_pixel[RATE_CONTROL_QUALITY_LEVELS];
+	int quality;
+	int n_upgrade_votes;
+};
+
+struct rate_control* rate_control_create(void)
+{
+	struct rate_control* self = calloc(1, sizeof(*self));
+	if (!self)
+		return NULL;
+
+	self->quality = -1;
+
+	return self;
+}
+
+void rate_control_destroy(struct rate_control* self)
+{
+	free(self);
+}
+
+static double estimate_bytes_per_pixel(const struct rate_control* self,
+		int quality)
+{
+	if (self->bytes_per_pixel[quality] > 0)
+		return self->bytes_per_pixel[quality];
+
+	// Extrapolate from the nearest level that has been measured
+	for (int d = 1; d < RATE_CONTROL_QUALITY_LEVELS; ++d) {
+		int lower = quality - d;
+		int upper = quality + d;
+
+		if (lower >= 0 && self->bytes_per_pixel[lower] > 0)
+			return self->bytes_per_pixel[lower] *
+				pow(LEVEL_SIZE_RATIO, d);
+
+		if (upper < RATE_CONTROL_QUALITY_LEVELS &&
+				self->bytes_per_pixel[upper] > 0)
+			return self->bytes_per_pixel[upper] /
+				pow(LEVEL_SIZE_RATIO, d);
+	}
+
+	return 0;
+}
+
+void rate_control_feed(struct rate_control* self, int quality,
+		uint32_t n_bytes, uint32_t n_pixels)
+{
+	if (quality < 0 || quality >= RATE_CONTROL_QUALITY_LEVELS ||
+			n_pixels == 0)
+		return;
+
+	double sample = (double)n_bytes / n_pixels;
+	double* bpp = &self->bytes_per_pixel[quality];
+
+	*bpp = *bpp > 0 ? *bpp + SIZE_SMOOTHING * (sample - *bpp) : sample;
+}
+
+static double estimate_frame_size(const struct rate_control* self,
+		int quality, uint32_t n_pixels)
+{
+	return estimate_bytes_per_pixel(self, quality) * n_pixels;
+}
+
+int rate_control_get_quality(struct rate_control* self,
+		const struct rate_control_input* input)
+{
+	int min_quality = input->min_quality;
+	int max_quality = input->max_quality;
+
+	assert(0 <= min_quality && min_quality <= max_quality &&
+			max_quality < RATE_CONTROL_QUALITY_LEVELS);
+
+	if (self->quality < 0 || self->quality > max_quality)
+		self->quality = max_quality;
+	else if (self->quality < min_quality)
+		self->quality = min_quality;
+
+	if (input->bandwidth <= 0 || input->n_pixels == 0)
+		return self->quality;
+
+	double rtt = input->min_rtt != INT32_MAX ? input->min_rtt * 1e-6 : 0;
+	double budget = input->bandwidth * (MAX_DELAY + rtt) -
+		input->inflight_bytes;
+
+	int target = min_quality;
+	for (int q = max_quality; q > min_quality; --q)
+		if (estimate_frame_size(self, q, input->n_pixels) <= budget) {
+			target = q;
+			break;
+		}
+
+	if (target < self->quality) {
+		// Back off immediately under congestion
+		self->quality = target;
+		self->n_upgrade_votes = 0;
+	} else if (target > self->quality) {
+		// Recover slowly, one level at a time, so that the quality does
+		// not oscillate around the capacity of the link.
+		double next_size = estimate_frame_size(self, self->quality + 1,
+				input->n_pixels);
+		if (next_size * UPGRADE_HEADROOM <= budget &&
+				++self->n_upgrade_votes >= UPGRADE_HOLD) {
+			self->quality++;
+			self->n_upgrade_votes = 0;
+		}
+	} else {
+		self->n_upgrade_votes = 0;
+	}
+
+	return self->quality;
+}
@@ -45,6 +45,11 @@ void nvnc_region_scale(struct pixman_region16* dst, struct pixman_region16* src,
 	}
 }
 
+int nvnc_scale_coordinate(int value, double scale)
+{
+	return lround(value * scale);
+}
+
 void nvnc_region_translate(struct pixman_region16* dst,
 		struct pixman_region16* src, int x, int y)
 {
@@ -28,11 +28,16 @@
 #include "enc/encoder.h"
 #include "enc/util.h"
 #include "enc/h264-encoder.h"
+#include "enc/tile-cache.h"
 #include "cursor.h"
 #include "logging.h"
 #include "auth/auth.h"
 #include "bandwidth.h"
+#include "rate-control.h"
+#include "encoding-policy.h"
 #include "compositor.h"
+#include "executor.h"
+#include "region.h"
 #include "transform-util.h"
 #include "type-macros.h"
 #include "server.h"
@@ -41,6 +46,7 @@
 #include <stdlib.h>
 #include <inttypes.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/queue.h>
 #include <sys/param.h>
 #include <assert.h>
@@ -80,6 +86,14 @@
 
 #define DEFAULT_NAME "Neat VNC"
 #define HANDSHAKE_TIMEOUT 30000000 // µs
+#define DEFAULT_ACCEPT_BATCH_SIZE 16
+#define MIN_ADAPTIVE_QUALITY 2
+
+// Half the side of the region of interest around the pointer
+#define ROI_POINTER_RADIUS 96
+
+// Encoded tiles that are shared between clients
+#define TILE_CACHE_SIZE (32 * 1024 * 1024)
 
 #define EXPORT __attribute__((visibility("default")))
 
@@ -89,7 +103,7 @@ static bool client_supports_resizing(const struct nvnc_client* client);
 static bool send_ext_support_frame(struct nvnc_client* client);
 static void send_ext_clipboard_caps(struct nvnc_client* client);
 static enum rfb_encodings choose_frame_encoding(struct nvnc_client* client,
-		const struct nvnc_composite_fb*);
+		const struct nvnc_composite_fb*, struct pixman_region16* damage);
 static void on_encode_frame_done(struct encoder*, struct encoded_frame*);
 static bool client_has_encoding(const struct nvnc_client* client,
 		enum rfb_encodings encoding);
@@ -156,8 +170,8 @@ static void client_drain_encoder(struct nvnc_client* client)
 	int64_t start_time = gettime_us(CLOCK_MONOTONIC);
 
 	while (client->is_updating) {
-		aml_poll(aml_get_default(), remaining);
-		aml_dispatch(aml_get_default());
+		aml_poll(client->server->loop, remaining);
+		aml_dispatch(client->server->loop);
 
 		int64_t now = gettime_us(CLOCK_MONOTONIC);
 		int64_t dt = now - start_time;
@@ -169,21 +183,107 @@ static void client_drain_encoder(struct nvnc_client* client)
 	}
 }
 
+static void collect_scaled_outputs(struct nvnc* server)
+{
+	struct nvnc__scaled_output* output;
+	struct nvnc__scaled_output* tmp;
+	LIST_FOREACH_SAFE(output, &server->scaled_outputs, link, tmp) {
+		// Outputs that are still compositing are collected later
+		if (output->ref > 0 || !compositor_is_idle(output->compositor))
+			continue;
+
+		LIST_REMOVE(output, link);
+		compositor_destroy(output->compositor);
+		free(output);
+	}
+}
+
+static struct nvnc__scaled_output* scaled_output_get(struct nvnc* server,
+		double scale)
+{
+	collect_scaled_outputs(server);
+
+	struct nvnc__scaled_output* output;
+	LIST_FOREACH(output, &server->scaled_outputs, link)
+		if (output->scale == scale) {
+			output->ref++;
+			return output;
+		}
+
+	output = calloc(1, sizeof(*output));
+	if (!output)
+		return NULL;
+
+	output->compositor = compositor_create_scaled(server->executor,
+			scale);
+	if (!output->compositor) {
+		free(output);
+		return NULL;
+	}
+
+	output->scale = scale;
+	output->ref = 1;
+	LIST_INSERT_HEAD(&server->scaled_outputs, output, link);
+
+	return output;
+}
+
+static void scaled_output_unref(struct nvnc* server,
+		struct nvnc__scaled_output* output)
+{
+	if (!output)
+		return;
+
+	assert(output->ref > 0);
+	output->ref--;
+	collect_scaled_outputs(server);
+}
+
+static struct compositor* client_get_compositor(
+		const struct nvnc_client* client)
+{
+	return client->scaled_output ? client->scaled_output->compositor :
+		client->server->compositor;
+}
+
+static double client_get_output_scale(const struct nvnc_client* client)
+{
+	return client->scaled_output ? client->scaled_output->scale : 1.0;
+}
+
+static void client_cancel_compositing(struct nvnc_client* client)
+{
+	struct nvnc* server = client->server;
+
+	// A frame may still be underway from before the scale was changed
+	compositor_cancel(server->compositor, client);
+
+	struct nvnc__scaled_output* output;
+	LIST_FOREACH(output, &server->scaled_outputs, link)
+		compositor_cancel(output->compositor, client);
+}
+
 static void client_close(struct nvnc_client* client)
 {
 	if (client->close_task) {
 		struct aml_idle* task = client->close_task;
 		client->close_task = NULL;
-		aml_stop(aml_get_default(), task);
+		aml_stop(client->server->loop, task);
 		aml_unref(task);
 	}
 
 	if (client->handshake_timer) {
-		aml_stop(aml_get_default(), client->handshake_timer);
+		aml_stop(client->server->loop, client->handshake_timer);
 		aml_timer_unref(client->handshake_timer);
 		client->handshake_timer = NULL;
 	}
 
+	if (client->refresh_timer) {
+		aml_stop(client->server->loop, client->refresh_timer);
+		aml_timer_unref(client->refresh_timer);
+		client->refresh_timer = NULL;
+	}
+
 	weakref_subject_deinit(&client->weakref);
 
 	nvnc_log(NVNC_LOG_INFO, "Closing client connection %p", client);
@@ -197,8 +297,11 @@ static void client_close(struct nvnc_client* client)
 	if (cleanup)
 		cleanup(client->userdata);
 
-	compositor_destroy(client->compositor);
+	client_cancel_compositing(client);
+	scaled_output_unref(client->server, client->scaled_output);
 	bwe_destroy(client->bwe);
+	rate_control_destroy(client->rate_control);
+	encoding_policy_destroy(client->encoding_policy);
 
 #ifdef HAVE_CRYPTO
 	crypto_key_del(client->apple_dh_secret);
@@ -217,6 +320,8 @@ static void client_close(struct nvnc_client* client)
 	encoder_unref(client->encoder);
 	encoder_unref(client->zrle_encoder);
 	encoder_unref(client->tight_encoder);
+	pixman_region_fini(&client->update_refresh_region);
+	pixman_region_fini(&client->refresh_region);
 	pixman_region_fini(&client->damage);
 	free(client->known_layout);
 	free(client->cut_text.buffer);
@@ -227,7 +332,7 @@ static void do_deferred_client_close(struct aml_idle* idle)
 {
 	struct nvnc_client* client = aml_get_userdata(idle);
 	client->close_task = NULL;
-	aml_stop(aml_get_default(), idle);
+	aml_stop(client->server->loop, idle);
 	aml_unref(idle);
 
 	client_close(client);
@@ -239,7 +344,7 @@ static void defer_client_close(struct nvnc_client* client)
 		return;
 	client->close_task = aml_idle_new(do_deferred_client_close, client,
 			NULL);
-	aml_start(aml_get_default(), client->close_task);
+	aml_start(client->server->loop, client->close_task);
 }
 
 static int handle_unsupported_version(struct nvnc_client* client)
@@ -609,6 +714,28 @@ static struct nvnc_desktop_layout* build_desktop_layout(
 	return layout;
 }
 
+static void scale_desktop_layout(struct nvnc_desktop_layout* layout,
+		double scale)
+{
+	if (scale == 1.0)
+		return;
+
+	layout->width = nvnc_scale_coordinate(layout->width, scale);
+	layout->height = nvnc_scale_coordinate(layout->height, scale);
+
+	for (int i = 0; i < layout->n_display_layouts; ++i) {
+		struct nvnc_display_layout* dl = &layout->display_layouts[i];
+
+		uint16_t x = nvnc_scale_coordinate(dl->x_pos, scale);
+		uint16_t y = nvnc_scale_coordinate(dl->y_pos, scale);
+		dl->width = nvnc_scale_coordinate(dl->x_pos + dl->width, scale) - x;
+		dl->height = nvnc_scale_coordinate(dl->y_pos + dl->height, scale)
+			- y;
+		dl->x_pos = x;
+		dl->y_pos = y;
+	}
+}
+
 static int send_server_init_message(struct nvnc_client* client)
 {
 	struct nvnc* server = client->server;
@@ -698,7 +825,7 @@ static int on_init_message(struct nvnc_client* client)
 			client, client->min_rtt / 1000);
 
 	if (client->handshake_timer) {
-		aml_stop(aml_get_default(), client->handshake_timer);
+		aml_stop(client->server->loop, client->handshake_timer);
 		aml_timer_unref(client->handshake_timer);
 		client->handshake_timer = NULL;
 	}
@@ -1003,11 +1130,12 @@ static const char* encoding_to_string(enum rfb_encodings encoding)
 }
 
 static bool ensure_encoder(struct nvnc_client* client,
-		const struct nvnc_composite_fb *fb)
+		const struct nvnc_composite_fb *fb,
+		struct pixman_region16* damage)
 {
 	struct nvnc* server = client->server;
 
-	enum rfb_encodings encoding = choose_frame_encoding(client, fb);
+	enum rfb_encodings encoding = choose_frame_encoding(client, fb, damage);
 	if (client->encoder && encoding == encoder_get_type(client->encoder))
 		return true;
 
@@ -1028,7 +1156,9 @@ static bool ensure_encoder(struct nvnc_client* client,
 	case RFB_ENCODING_ZRLE:
 		if (!client->zrle_encoder) {
 			client->zrle_encoder =
-				encoder_new(encoding, width, height);
+				encoder_new(server->executor,
+						server->tile_cache, encoding,
+						width, height);
 		}
 		client->encoder = client->zrle_encoder;
 		encoder_ref(client->encoder);
@@ -1036,13 +1166,16 @@ static bool ensure_encoder(struct nvnc_client* client,
 	case RFB_ENCODING_TIGHT:
 		if (!client->tight_encoder) {
 			client->tight_encoder =
-				encoder_new(encoding, width, height);
+				encoder_new(server->executor,
+						server->tile_cache, encoding,
+						width, height);
 		}
 		client->encoder = client->tight_encoder;
 		encoder_ref(client->encoder);
 		break;
 	default:
-		client->encoder = encoder_new(encoding, width, height);
+		client->encoder = encoder_new(server->executor,
+				server->tile_cache, encoding, width, height);
 		break;
 	}
 
@@ -1069,20 +1202,138 @@ static int decrement_pending_requests(struct nvnc_client* client)
 	return --client->n_pending_requests;
 }
 
+/* Feed congestion data from the kernel into the bandwidth estimator. This
+ * works for all clients, whether they support fences or not.
+ */
+static void client_update_link_info(struct nvnc_client* client)
+{
+	const struct stream_link_info* info = &client->net_stream->link_info;
+	if (info->seq == client->link_info_seq)
+		return;
+	client->link_info_seq = info->seq;
+
+	if (info->min_rtt != 0 && info->min_rtt < (uint32_t)client->min_rtt) {
+		client->min_rtt = info->min_rtt;
+		bwe_update_rtt_min(client->bwe, info->min_rtt);
+	}
+
+	bwe_feed_delivery_rate(client->bwe, info->delivery_rate,
+			info->is_app_limited);
+}
+
+static int client_get_max_inflight(const struct nvnc_client* client)
+{
+	int bandwidth = bwe_get_estimate(client->bwe);
+	if (bandwidth == 0)
+		return 0;
+
+	double max_delay = 33.333e-3;
+	return round(bandwidth * (max_delay + client->min_rtt * 1e-6));
+}
+
+static bool encoder_supports_rate_control(const struct encoder* encoder)
+{
+	switch (encoder_get_type(encoder)) {
+	case RFB_ENCODING_TIGHT:
+	case RFB_ENCODING_OPEN_H264:
+		return true;
+	default:;
+	}
+	return false;
+}
+
+/* The quality requested by the client is used as a ceiling. Lossless clients
+ * are left alone.
+ */
+static int client_choose_quality(struct nvnc_client* client,
+		uint32_t n_pixels)
+{
+	if (client->quality >= 10 || !client->rate_control ||
+			!encoder_supports_rate_control(client->encoder))
+		return client->quality;
+
+	struct rate_control_input input = {
+		.bandwidth = bwe_get_estimate(client->bwe),
+		.inflight_bytes = client->inflight_bytes,
+		.min_rtt = client->min_rtt,
+		.n_pixels = n_pixels,
+		.min_quality = MIN(MIN_ADAPTIVE_QUALITY, client->quality),
+		.max_quality = client->quality,
+	};
+	return rate_control_get_quality(client->rate_control, &input);
+}
+
+/* The area around the pointer and the application's focus rectangle get a
+ * higher quality than the rest of the frame. The rate control sees the extra
+ * bytes in its measurements, so the rest of the frame makes room for them.
+ */
+static void client_update_roi(struct nvnc_client* client)
+{
+	struct nvnc* server = client->server;
+
+	struct pixman_region16 roi;
+	pixman_region_init(&roi);
+
+	// Clients that haven't asked for lossy encoding may not support it
+	int quality = server->roi_quality;
+	if (client->quality >= 10 || client->is_refresh_update)
+		goto done;
+
+	if (quality >= 0 && client->has_pointer_position)
+		pixman_region_union_rect(&roi, &roi,
+				client->pointer_x - ROI_POINTER_RADIUS,
+				client->pointer_y - ROI_POINTER_RADIUS,
+				2 * ROI_POINTER_RADIUS, 2 * ROI_POINTER_RADIUS);
+
+	if (quality >= 0 && server->focus_rect.width &&
+			server->focus_rect.height) {
+		double scale = client_get_output_scale(client);
+		int x1 = nvnc_scale_coordinate(server->focus_rect.x, scale);
+		int y1 = nvnc_scale_coordinate(server->focus_rect.y, scale);
+		int x2 = nvnc_scale_coordinate(server->focus_rect.x +
+				server->focus_rect.width, scale);
+		int y2 = nvnc_scale_coordinate(server->focus_rect.y +
+				server->focus_rect.height, scale);
+		pixman_region_union_rect(&roi, &roi, x1, y1, x2 - x1, y2 - y1);
+	}
+
+	/* Lossy areas that are refreshed as a part of a regular update are sent
+	 * losslessly, along with the rest of the region of interest.
+	 */
+	if (pixman_region_not_empty(&client->update_refresh_region)) {
+		pixman_region_union(&roi, &roi, &client->update_refresh_region);
+		quality = 10;
+	}
+
+done:
+	encoder_set_roi(client->encoder, &roi, MIN(quality, 10));
+	pixman_region_fini(&roi);
+}
+
 static void on_compositing_done(struct nvnc_composite_fb* cfb,
 		struct pixman_region16* frame_damage, void* userdata)
 {
 	struct nvnc_client* client = userdata;
 
-	if (!ensure_encoder(client, cfb)) {
+	if (!ensure_encoder(client, cfb, frame_damage)) {
 		nvnc_log(NVNC_LOG_ERROR, "Failed to set up encoder");
 		return;
 	}
 
-	encoder_set_quality(client->encoder, client->quality);
+	client->update_area = (client->encoder->impl->flags &
+			ENCODER_IMPL_FLAG_IGNORES_DAMAGE) ?
+		(uint32_t)nvnc_composite_fb_width(cfb) *
+			nvnc_composite_fb_height(cfb) :
+		nvnc__calculate_region_area(frame_damage);
+	client->update_quality = client->is_refresh_update ? 10 :
+		client_choose_quality(client, client->update_area);
+
+	encoder_set_quality(client->encoder, client->update_quality);
+	client_update_roi(client);
 	encoder_set_output_format(client->encoder, &client->pixfmt);
 	client->encoder->on_done = on_encode_frame_done;
 	client->encoder->userdata = client;
+	client->encode_start_time = gettime_us(CLOCK_MONOTONIC);
 
 	if (encoder_encode(client->encoder, cfb, frame_damage) >= 0) {
 		if (client->n_pending_requests > 0)
@@ -1121,13 +1372,15 @@ static bool client_has_damage(struct nvnc_client* client)
 }
 
 static void attach_desktop_layout_to_frame(const struct nvnc* server,
-		struct nvnc_composite_fb* cfb)
+		struct nvnc_composite_fb* cfb, double scale)
 {
 	struct nvnc_desktop_layout* layout = build_desktop_layout(server,
 			nvnc_composite_fb_width(cfb),
 			nvnc_composite_fb_height(cfb));
 	assert(layout);
 
+	scale_desktop_layout(layout, scale);
+
 	if (!cfb->metadata)
 		cfb->metadata = nvnc_frame_metadata_new();
 
@@ -1147,7 +1400,12 @@ static void process_fb_update_requests(struct nvnc_client* client)
 	if (!have_display_buffers(server))
 		return;
 
-	if (client->is_updating)
+	/* Only one frame is encoded at a time so that the encoders' zlib
+	 * streams stay in order, but the next frame may be encoded while
+	 * earlier ones are still being transmitted.
+	 */
+	if (client->is_updating ||
+			client->n_outgoing_frames >= MAX_OUTGOING_FRAMES)
 		return;
 
 	if (!client->continuous_updates_enabled &&
@@ -1186,12 +1444,10 @@ static void process_fb_update_requests(struct nvnc_client* client)
 	if (!client_has_damage(client))
 		return;
 
-	int bandwidth = bwe_get_estimate(client->bwe);
-	if (bandwidth != 0) {
-		double max_delay = 33.333e-3;
-		int max_inflight = round(bandwidth *
-				(max_delay + client->min_rtt * 1e-6));
+	client_update_link_info(client);
 
+	int max_inflight = client_get_max_inflight(client);
+	if (max_inflight != 0) {
 		// If there is already more data inflight than the link can
 		// handle, let's not put more load on it:
 		if (client->inflight_bytes > max_inflight) {
@@ -1200,6 +1456,14 @@ static void process_fb_update_requests(struct nvnc_client* client)
 		}
 	}
 
+	// Hold off until the socket has drained, so that the update doesn't
+	// get stuck behind older data in the send buffer.
+	if (client->has_notsent_lowat &&
+			!stream_is_drained(client->net_stream)) {
+		stream_notify_writable(client->net_stream);
+		return;
+	}
+
 	struct nvnc_composite_fb cfb = {
 		.n_fbs = server->n_displays
 	};
@@ -1211,7 +1475,8 @@ static void process_fb_update_requests(struct nvnc_client* client)
 
 	nvnc_composite_fb_validate(&cfb);
 
-	attach_desktop_layout_to_frame(server, &cfb);
+	double scale = client_get_output_scale(client);
+	attach_desktop_layout_to_frame(server, &cfb, scale);
 
 	DTRACE_PROBE1(neatvnc, update_fb_start, client);
 
@@ -1219,6 +1484,23 @@ static void process_fb_update_requests(struct nvnc_client* client)
 	struct pixman_region16 damage = client->damage;
 	pixman_region_init(&client->damage);
 
+	/* An update that consists only of refreshed areas is sent losslessly as
+	 * a whole. Otherwise, the refreshed areas are sent losslessly as a
+	 * region of interest.
+	 */
+	pixman_region_copy(&client->update_refresh_region,
+			&client->refresh_region);
+	pixman_region_clear(&client->refresh_region);
+
+	struct pixman_region16 regular_damage;
+	pixman_region_init(&regular_damage);
+	pixman_region_subtract(&regular_damage, &damage,
+			&client->update_refresh_region);
+	client->is_refresh_update =
+		pixman_region_not_empty(&client->update_refresh_region) &&
+		!pixman_region_not_empty(&regular_damage);
+	pixman_region_fini(&regular_damage);
+
 	client->is_updating = true;
 	client->formats_changed = false;
 
@@ -1229,11 +1511,11 @@ static void process_fb_update_requests(struct nvnc_client* client)
 	 * region.
 	 */
 	pixman_region_intersect_rect(&damage, &damage, 0, 0,
-			nvnc_composite_fb_width(&cfb),
-			nvnc_composite_fb_height(&cfb));
+			nvnc_scale_coordinate(nvnc_composite_fb_width(&cfb), scale),
+			nvnc_scale_coordinate(nvnc_composite_fb_height(&cfb), scale));
 
-	compositor_feed(client->compositor, &cfb, &damage, on_compositing_done,
-			client);
+	compositor_feed(client_get_compositor(client), &cfb, &damage,
+			on_compositing_done, client);
 
 	nvnc_frame_metadata_unref(cfb.metadata);
 	pixman_region_fini(&damage);
@@ -1389,6 +1671,19 @@ static int on_client_pointer_event(struct nvnc_client* client)
 	uint16_t x = ntohs(msg->x);
 	uint16_t y = ntohs(msg->y);
 
+	client->has_pointer_position = true;
+	client->pointer_x = x;
+	client->pointer_y = y;
+
+	double scale = client_get_output_scale(client);
+	if (scale != 1.0) {
+		uint16_t desktop_width, desktop_height;
+		calculate_desktop_extents(server, &desktop_width,
+				&desktop_height);
+		x = MIN(floor((x + 0.5) / scale), desktop_width - 1);
+		y = MIN(floor((y + 0.5) / scale), desktop_height - 1);
+	}
+
 	nvnc_pointer_fn fn = server->pointer_fn;
 	if (fn)
 		fn(client, x, y, button_mask);
@@ -1954,6 +2249,68 @@ static enum rfb_resize_status check_desktop_layout(struct nvnc_client* client,
 	return RFB_RESIZE_STATUS_REQUEST_FORWARDED;
 }
 
+static int client_set_output_scale(struct nvnc_client* client, double scale)
+{
+	struct nvnc* server = client->server;
+
+	if (!(scale > 0 && scale <= 1))
+		return -1;
+
+	if (scale == client_get_output_scale(client))
+		return 0;
+
+	struct nvnc__scaled_output* output = NULL;
+	if (scale != 1.0) {
+		output = scaled_output_get(server, scale);
+		if (!output)
+			return -1;
+	}
+
+	struct nvnc__scaled_output* old_output = client->scaled_output;
+	client->scaled_output = output;
+	scaled_output_unref(server, old_output);
+
+	/* The damage is in the old coordinates. The resize that follows damages
+	 * the whole desktop anyway.
+	 */
+	uint16_t width, height;
+	calculate_desktop_extents(server, &width, &height);
+	pixman_region_clear(&client->damage);
+	pixman_region_union_rect(&client->damage, &client->damage, 0, 0,
+			nvnc_scale_coordinate(width, scale),
+			nvnc_scale_coordinate(height, scale));
+
+	return 0;
+}
+
+/* A client that asks for a smaller desktop of the same aspect ratio gets the
+ * desktop scaled down to that size instead.
+ */
+static struct nvnc_desktop_layout* resize_by_scaling(
+		struct nvnc_client* client, uint16_t width, uint16_t height)
+{
+	struct nvnc* server = client->server;
+
+	uint16_t desktop_width, desktop_height;
+	calculate_desktop_extents(server, &desktop_width, &desktop_height);
+
+	if (width == 0 || width > desktop_width)
+		return NULL;
+
+	double scale = (double)width / desktop_width;
+	if (abs(nvnc_scale_coordinate(desktop_height, scale) - height) > 1)
+		return NULL;
+
+	if (client_set_output_scale(client, scale) < 0)
+		return NULL;
+
+	struct nvnc_desktop_layout* layout = build_desktop_layout(server,
+			desktop_width, desktop_height);
+	if (layout)
+		scale_desktop_layout(layout, scale);
+	return layout;
+}
+
 static const char* resize_status_string(enum rfb_resize_status status)
 {
 	switch (status) {
@@ -2029,6 +2386,17 @@ static int on_client_set_desktop_size_event(struct nvnc_client* client)
 
 	enum rfb_resize_status status = check_desktop_layout(client, layout);
 
+	if (status == RFB_RESIZE_STATUS_PROHIBITED &&
+			client->server->is_resize_by_scaling_enabled) {
+		struct nvnc_desktop_layout* scaled_layout =
+			resize_by_scaling(client, width, height);
+		if (scaled_layout) {
+			free(layout);
+			layout = scaled_layout;
+			status = RFB_RESIZE_STATUS_SUCCESS;
+		}
+	}
+
 	nvnc_log(NVNC_LOG_DEBUG, "Client requested resize to %"PRIu16"x%"PRIu16", result: %d",
 			width, height, status);
 
@@ -2338,6 +2706,11 @@ static void on_client_event(struct stream* stream, enum stream_event event)
 		return;
 	}
 
+	if (event == STREAM_EVENT_WRITABLE) {
+		process_fb_update_requests(client);
+		return;
+	}
+
 	if (client->cut_text.buffer) {
 		process_big_cut_text(client);
 		return;
@@ -2375,14 +2748,15 @@ static void on_handshake_timeout(struct aml_timer* timer)
 	client_close(client);
 }
 
-static void on_connection(struct aml_handler* poll_handle)
+static void on_new_client(struct nvnc__socket* socket, int fd)
 {
-	struct nvnc__socket* socket = aml_get_userdata(poll_handle);
 	struct nvnc* server = socket->parent;
 
 	struct nvnc_client* client = calloc(1, sizeof(*client));
-	if (!client)
+	if (!client) {
+		close(fd);
 		return;
+	}
 
 	weakref_subject_init(&client->weakref);
 
@@ -2391,7 +2765,8 @@ static void on_connection(struct aml_handler* poll_handle)
 	client->led_state = -1; /* trigger sending of initial state */
 	client->min_rtt = INT32_MAX;
 	client->bwe = bwe_create(INT32_MAX);
-	client->compositor = compositor_create();
+	client->rate_control = rate_control_create();
+	client->encoding_policy = encoding_policy_create();
 
 	/* default extended clipboard capabilities */
 	client->ext_clipboard_caps =
@@ -2402,24 +2777,28 @@ static void on_connection(struct aml_handler* poll_handle)
 	client->ext_clipboard_max_unsolicited_text_size =
 		MAX_CLIENT_UNSOLICITED_TEXT_SIZE;
 
-	int fd = accept(socket->fd, NULL, 0);
-	if (fd < 0) {
-		nvnc_log(NVNC_LOG_WARNING, "Failed to accept a connection");
-		goto accept_failure;
-	}
-
 	int one = 1;
 	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
 
+#ifdef TCP_NOTSENT_LOWAT
+	if (server->notsent_lowat != 0) {
+		int lowat = server->notsent_lowat;
+		client->has_notsent_lowat = setsockopt(fd, IPPROTO_TCP,
+				TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat)) == 0;
+	}
+#endif
+
 #ifdef ENABLE_WEBSOCKET
 	if (socket->type == NVNC_STREAM_WEBSOCKET)
 	{
-		client->net_stream = stream_ws_new(fd, on_client_event, client);
+		client->net_stream = stream_ws_new(server->loop, fd,
+				on_client_event, client);
 	}
 	else
 #endif
 	{
-		client->net_stream = stream_new(fd, on_client_event, client);
+		client->net_stream = stream_new(server->loop, fd,
+				on_client_event, client);
 	}
 	if (!client->net_stream) {
 		nvnc_log(NVNC_LOG_WARNING, "OOM");
@@ -2432,6 +2811,8 @@ static void on_connection(struct aml_handler* poll_handle)
 	}
 
 	pixman_region_init(&client->damage);
+	pixman_region_init(&client->refresh_region);
+	pixman_region_init(&client->update_refresh_region);
 
 	struct rcbuf* payload = rcbuf_from_string(RFB_VERSION_MESSAGE);
 	if (!payload) {
@@ -2458,20 +2839,50 @@ static void on_connection(struct aml_handler* poll_handle)
 	client->handshake_timer = aml_timer_new(HANDSHAKE_TIMEOUT,
 			on_handshake_timeout, client, NULL);
 	assert(client->handshake_timer);
-	aml_start(aml_get_default(), client->handshake_timer);
+	aml_start(server->loop, client->handshake_timer);
 
 	return;
 
 payload_failure:
+	pixman_region_fini(&client->update_refresh_region);
+	pixman_region_fini(&client->refresh_region);
 	pixman_region_fini(&client->damage);
 buffer_failure:
 	stream_destroy(client->net_stream);
 stream_failure:
 	close(fd);
-accept_failure:
 	free(client);
 }
 
+static void on_connection(struct aml_handler* poll_handle)
+{
+	struct nvnc__socket* socket = aml_get_userdata(poll_handle);
+	struct nvnc* server = socket->parent;
+
+	/* Accepting several connections per wakeup gets through reconnect
+	 * storms faster, but the batch is capped so that clients that are
+	 * already connected and in the middle of their handshakes are not
+	 * starved. Whatever is left in the backlog is picked up on the next
+	 * iteration of the loop.
+	 */
+	// A blocking socket would block on the accept after the last connection
+	uint32_t batch_size = socket->is_nonblocking ?
+		server->accept_batch_size : 1;
+
+	for (uint32_t i = 0; i < batch_size; ++i) {
+		int fd = accept4(socket->fd, NULL, 0, SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK &&
+					errno != EINTR)
+				nvnc_log(NVNC_LOG_WARNING,
+						"Failed to accept a connection: %m");
+			break;
+		}
+
+		on_new_client(socket, fd);
+	}
+}
+
 static void sockaddr_to_string(char* dst, size_t sz, const struct sockaddr* addr)
 {
 	struct sockaddr_in *sa_in = (struct sockaddr_in*)addr;
@@ -2494,7 +2905,7 @@ static void sockaddr_to_string(char* dst, size_t sz, const struct sockaddr* addr
 	}
 }
 
-static int bind_address_tcp(const char* name, int port)
+static int bind_address_tcp(const char* name, int port, bool reuse_port)
 {
 	struct addrinfo hints = {
 		.ai_socktype = SOCK_STREAM,
@@ -2532,6 +2943,14 @@ static int bind_address_tcp(const char* name, int port)
 			goto failure;
 		}
 
+#ifdef SO_REUSEPORT
+		if (reuse_port && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one,
+					sizeof(int)) < 0) {
+			nvnc_log(NVNC_LOG_DEBUG, "Failed to set SO_REUSEPORT: %m");
+			goto failure;
+		}
+#endif
+
 		if (bind(fd, p->ai_addr, p->ai_addrlen) == 0) {
 			nvnc_log(NVNC_LOG_DEBUG, "Successfully bound to address");
 			break;
@@ -2572,26 +2991,27 @@ static int bind_address_unix(const char* name)
 }
 
 static struct nvnc__socket* nvnc__listen(struct nvnc* self, int fd,
-		enum nvnc_stream_type type)
+		enum nvnc_stream_type type, int backlog)
 {
 	struct nvnc__socket* socket = calloc(1, sizeof(*socket));
 	if (!socket)
 		return NULL;
 
-	if (listen(fd, 16) < 0)
+	if (listen(fd, backlog) < 0)
 		goto failure;
 
 	socket->parent = self;
 	socket->type = type;
 	socket->fd = fd;
 	socket->is_external = true;
+	socket->is_nonblocking = fcntl(fd, F_GETFL, 0) & O_NONBLOCK;
 
 	socket->poll_handle = aml_handler_new(fd, on_connection, socket, NULL);
 	if (!socket->poll_handle) {
 		goto failure;
 	}
 
-	aml_start(aml_get_default(), socket->poll_handle);
+	aml_start(self->loop, socket->poll_handle);
 
 	LIST_INSERT_HEAD(&self->sockets, socket, link);
 	return socket;
@@ -2602,27 +3022,57 @@ failure:
 }
 
 EXPORT
-struct nvnc* nvnc_new(void)
+struct nvnc* nvnc_new_with_loop(struct aml* loop)
 {
 	nvnc__log_init();
-	aml_require_workers(aml_get_default(), -1);
+	aml_require_workers(loop, -1);
 
 	struct nvnc* self = calloc(1, sizeof(*self));
 	if (!self)
 		return NULL;
 
+	self->loop = loop;
 	strcpy(self->name, DEFAULT_NAME);
 
 	LIST_INIT(&self->sockets);
 	LIST_INIT(&self->clients);
+	LIST_INIT(&self->scaled_outputs);
+
+	self->roi_quality = -1;
+	self->accept_batch_size = DEFAULT_ACCEPT_BATCH_SIZE;
+
+	self->executor = executor_new(loop);
+	if (!self->executor) {
+		free(self);
+		return NULL;
+	}
+
+	self->compositor = compositor_create(self->executor);
+	if (!self->compositor) {
+		executor_destroy(self->executor);
+		free(self);
+		return NULL;
+	}
+
+#ifdef HAVE_JPEG
+	// Failing to create this only makes things slower
+	self->tile_cache = tile_cache_create(TILE_CACHE_SIZE);
+#endif
 
 	return self;
 }
 
+EXPORT
+struct nvnc* nvnc_new(void)
+{
+	return nvnc_new_with_loop(aml_get_default());
+}
+
 EXPORT
 int nvnc_listen(struct nvnc* self, int fd, enum nvnc_stream_type type)
 {
-	struct nvnc__socket* socket = nvnc__listen(self, fd, type);
+	// The caller owns the socket, so its backlog and flags are left as they are
+	struct nvnc__socket* socket = nvnc__listen(self, fd, type, 16);
 	return socket ? 0 : -1;
 }
 
@@ -2630,11 +3080,14 @@ EXPORT
 int nvnc_listen_tcp(struct nvnc* self, const char* addr, uint16_t port,
 		enum nvnc_stream_type type)
 {
-	int fd = bind_address_tcp(addr, port);
+	int fd = bind_address_tcp(addr, port, self->is_reuse_port_enabled);
 	if (fd < 0)
 		return -1;
 
-	struct nvnc__socket* socket = nvnc__listen(self, fd, type);
+	// Connections are accepted until the backlog runs dry
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+
+	struct nvnc__socket* socket = nvnc__listen(self, fd, type, SOMAXCONN);
 	if (!socket) {
 		close(fd);
 		return -1;
@@ -2652,7 +3105,9 @@ int nvnc_listen_unix(struct nvnc* self, const char* path,
 	if (fd < 0)
 		return -1;
 
-	struct nvnc__socket* socket = nvnc__listen(self, fd, type);
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+
+	struct nvnc__socket* socket = nvnc__listen(self, fd, type, SOMAXCONN);
 	if (!socket)
 		goto failure;
 
@@ -2692,6 +3147,7 @@ void nvnc_del(struct nvnc* self)
 	for (int i = 0; i < self->n_displays; ++i) {
 		struct nvnc_display *display = self->displays[i];
 		assert(display);
+		nvnc_display__stop_mailbox(display);
 		nvnc_display_unref(display);
 	}
 
@@ -2707,11 +3163,24 @@ void nvnc_del(struct nvnc* self)
 	while (!LIST_EMPTY(&self->clients))
 		client_close(LIST_FIRST(&self->clients));
 
+	compositor_destroy(self->compositor);
+
+	while (!LIST_EMPTY(&self->scaled_outputs)) {
+		struct nvnc__scaled_output* output =
+			LIST_FIRST(&self->scaled_outputs);
+		LIST_REMOVE(output, link);
+		compositor_destroy(output->compositor);
+		free(output);
+	}
+
+	executor_destroy(self->executor);
+	tile_cache_unref(self->tile_cache);
+
 	while (!LIST_EMPTY(&self->sockets)) {
 		struct nvnc__socket* socket = LIST_FIRST(&self->sockets);
 		LIST_REMOVE(socket, link);
 
-		aml_stop(aml_get_default(), socket->poll_handle);
+		aml_stop(self->loop, socket->poll_handle);
 		aml_unref(socket->poll_handle);
 
 		if (!socket->is_external) {
@@ -2767,40 +3236,158 @@ static void complete_fb_update(struct nvnc_client* client)
 	DTRACE_PROBE1(neatvnc, update_fb_done, client);
 }
 
+static void on_refresh_timeout(struct aml_timer* timer);
+
+static void client_schedule_refresh(struct nvnc_client* client,
+		uint64_t delay)
+{
+	struct aml* loop = client->server->loop;
+	uint64_t deadline = gettime_us(CLOCK_MONOTONIC) + delay;
+
+	if (!client->refresh_timer) {
+		client->refresh_timer = aml_timer_new(delay, on_refresh_timeout,
+				client, NULL);
+		if (!client->refresh_timer)
+			return;
+	} else if (client->refresh_deadline != 0) {
+		// An armed timer is only ever moved closer
+		if (client->refresh_deadline <= deadline)
+			return;
+
+		aml_stop(loop, client->refresh_timer);
+		aml_timer_set_duration(client->refresh_timer, delay);
+	} else {
+		aml_timer_set_duration(client->refresh_timer, delay);
+	}
+
+	client->refresh_deadline = deadline;
+	aml_start(loop, client->refresh_timer);
+}
+
+/* Arm the refresh timer for when the earliest lossy area becomes eligible for
+ * a lossless refresh.
+ */
+static void client_schedule_next_refresh(struct nvnc_client* client)
+{
+	uint64_t delay = client->server->lossless_refresh_delay;
+	if (delay == 0 || !client->encoder)
+		return;
+
+	struct pixman_region16 region;
+	pixman_region_init(&region);
+
+	uint64_t next = encoder_get_refresh_region(client->encoder, &region,
+			delay);
+
+	if (pixman_region_not_empty(&region))
+		client_schedule_refresh(client, 0);
+	else if (next != 0)
+		client_schedule_refresh(client, next);
+
+	pixman_region_fini(&region);
+}
+
+/* Areas that were sent lossily and have since stopped changing are sent again
+ * losslessly, provided that the link isn't busy with other things. If other
+ * damage is pending, they are merged into that update.
+ */
+static void on_refresh_timeout(struct aml_timer* timer)
+{
+	struct nvnc_client* client = aml_timer_get_userdata(timer);
+	uint64_t delay = client->server->lossless_refresh_delay;
+
+	client->refresh_deadline = 0;
+
+	if (!client->encoder)
+		return;
+
+	int max_inflight = client_get_max_inflight(client);
+	if (max_inflight != 0 && client->inflight_bytes > max_inflight / 2) {
+		client_schedule_refresh(client, delay);
+		return;
+	}
+
+	struct pixman_region16 region;
+	pixman_region_init(&region);
+
+	uint64_t next = encoder_get_refresh_region(client->encoder, &region,
+			delay);
+
+	if (next != 0)
+		client_schedule_refresh(client, next);
+
+	if (pixman_region_not_empty(&region)) {
+		nvnc_trace("Refreshing lossy areas");
+		pixman_region_union(&client->refresh_region,
+				&client->refresh_region, &region);
+		pixman_region_union(&client->damage, &client->damage, &region);
+		process_fb_update_requests(client);
+	}
+
+	pixman_region_fini(&region);
+}
+
 static void on_write_frame_done(void* userdata, enum stream_req_status status)
 {
 	struct nvnc_client* client = userdata;
-	complete_fb_update(client);
+	assert(client->n_outgoing_frames > 0);
+	client->n_outgoing_frames--;
+
+	if (client->n_outgoing_frames == 0)
+		client_schedule_next_refresh(client);
+
+	process_fb_update_requests(client);
 }
 
-static enum rfb_encodings choose_frame_encoding(struct nvnc_client* client,
+static bool is_usable_frame_encoding(enum rfb_encodings encoding,
 		const struct nvnc_composite_fb* fb)
 {
-	for (size_t i = 0; i < client->n_encodings; ++i) {
-		switch (client->encodings[i]) {
-		case RFB_ENCODING_RAW:
-		case RFB_ENCODING_TIGHT:
-		case RFB_ENCODING_ZRLE:
-			return client->encodings[i];
-#ifdef ENABLE_OPEN_H264
-		case RFB_ENCODING_OPEN_H264:
-			// h264 is useless for sw frames
-			for (int i = 0; i < fb->n_fbs; ++i)
-				if (fb->fbs[i]->buffer->type != NVNC_BUFFER_GBM_BO)
-					goto skip;
-			if (!have_working_h264_encoder())
-				break;
-			return client->encodings[i];
-#endif
-		default:
-			break;
-		}
+	switch (encoding) {
+	case RFB_ENCODING_RAW:
+	case RFB_ENCODING_TIGHT:
+	case RFB_ENCODING_ZRLE:
+		return true;
 #ifdef ENABLE_OPEN_H264
-skip:;
+	case RFB_ENCODING_OPEN_H264:
+		// h264 is useless for sw frames
+		for (int i = 0; i < fb->n_fbs; ++i)
+			if (fb->fbs[i]->buffer->type != NVNC_BUFFER_GBM_BO)
+				return false;
+		return have_working_h264_encoder();
 #endif
+	default:
+		break;
 	}
+	return false;
+}
+
+static enum rfb_encodings choose_frame_encoding(struct nvnc_client* client,
+		const struct nvnc_composite_fb* fb,
+		struct pixman_region16* damage)
+{
+	enum rfb_encodings candidates[MAX_ENCODINGS];
+	size_t n_candidates = 0;
 
-	return RFB_ENCODING_RAW;
+	for (size_t i = 0; i < client->n_encodings; ++i)
+		if (is_usable_frame_encoding(client->encodings[i], fb))
+			candidates[n_candidates++] = client->encodings[i];
+
+	if (n_candidates == 0)
+		return RFB_ENCODING_RAW;
+
+	if (!client->server->is_adaptive_encoding_enabled ||
+			!client->encoding_policy || n_candidates == 1)
+		return candidates[0];
+
+	struct encoding_policy_input input = {
+		.bandwidth = bwe_get_estimate(client->bwe),
+		.n_pixels = (uint32_t)nvnc_composite_fb_width(fb) *
+			nvnc_composite_fb_height(fb),
+		.n_damaged_pixels = nvnc__calculate_region_area(damage),
+		.bytes_per_pixel = MAX(client->pixfmt.bits_per_pixel / 8, 1),
+	};
+	return encoding_policy_choose(client->encoding_policy, candidates,
+			n_candidates, &input);
 }
 
 static bool client_has_encoding(const struct nvnc_client* client,
@@ -2863,6 +3450,9 @@ static void finish_fb_update(struct nvnc_client* client,
 	if (send_pts_rect(client, frame->pts) < 0)
 		goto complete;
 
+	// on_write_frame_done may be called from within stream_send
+	client->n_outgoing_frames++;
+
 	encoded_frame_ref(frame);
 	if (stream_send(client->net_stream, &frame->buf, on_write_frame_done,
 				client) < 0)
@@ -2870,10 +3460,13 @@ static void finish_fb_update(struct nvnc_client* client,
 
 	send_ping(client, frame->buf.size);
 
+	if (client->rate_control && client->update_quality < 10)
+		rate_control_feed(client->rate_control, client->update_quality,
+				frame->buf.size, client->update_area);
+
 	process_pending_fence(client);
 
 	DTRACE_PROBE2(neatvnc, send_fb_done, client, pts);
-	return;
 
 complete:
 	complete_fb_update(client);
@@ -2885,6 +3478,15 @@ static void on_encode_frame_done(struct encoder* encoder,
 	struct nvnc_client* client = encoder->userdata;
 	client->encoder->on_done = NULL;
 	client->encoder->userdata = NULL;
+
+	if (client->encoding_policy) {
+		uint64_t now = gettime_us(CLOCK_MONOTONIC);
+		encoding_policy_feed(client->encoding_policy,
+				encoder_get_type(encoder), result->buf.size,
+				client->update_area,
+				now - client->encode_start_time);
+	}
+
 	finish_fb_update(client, result);
 }
 
@@ -2966,10 +3568,28 @@ void nvnc__damage_region(struct nvnc* self, const struct pixman_region16* damage
 {
 	struct nvnc_client* client;
 
-	LIST_FOREACH(client, &self->clients, link)
-		if (client->net_stream->state != STREAM_STATE_CLOSED)
-			pixman_region_union(&client->damage, &client->damage,
-					(struct pixman_region16*)damage);
+	compositor_damage(self->compositor, (struct pixman_region16*)damage);
+
+	struct nvnc__scaled_output* output;
+	LIST_FOREACH(output, &self->scaled_outputs, link)
+		compositor_damage(output->compositor,
+				(struct pixman_region16*)damage);
+
+	struct pixman_region16 scaled_damage;
+	pixman_region_init(&scaled_damage);
+
+	LIST_FOREACH(client, &self->clients, link) {
+		if (client->net_stream->state == STREAM_STATE_CLOSED)
+			continue;
+
+		double scale = client_get_output_scale(client);
+		nvnc_region_scale(&scaled_damage,
+				(struct pixman_region16*)damage, scale, scale);
+		pixman_region_union(&client->damage, &client->damage,
+				&scaled_damage);
+	}
+
+	pixman_region_fini(&scaled_damage);
 
 	LIST_FOREACH(client, &self->clients, link)
 		process_fb_update_requests(client);
@@ -3110,6 +3730,9 @@ void nvnc_add_display(struct nvnc* self, struct nvnc_display* display)
 	display->server = self;
 	display->id = self->next_display_id++;
 
+	if (nvnc_display__start_mailbox(display) < 0)
+		nvnc_log(NVNC_LOG_ERROR, "Failed to start display mailbox");
+
 	self->displays[self->n_displays++] = display;
 	nvnc_display_ref(display);
 }
@@ -3135,14 +3758,16 @@ void nvnc__reset_encoders(struct nvnc* self)
 EXPORT
 void nvnc_remove_display(struct nvnc* self, struct nvnc_display* display)
 {
-	nvnc_display_unref(display);
-
 	int index = nvnc__find_display(self, display);
 	if (index == -1) {
 		nvnc_log(NVNC_LOG_ERROR, "Tried to remove non-existent display");
+		nvnc_display_unref(display);
 		return;
 	}
 
+	nvnc_display__stop_mailbox(display);
+	nvnc_display_unref(display);
+
 	self->n_displays--;
 	self->displays[index] = self->displays[self->n_displays];
 	self->displays[self->n_displays] = NULL;
@@ -3254,6 +3879,22 @@ void nvnc_client_set_led_state(struct nvnc_client* client,
 	process_fb_update_requests(client);
 }
 
+EXPORT
+int nvnc_client_set_output_scale(struct nvnc_client* client, double scale)
+{
+	if (client_set_output_scale(client, scale) < 0)
+		return -1;
+
+	process_fb_update_requests(client);
+	return 0;
+}
+
+EXPORT
+double nvnc_client_get_output_scale(const struct nvnc_client* client)
+{
+	return client_get_output_scale(client);
+}
+
 EXPORT
 void nvnc_set_name(struct nvnc* self, const char* name)
 {
@@ -3269,6 +3910,81 @@ void nvnc_set_name(struct nvnc* self, const char* name)
 	}
 }
 
+EXPORT
+void nvnc_set_adaptive_encoding(struct nvnc* self, bool enable)
+{
+	self->is_adaptive_encoding_enabled = enable;
+}
+
+EXPORT
+void nvnc_set_notsent_lowat(struct nvnc* self, uint32_t bytes)
+{
+	self->notsent_lowat = bytes;
+}
+
+EXPORT
+void nvnc_set_accept_batch_size(struct nvnc* self, uint32_t size)
+{
+	self->accept_batch_size = size > 0 ? size : 1;
+}
+
+EXPORT
+int nvnc_set_reuse_port_enabled(struct nvnc* self, bool enable)
+{
+#ifdef SO_REUSEPORT
+	self->is_reuse_port_enabled = enable;
+	return 0;
+#else
+	return enable ? -1 : 0;
+#endif
+}
+
+EXPORT
+int nvnc_set_worker_count(struct nvnc* self, int n)
+{
+	return executor_set_worker_count(self->executor, n);
+}
+
+EXPORT
+int nvnc_set_worker_cpus(struct nvnc* self, const int* cpus, size_t n)
+{
+	return executor_set_cpus(self->executor, cpus, n);
+}
+
+EXPORT
+int nvnc_set_worker_numa_node(struct nvnc* self, int node)
+{
+	return executor_set_numa_node(self->executor, node);
+}
+
+EXPORT
+void nvnc_set_lossless_refresh_delay(struct nvnc* self, uint32_t delay_ms)
+{
+	self->lossless_refresh_delay = delay_ms * UINT64_C(1000);
+}
+
+EXPORT
+void nvnc_set_roi_quality(struct nvnc* self, int quality)
+{
+	self->roi_quality = quality;
+}
+
+EXPORT
+void nvnc_set_focus_rect(struct nvnc* self, int x, int y,
+		unsigned int width, unsigned int height)
+{
+	self->focus_rect.x = x;
+	self->focus_rect.y = y;
+	self->focus_rect.width = width;
+	self->focus_rect.height = height;
+}
+
+EXPORT
+void nvnc_set_resize_by_scaling(struct nvnc* self, bool enable)
+{
+	self->is_resize_by_scaling_enabled = enable;
+}
+
 EXPORT
 bool nvnc_has_auth(void)
 {
@@ -3323,6 +4039,17 @@ cert_alloc_failure:
 	return -1;
 }
 
+EXPORT
+int nvnc_set_ktls_enabled(struct nvnc* self, bool enable)
+{
+#ifdef HAVE_GNUTLS_KTLS
+	self->is_ktls_enabled = enable;
+	return 0;
+#else
+	return enable ? -1 : 0;
+#endif
+}
+
 EXPORT
 int nvnc_enable_auth(struct nvnc* self, enum nvnc_auth_flags flags,
 		nvnc_auth_fn auth_fn, void* userdata)
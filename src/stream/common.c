@@ -44,3 +44,15 @@ void stream__remote_closed(struct stream* self)
 	if (self->on_event)
 		self->on_event(self, STREAM_EVENT_REMOTE_CLOSED);
 }
+
+void stream__on_drained(struct stream* self)
+{
+	if (!self->wants_writable || !TAILQ_EMPTY(&self->send_queue))
+		return;
+
+	self->wants_writable = false;
+	stream__poll_r(self);
+
+	if (self->on_event)
+		self->on_event(self, STREAM_EVENT_WRITABLE);
+}
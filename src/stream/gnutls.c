@@ -26,24 +26,44 @@
 #include <fcntl.h>
 #include <poll.h>
 #include <sys/socket.h>
+#include <sys/param.h>
 
 #include <gnutls/gnutls.h>
 
+#include "config.h"
+
+#ifdef HAVE_GNUTLS_KTLS
+#include <gnutls/socket.h>
+#endif
+
 #include "rcbuf.h"
 #include "stream/stream.h"
 #include "stream/common.h"
+#include "stream/tcp.h"
 #include "sys/queue.h"
+#include "neatvnc.h"
 
 struct stream_gnutls {
 	struct stream base;
 
 	gnutls_session_t session;
+
+	bool is_corked;
+	size_t corked_bytes;
+
+	bool use_ktls;
 };
 
+/* Number of plaintext bytes that are encrypted into records before they are
+ * written out together with a single uncork.
+ */
+#define TLS_BATCH_SIZE (64 * 1024)
+
 static_assert(sizeof(struct stream_gnutls) <= STREAM_ALLOC_SIZE,
 		"struct stream_gnutls has grown too large, increase STREAM_ALLOC_SIZE");
 
 static int stream__try_tls_accept(struct stream* self);
+static struct stream_impl ktls_impl;
 
 static int stream_gnutls_close(struct stream* base)
 {
@@ -66,7 +86,7 @@ static int stream_gnutls_close(struct stream* base)
 		gnutls_deinit(self->session);
 	self->session = NULL;
 
-	aml_stop(aml_get_default(), self->base.handler);
+	aml_stop(self->base.loop, self->base.handler);
 	close(self->base.fd);
 	self->base.fd = -1;
 
@@ -83,6 +103,79 @@ static void stream_gnutls_destroy(struct stream* self)
 	free(self);
 }
 
+static void stream_gnutls__finish_sent(struct stream_gnutls* self)
+{
+	while (!TAILQ_EMPTY(&self->base.send_queue)) {
+		struct stream_req* req = TAILQ_FIRST(&self->base.send_queue);
+
+		/* GnuTLS returns an error when sending with 0 data_size, so empty
+		 * requests are also finished here.
+		 */
+		if (req->offset < req->payload->size)
+			break;
+
+		TAILQ_REMOVE(&self->base.send_queue, req, link);
+		stream_req__finish(req, STREAM_REQ_DONE);
+
+		if (self->base.state == STREAM_STATE_CLOSED)
+			break;
+	}
+}
+
+/* Encrypts up to TLS_BATCH_SIZE bytes from the send queue while corked and
+ * then writes all the resulting records out in one go. Requests are only
+ * advanced past, not finished, so that they stay on the queue until their
+ * data has actually reached the socket.
+ *
+ * Returns 1 if the batch was written, 0 if the socket would block and -1 on
+ * fatal errors.
+ */
+static int stream_gnutls__send_batch(struct stream_gnutls* self)
+{
+	if (!self->is_corked) {
+		gnutls_record_cork(self->session);
+		self->is_corked = true;
+		self->corked_bytes = 0;
+
+		struct stream_req* req;
+		TAILQ_FOREACH(req, &self->base.send_queue, link) {
+			while (req->offset < req->payload->size &&
+					self->corked_bytes < TLS_BATCH_SIZE) {
+				size_t len = MIN(req->payload->size - req->offset,
+						TLS_BATCH_SIZE - self->corked_bytes);
+				const char* p = req->payload->payload;
+
+				ssize_t n_sent = gnutls_record_send(self->session,
+						p + req->offset, len);
+				if (n_sent < 0) {
+					if (gnutls_error_is_fatal(n_sent))
+						return -1;
+					goto uncork;
+				}
+
+				req->offset += n_sent;
+				self->corked_bytes += n_sent;
+			}
+
+			if (self->corked_bytes >= TLS_BATCH_SIZE)
+				break;
+		}
+	}
+
+uncork:;
+	/* An interrupted uncork must be resumed before anything else is sent,
+	 * so is_corked stays set until it has completed.
+	 */
+	int rc = gnutls_record_uncork(self->session, 0);
+	if (rc < 0)
+		return gnutls_error_is_fatal(rc) ? -1 : 0;
+
+	self->is_corked = false;
+	self->base.bytes_sent += self->corked_bytes;
+	self->corked_bytes = 0;
+	return 1;
+}
+
 static int stream_gnutls__flush(struct stream* base)
 {
 	struct stream_gnutls* self = (struct stream_gnutls*)base;
@@ -90,51 +183,32 @@ static int stream_gnutls__flush(struct stream* base)
 	stream_ref(base);
 	int rc = -1;
 
+	/* While an uncork is pending, the corked data has not reached the
+	 * socket yet, so the requests that it came from must not be finished.
+	 */
+	if (!self->is_corked)
+		stream_gnutls__finish_sent(self);
+
 	while (!TAILQ_EMPTY(&self->base.send_queue)) {
 		assert(self->base.state != STREAM_STATE_CLOSED);
 
-		struct stream_req* req = TAILQ_FIRST(&self->base.send_queue);
-
-		/* GnuTLS returns an error when sending with 0 data_size */
-		if (req->payload->size == 0)
-			goto req_done;
-
-		ssize_t n_sent = gnutls_record_send(self->session,
-				req->payload->payload, req->payload->size);
-		if (n_sent < 0) {
-			if (gnutls_error_is_fatal(n_sent)) {
-				stream_close(base);
-				goto done;
-			}
-
-			stream__poll_rw(base);
-			rc = 0;
+		int batch_rc = stream_gnutls__send_batch(self);
+		if (batch_rc < 0) {
+			stream_close(base);
 			goto done;
 		}
 
-		self->base.bytes_sent += n_sent;
-
-		ssize_t remaining = req->payload->size - n_sent;
-
-		if (remaining > 0) {
-			char* p = req->payload->payload;
-			size_t s = req->payload->size;
-			memmove(p, p + s - remaining, remaining);
-			req->payload->size = remaining;
+		if (batch_rc == 0) {
 			stream__poll_rw(base);
-			rc = 1;
+			rc = 0;
 			goto done;
 		}
 
-		assert(remaining == 0);
-
-req_done:
-		TAILQ_REMOVE(&self->base.send_queue, req, link);
-		stream_req__finish(req, STREAM_REQ_DONE);
+		stream_gnutls__finish_sent(self);
 	}
 
-	if (TAILQ_EMPTY(&base->send_queue) && base->state != STREAM_STATE_CLOSED)
-		stream__poll_r(base);
+	if (base->state != STREAM_STATE_CLOSED)
+		stream__poll_idle(base);
 
 	rc = 1;
 done:
@@ -166,7 +240,11 @@ static void stream_gnutls__on_writable(struct stream* self)
 	case STREAM_STATE_NORMAL:
 		/* fallthrough */
 	case STREAM_STATE_TLS_READY:
-		stream_gnutls__flush(self);
+		if (self->impl == &ktls_impl)
+			stream_tcp_flush(self);
+		else
+			stream_gnutls__flush(self);
+		stream__on_drained(self);
 		break;
 	case STREAM_STATE_TLS_HANDSHAKE:
 		stream__try_tls_accept(self);
@@ -246,6 +324,29 @@ static ssize_t stream_gnutls_read(struct stream* base, void* dst, size_t size)
 	return -1;
 }
 
+/* With the transmit side offloaded to the kernel, plain writes to the socket
+ * are encrypted there, so the TCP send path can be used as is. Reads still go
+ * through GnuTLS, which knows how to receive control records from kTLS.
+ */
+static void stream_gnutls__check_ktls(struct stream_gnutls* self)
+{
+#ifdef HAVE_GNUTLS_KTLS
+	if (!self->use_ktls)
+		return;
+
+	gnutls_transport_ktls_enable_flags_t flags =
+		gnutls_transport_is_ktls_enabled(self->session);
+	if (!(flags & GNUTLS_KTLS_SEND)) {
+		nvnc_log(NVNC_LOG_DEBUG, "kTLS is unavailable, encrypting in user space");
+		return;
+	}
+
+	nvnc_log(NVNC_LOG_DEBUG, "Using kTLS for sending%s",
+			(flags & GNUTLS_KTLS_RECV) ? " and receiving" : "");
+	self->base.impl = &ktls_impl;
+#endif
+}
+
 static int stream__try_tls_accept(struct stream* base)
 {
 	struct stream_gnutls* self = (struct stream_gnutls*)base;
@@ -254,12 +355,13 @@ static int stream__try_tls_accept(struct stream* base)
 	rc = gnutls_handshake(self->session);
 	if (rc == GNUTLS_E_SUCCESS) {
 		self->base.state = STREAM_STATE_TLS_READY;
+		stream_gnutls__check_ktls(self);
 		stream__poll_r(base);
 		return 0;
 	}
 
 	if (gnutls_error_is_fatal(rc)) {
-		aml_stop(aml_get_default(), self->base.handler);
+		aml_stop(self->base.loop, self->base.handler);
 		return -1;
 	}
 
@@ -280,12 +382,28 @@ static struct stream_impl impl = {
 	.send = stream_gnutls_send,
 };
 
-int stream_upgrade_to_tls(struct stream* base, void* context)
+static struct stream_impl ktls_impl = {
+	.close = stream_gnutls_close,
+	.destroy = stream_gnutls_destroy,
+	.read = stream_gnutls_read,
+	.send = stream_tcp_send,
+	.send_first = stream_tcp_send_first,
+	.exec_and_send = stream_tcp_exec_and_send,
+};
+
+int stream_upgrade_to_tls(struct stream* base, void* context, bool use_ktls)
 {
 	struct stream_gnutls* self = (struct stream_gnutls*)base;
 	int rc;
 
-	rc = gnutls_init(&self->session, GNUTLS_SERVER | GNUTLS_NONBLOCK);
+	unsigned int flags = GNUTLS_SERVER | GNUTLS_NONBLOCK;
+#ifdef HAVE_GNUTLS_ENABLE_KTLS
+	if (use_ktls)
+		flags |= GNUTLS_ENABLE_KTLS;
+#endif
+	self->use_ktls = use_ktls;
+
+	rc = gnutls_init(&self->session, flags);
 	if (rc != GNUTLS_E_SUCCESS)
 		return -1;
 
@@ -298,14 +416,14 @@ int stream_upgrade_to_tls(struct stream* base, void* context)
 	if (rc != GNUTLS_E_SUCCESS)
 		goto failure;
 
-	aml_stop(aml_get_default(), self->base.handler);
+	aml_stop(self->base.loop, self->base.handler);
 	aml_unref(self->base.handler);
 
 	self->base.handler = aml_handler_new(self->base.fd,
 			stream_gnutls__on_event, self, NULL);
 	assert(self->base.handler);
 
-	rc = aml_start(aml_get_default(), self->base.handler);
+	rc = aml_start(self->base.loop, self->base.handler);
 	assert(rc >= 0);
 
 	gnutls_transport_set_int(self->session, self->base.fd);
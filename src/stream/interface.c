@@ -15,8 +15,10 @@
  */
 
 #include "stream/stream.h"
+#include "stream/common.h"
 
 #include <assert.h>
+#include <poll.h>
 
 void stream_ref(struct stream* self)
 {
@@ -70,3 +72,24 @@ void stream_exec_and_send(struct stream* self, stream_exec_fn exec_fn,
 	else
 		stream_send(self, exec_fn(self, userdata), NULL, NULL);
 }
+
+bool stream_is_drained(struct stream* self)
+{
+	if (!TAILQ_EMPTY(&self->send_queue))
+		return false;
+
+	struct pollfd pfd = {
+		.fd = self->fd,
+		.events = POLLOUT,
+	};
+	return poll(&pfd, 1, 0) == 1 && (pfd.revents & POLLOUT);
+}
+
+void stream_notify_writable(struct stream* self)
+{
+	if (self->state == STREAM_STATE_CLOSED)
+		return;
+
+	self->wants_writable = true;
+	stream__poll_rw(self);
+}
@@ -21,6 +21,7 @@
 #include <errno.h>
 #include <sys/param.h>
 #include <arpa/inet.h>
+#include <aml.h>
 
 #include "rcbuf.h"
 #include "stream/stream.h"
@@ -28,10 +29,37 @@
 #include "stream/common.h"
 #include "crypto.h"
 #include "neatvnc.h"
+#include "sys/queue.h"
 
 #define RSA_AES_BUFFER_SIZE 8192
 #define UDIV_UP(a, b) (((a) + (b) - 1) / (b))
 
+// Payloads larger than this are split up and encrypted on worker threads
+#define RSA_AES_JOB_SIZE (8 * RSA_AES_BUFFER_SIZE)
+
+struct stream_rsa_aes;
+
+struct rsa_aes_job {
+	struct stream_rsa_aes* stream;
+
+	struct rcbuf* src;
+	size_t src_offset;
+	size_t src_len;
+	uint64_t first_msg;
+
+	uint8_t* dst;
+	size_t dst_len;
+	bool is_done;
+
+	// Only set for the last job of a payload
+	stream_req_fn on_done;
+	void* userdata;
+
+	TAILQ_ENTRY(rsa_aes_job) link;
+};
+
+TAILQ_HEAD(rsa_aes_job_queue, rsa_aes_job);
+
 struct stream_rsa_aes {
 	struct stream base;
 
@@ -39,14 +67,75 @@ struct stream_rsa_aes {
 	uint8_t* read_buffer;
 
 	struct crypto_cipher* cipher;
+
+	/* Encrypted payloads are moved from here to the TCP send queue in
+	 * order, as soon as the jobs at the front are done.
+	 */
+	struct rsa_aes_job_queue jobs;
 };
 
 static_assert(sizeof(struct stream_rsa_aes) <= STREAM_ALLOC_SIZE,
 		"struct stream_rsa_aes has grown too large, increase STREAM_ALLOC_SIZE");
 
+static void rsa_aes_job_destroy(struct rsa_aes_job* job)
+{
+	rcbuf_unref(job->src);
+	free(job->dst);
+	free(job);
+}
+
+/* The owner of the stream may be gone by the time that running jobs come
+ * back, so all queued payloads are failed right away. Running jobs hold a
+ * reference to the stream, so they stay on the queue without their callbacks
+ * until they are done.
+ */
+static int stream_rsa_aes_close(struct stream* base)
+{
+	struct stream_rsa_aes* self = (struct stream_rsa_aes*)base;
+
+	if (base->state == STREAM_STATE_CLOSED)
+		return -1;
+
+	stream_ref(base);
+
+	// Payloads that are already on the TCP send queue are failed first
+	stream_tcp_close(base);
+
+	struct rsa_aes_job* job;
+	struct rsa_aes_job* tmp;
+	TAILQ_FOREACH_SAFE(job, &self->jobs, link, tmp) {
+		stream_req_fn on_done = job->on_done;
+		void* userdata = job->userdata;
+		job->on_done = NULL;
+		job->userdata = NULL;
+
+		if (job->is_done) {
+			TAILQ_REMOVE(&self->jobs, job, link);
+			rsa_aes_job_destroy(job);
+		}
+
+		if (on_done)
+			on_done(userdata, STREAM_REQ_FAILED);
+	}
+
+	// unref
+	stream_destroy(base);
+	return 0;
+}
+
 static void stream_rsa_aes_destroy(struct stream* base)
 {
 	struct stream_rsa_aes* self = (struct stream_rsa_aes*)base;
+
+	// Running jobs hold a reference, so only finished ones can be left
+	while (!TAILQ_EMPTY(&self->jobs)) {
+		struct rsa_aes_job* job = TAILQ_FIRST(&self->jobs);
+		TAILQ_REMOVE(&self->jobs, job, link);
+		if (job->on_done)
+			job->on_done(job->userdata, STREAM_REQ_FAILED);
+		rsa_aes_job_destroy(job);
+	}
+
 	crypto_cipher_del(self->cipher);
 	free(self->read_buffer);
 	stream_tcp_destroy(base);
@@ -147,43 +236,175 @@ static ssize_t stream_rsa_aes_read(struct stream* base, void* dst, size_t size)
 	return total_read;
 }
 
-static int stream_rsa_aes_send(struct stream* base, struct rcbuf* payload,
-		stream_req_fn on_done, void* userdata)
+static size_t rsa_aes_encrypted_size(size_t len)
 {
-	struct stream_rsa_aes* self = (struct stream_rsa_aes*)base;
-	size_t n_msg = UDIV_UP(payload->size, RSA_AES_BUFFER_SIZE);
+	return len + UDIV_UP(len, RSA_AES_BUFFER_SIZE) * (2 + 16);
+}
 
-	struct vec buf;
-	vec_init(&buf, payload->size + n_msg * (2 + 16));
+static void rsa_aes_encrypt(const struct crypto_cipher* cipher, uint8_t* dst,
+		const uint8_t* src, size_t len, uint64_t first_msg)
+{
+	size_t n_msg = UDIV_UP(len, RSA_AES_BUFFER_SIZE);
 
 	for (size_t i = 0; i < n_msg; ++i) {
-		size_t msglen = MIN(payload->size - i * RSA_AES_BUFFER_SIZE,
+		size_t msglen = MIN(len - i * RSA_AES_BUFFER_SIZE,
 				RSA_AES_BUFFER_SIZE);
 		uint16_t msglen_be = htons(msglen);
 
-		vec_append(&buf, &msglen_be, sizeof(msglen_be));
+		memcpy(dst, &msglen_be, sizeof(msglen_be));
+		dst += sizeof(msglen_be);
 
-		uint8_t mac[16];
-		crypto_cipher_encrypt(self->cipher, &buf, mac,
-				payload->payload + i * RSA_AES_BUFFER_SIZE,
+		crypto_cipher_encrypt_message(cipher, first_msg + i, dst,
+				dst + msglen, src + i * RSA_AES_BUFFER_SIZE,
 				msglen, (uint8_t*)&msglen_be, sizeof(msglen_be));
-		vec_append(&buf, mac, sizeof(mac));
+		dst += msglen + 16;
 	}
+}
+
+static void rsa_aes_job_encrypt(struct rsa_aes_job* job)
+{
+	const uint8_t* src = job->src->payload;
+	rsa_aes_encrypt(job->stream->cipher, job->dst, src + job->src_offset,
+			job->src_len, job->first_msg);
+}
+
+static void stream_rsa_aes_flush_jobs(struct stream_rsa_aes* self)
+{
+	stream_ref(&self->base);
 
+	while (!TAILQ_EMPTY(&self->jobs)) {
+		struct rsa_aes_job* job = TAILQ_FIRST(&self->jobs);
+		if (!job->is_done)
+			break;
+
+		TAILQ_REMOVE(&self->jobs, job, link);
+
+		// Callbacks were detached when the stream was closed
+		if (self->base.state != STREAM_STATE_CLOSED) {
+			struct rcbuf* buf = rcbuf_new(job->dst, job->dst_len);
+			job->dst = NULL;
+			stream_tcp_send(&self->base, buf, job->on_done,
+					job->userdata);
+		}
+
+		rsa_aes_job_destroy(job);
+	}
+
+	// unref
+	stream_destroy(&self->base);
+}
+
+static void rsa_aes_job_do_work(struct aml_work* work)
+{
+	struct rsa_aes_job* job = aml_get_userdata(work);
+	rsa_aes_job_encrypt(job);
+}
+
+static void rsa_aes_job_on_done(struct aml_work* work)
+{
+	struct rsa_aes_job* job = aml_get_userdata(work);
+	struct stream_rsa_aes* self = job->stream;
+
+	job->is_done = true;
+	stream_rsa_aes_flush_jobs(self);
+
+	// unref
+	stream_destroy(&self->base);
+}
+
+static void stream_rsa_aes_queue_job(struct stream_rsa_aes* self,
+		struct rcbuf* payload, size_t offset, size_t len,
+		bool use_worker)
+{
+	struct rsa_aes_job* job = calloc(1, sizeof(*job));
+	assert(job);
+
+	job->stream = self;
+	job->src = payload;
+	rcbuf_ref(payload);
+	job->src_offset = offset;
+	job->src_len = len;
+
+	// The nonces are handed out in queue order, whichever job finishes first
+	job->first_msg = crypto_cipher_reserve_messages(self->cipher,
+			UDIV_UP(len, RSA_AES_BUFFER_SIZE));
+
+	job->dst_len = rsa_aes_encrypted_size(len);
+	job->dst = malloc(MAX(job->dst_len, 1));
+	assert(job->dst);
+
+	TAILQ_INSERT_TAIL(&self->jobs, job, link);
+
+	if (!use_worker) {
+		rsa_aes_job_encrypt(job);
+		job->is_done = true;
+		return;
+	}
+
+	stream_ref(&self->base);
+
+	struct aml_work* work = aml_work_new(rsa_aes_job_do_work,
+			rsa_aes_job_on_done, job, NULL);
+	assert(work);
+	aml_start(self->base.loop, work);
+	aml_unref(work);
+}
+
+static int stream_rsa_aes_send(struct stream* base, struct rcbuf* payload,
+		stream_req_fn on_done, void* userdata)
+{
+	struct stream_rsa_aes* self = (struct stream_rsa_aes*)base;
 	size_t payload_size = payload->size;
-	rcbuf_unref(payload);
 
-	int r = stream_tcp_send(base, rcbuf_new(buf.data, buf.len), on_done,
-			userdata);
-	if (r < 0) {
-		return r;
+	if (self->base.state == STREAM_STATE_CLOSED) {
+		rcbuf_unref(payload);
+		return -1;
 	}
 
+	/* Small payloads are encrypted right away. If nothing is in flight,
+	 * they also skip the job queue.
+	 */
+	if (payload_size <= RSA_AES_JOB_SIZE && TAILQ_EMPTY(&self->jobs)) {
+		uint64_t first_msg = crypto_cipher_reserve_messages(
+				self->cipher,
+				UDIV_UP(payload_size, RSA_AES_BUFFER_SIZE));
+
+		size_t len = rsa_aes_encrypted_size(payload_size);
+		uint8_t* buf = malloc(MAX(len, 1));
+		assert(buf);
+
+		rsa_aes_encrypt(self->cipher, buf, payload->payload,
+				payload_size, first_msg);
+		rcbuf_unref(payload);
+
+		int r = stream_tcp_send(base, rcbuf_new(buf, len), on_done,
+				userdata);
+		return r < 0 ? r : (int)payload_size;
+	}
+
+	bool use_worker = payload_size > RSA_AES_JOB_SIZE;
+	size_t offset = 0;
+
+	do {
+		size_t len = MIN(payload_size - offset, RSA_AES_JOB_SIZE);
+		stream_rsa_aes_queue_job(self, payload, offset, len,
+				use_worker);
+		offset += len;
+	} while (offset < payload_size);
+
+	struct rsa_aes_job* last = TAILQ_LAST(&self->jobs, rsa_aes_job_queue);
+	last->on_done = on_done;
+	last->userdata = userdata;
+
+	rcbuf_unref(payload);
+
+	stream_rsa_aes_flush_jobs(self);
+
 	return payload_size;
 }
 
 static struct stream_impl impl = {
-	.close = stream_tcp_close,
+	.close = stream_rsa_aes_close,
 	.destroy = stream_rsa_aes_destroy,
 	.read = stream_rsa_aes_read,
 	.send = stream_rsa_aes_send,
@@ -196,6 +417,7 @@ int stream_upgrade_to_rsa_eas(struct stream* base,
 	struct stream_rsa_aes* self = (struct stream_rsa_aes*)base;
 
 	self->read_index = 0;
+	TAILQ_INIT(&self->jobs);
 	self->read_buffer = malloc(RSA_AES_BUFFER_SIZE);
 	if (!self->read_buffer)
 		return -1;
@@ -20,12 +20,25 @@
 #include <string.h>
 #include <assert.h>
 #include <errno.h>
+#include <stddef.h>
 #include <sys/uio.h>
 #include <limits.h>
+#ifdef __STDC_NO_THREADS__
+#define thread_local _Thread_local
+#else
+#include <threads.h>
+#endif
 #include <aml.h>
 #include <fcntl.h>
 #include <poll.h>
 #include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <netinet/in.h>
+
+#ifdef __linux__
+#include <linux/tcp.h>
+#include <linux/sockios.h>
+#endif
 
 #include "rcbuf.h"
 #include "stream/stream.h"
@@ -53,7 +66,7 @@ int stream_tcp_close(struct stream* self)
 		stream_req__finish(req, STREAM_REQ_FAILED);
 	}
 
-	aml_stop(aml_get_default(), self->handler);
+	aml_stop(self->loop, self->handler);
 	close(self->fd);
 	self->fd = -1;
 
@@ -71,38 +84,138 @@ void stream_tcp_destroy(struct stream* self)
 	free(self);
 }
 
-static int stream_tcp__flush(struct stream* self)
+#ifdef __linux__
+static bool stream_tcp__get_tcp_info(struct stream* self,
+		struct stream_link_info* info)
+{
+	struct tcp_info tcpi = {};
+	socklen_t len = sizeof(tcpi);
+
+	if (getsockopt(self->fd, IPPROTO_TCP, TCP_INFO, &tcpi, &len) < 0)
+		return false;
+
+	info->rtt = tcpi.tcpi_rtt;
+	info->cwnd = tcpi.tcpi_snd_cwnd * tcpi.tcpi_snd_mss;
+	info->unacked = tcpi.tcpi_unacked * tcpi.tcpi_snd_mss;
+
+	// Older kernels return a shorter struct without these
+	if (len >= offsetof(struct tcp_info, tcpi_min_rtt) +
+			sizeof(tcpi.tcpi_min_rtt)) {
+		info->notsent = tcpi.tcpi_notsent_bytes;
+		info->min_rtt = tcpi.tcpi_min_rtt;
+	}
+
+	if (len >= offsetof(struct tcp_info, tcpi_delivery_rate) +
+			sizeof(tcpi.tcpi_delivery_rate)) {
+		info->delivery_rate = tcpi.tcpi_delivery_rate;
+		info->is_app_limited = tcpi.tcpi_delivery_rate_app_limited;
+	}
+
+	return true;
+}
+
+static bool stream_tcp__get_unix_info(struct stream* self,
+		struct stream_link_info* info)
+{
+	int outq = 0;
+	if (ioctl(self->fd, SIOCOUTQ, &outq) < 0)
+		return false;
+
+	info->notsent = outq;
+	return true;
+}
+
+static void stream_tcp__update_link_info(struct stream* self)
+{
+	if (!self->has_link_info)
+		return;
+
+	struct stream_link_info info = {
+		.seq = self->link_info.seq + 1,
+	};
+
+	if (!stream_tcp__get_tcp_info(self, &info) &&
+			!stream_tcp__get_unix_info(self, &info)) {
+		// Not supported by this socket; don't keep trying.
+		self->has_link_info = false;
+		return;
+	}
+
+	self->link_info = info;
+}
+#else
+static void stream_tcp__update_link_info(struct stream* self)
+{
+	self->has_link_info = false;
+}
+#endif
+
+static size_t stream_tcp__req_size(const struct stream_req* req)
+{
+	return req->prefix_len + req->payload_len;
+}
+
+// Fills in the iovecs for the part of the request that hasn't been sent yet
+static int stream_tcp__req_iov(struct stream_req* req, struct iovec* iov)
+{
+	int n = 0;
+	size_t offset = req->offset;
+
+	if (offset < req->prefix_len) {
+		iov[n].iov_base = req->prefix + offset;
+		iov[n].iov_len = req->prefix_len - offset;
+		n++;
+		offset = 0;
+	} else {
+		offset -= req->prefix_len;
+	}
+
+	if (offset < req->payload_len) {
+		uint8_t* payload = req->payload->payload;
+		iov[n].iov_base = payload + req->payload_start + offset;
+		iov[n].iov_len = req->payload_len - offset;
+		n++;
+	}
+
+	return n;
+}
+
+int stream_tcp_flush(struct stream* self)
 {
 	if (self->cork)
 		return 0;
 
-	static struct iovec iov[IOV_MAX];
-	size_t n_msgs = 0;
+	// Too large for the stack, and servers may flush on several threads
+	static thread_local struct iovec iov[IOV_MAX];
+	size_t n_iov = 0;
+	size_t n_reqs = 0;
 	ssize_t bytes_sent;
 
 	struct stream_req* req;
 	TAILQ_FOREACH(req, &self->send_queue, link) {
+		if (n_iov + 2 > IOV_MAX)
+			break;
+
 		if (req->exec) {
 			if (req->payload)
 				rcbuf_unref(req->payload);
 			struct rcbuf* payload  = req->exec(self, req->userdata);
 			assert(payload);
 			req->payload = payload;
+			req->payload_start = 0;
+			req->payload_len = payload->size;
 		}
 
-		iov[n_msgs].iov_base = req->payload->payload;
-		iov[n_msgs].iov_len = req->payload->size;
-
-		if (++n_msgs >= IOV_MAX)
-			break;
+		n_iov += stream_tcp__req_iov(req, &iov[n_iov]);
+		n_reqs++;
 	}
 
-	if (n_msgs == 0)
+	if (n_reqs == 0)
 		return 0;
 
 	struct msghdr msghdr = {
 		.msg_iov = iov,
-		.msg_iovlen = n_msgs,
+		.msg_iovlen = n_iov,
 	};
 	bytes_sent = sendmsg(self->fd, &msghdr, MSG_NOSIGNAL);
 	if (bytes_sent < 0) {
@@ -120,7 +233,9 @@ static int stream_tcp__flush(struct stream* self)
 
 	self->bytes_sent += bytes_sent;
 
-	ssize_t bytes_left = bytes_sent;
+	stream_tcp__update_link_info(self);
+
+	size_t bytes_left = bytes_sent;
 
 	// Don't flush while flushing
 	self->cork = true;
@@ -129,34 +244,35 @@ static int stream_tcp__flush(struct stream* self)
 
 	struct stream_req* tmp;
 	TAILQ_FOREACH_SAFE(req, &self->send_queue, link, tmp) {
-		bytes_left -= req->payload->size;
+		if (n_reqs-- == 0)
+			break;
 
-		if (bytes_left >= 0) {
-			TAILQ_REMOVE(&self->send_queue, req, link);
-			stream_req__finish(req, STREAM_REQ_DONE);
-		} else {
+		size_t remaining = stream_tcp__req_size(req) - req->offset;
+
+		if (remaining > bytes_left) {
+			// The payload is now fixed, so it must not be executed again
 			if (req->exec) {
 				free(req->userdata);
 				req->userdata = NULL;
 				req->exec = NULL;
 			}
-			char* p = req->payload->payload;
-			size_t s = req->payload->size;
-			memmove(p, p + s + bytes_left, -bytes_left);
-			req->payload->size = -bytes_left;
-			stream__poll_rw(self);
+			req->offset += bytes_left;
+			break;
 		}
 
-		if (bytes_left <= 0)
-			break;
+		bytes_left -= remaining;
+		TAILQ_REMOVE(&self->send_queue, req, link);
+		stream_req__finish(req, STREAM_REQ_DONE);
 	}
 
 	self->cork = false;
 
-	if (bytes_left == 0 && self->state != STREAM_STATE_CLOSED)
-		stream__poll_r(self);
-
-	assert(bytes_left <= 0);
+	if (self->state != STREAM_STATE_CLOSED) {
+		if (TAILQ_EMPTY(&self->send_queue))
+			stream__poll_idle(self);
+		else
+			stream__poll_rw(self);
+	}
 
 	// unref
 	stream_destroy(self);
@@ -183,7 +299,8 @@ static void stream_tcp__on_writable(struct stream* self)
 	switch (self->state) {
 	case STREAM_STATE_NORMAL:
 		/* fallthrough */
-		stream_tcp__flush(self);
+		stream_tcp_flush(self);
+		stream__on_drained(self);
 		break;
 	case STREAM_STATE_CLOSED:
 		break;
@@ -242,12 +359,13 @@ int stream_tcp_send(struct stream* self, struct rcbuf* payload,
 		goto failure;
 
 	req->payload = payload;
+	req->payload_len = payload->size;
 	req->on_done = on_done;
 	req->userdata = userdata;
 
 	TAILQ_INSERT_TAIL(&self->send_queue, req, link);
 
-	return stream_tcp__flush(self);
+	return stream_tcp_flush(self);
 
 failure:
 	rcbuf_unref(payload);
@@ -264,9 +382,10 @@ int stream_tcp_send_first(struct stream* self, struct rcbuf* payload)
 		goto failure;
 
 	req->payload = payload;
+	req->payload_len = payload->size;
 	TAILQ_INSERT_HEAD(&self->send_queue, req, link);
 
-	return stream_tcp__flush(self);
+	return stream_tcp_flush(self);
 
 failure:
 	rcbuf_unref(payload);
@@ -288,7 +407,7 @@ void stream_tcp_exec_and_send(struct stream* self,
 
 	TAILQ_INSERT_TAIL(&self->send_queue, req, link);
 
-	stream_tcp__flush(self);
+	stream_tcp_flush(self);
 }
 
 static struct stream_impl impl = {
@@ -300,23 +419,26 @@ static struct stream_impl impl = {
 	.exec_and_send = stream_tcp_exec_and_send,
 };
 
-int stream_tcp_init(struct stream* self, int fd, stream_event_fn on_event,
-		void* userdata)
+int stream_tcp_init(struct stream* self, struct aml* loop, int fd,
+		stream_event_fn on_event, void* userdata)
 {
 	self->impl = &impl,
+	self->loop = loop;
 	self->fd = fd;
 	self->on_event = on_event;
 	self->userdata = userdata;
 
 	TAILQ_INIT(&self->send_queue);
 
+	self->has_link_info = true;
+
 	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
 
 	self->handler = aml_handler_new(fd, stream_tcp__on_event, self, NULL);
 	if (!self->handler)
 		return -1;
 
-	if (aml_start(aml_get_default(), self->handler) < 0)
+	if (aml_start(self->loop, self->handler) < 0)
 		goto start_failure;
 
 	stream__poll_r(self);
@@ -328,7 +450,8 @@ start_failure:
 	return -1;
 }
 
-struct stream* stream_new(int fd, stream_event_fn on_event, void* userdata)
+struct stream* stream_new(struct aml* loop, int fd,
+		stream_event_fn on_event, void* userdata)
 {
 	struct stream* self = calloc(1, STREAM_ALLOC_SIZE);
 	if (!self)
@@ -336,7 +459,7 @@ struct stream* stream_new(int fd, stream_event_fn on_event, void* userdata)
 
 	stream_init(self);
 
-	if (stream_tcp_init(self, fd, on_event, userdata) < 0) {
+	if (stream_tcp_init(self, loop, fd, on_event, userdata) < 0) {
 		free(self);
 		return NULL;
 	}
@@ -94,21 +94,67 @@ bool ws_parse_frame_header(struct ws_frame_header* header,
 	}
 
 	header->header_length = i;
+	header->payload_offset = 0;
 
 	return true;
 }
 
+/* The masking key repeats every 4 bytes, so it can be widened to any multiple
+ * of 4 bytes, as long as it is rotated to the phase at the start of the data.
+ */
+typedef uint8_t ws_mask_vec __attribute__((vector_size(16)));
+
+static void ws_mask_copy64(uint8_t* dst, const uint8_t* src, size_t len,
+		const uint8_t* wide_key)
+{
+	uint64_t key;
+	memcpy(&key, wide_key, sizeof(key));
+
+	size_t i = 0;
+	for (; i + sizeof(key) <= len; i += sizeof(key)) {
+		uint64_t word;
+		memcpy(&word, src + i, sizeof(word));
+		word ^= key;
+		memcpy(dst + i, &word, sizeof(word));
+	}
+
+	for (; i < len; ++i)
+		dst[i] = src[i] ^ wide_key[i % 4];
+}
+
+/* dst may be equal to src, but they must not overlap otherwise. Unaligned
+ * heads and tails are handled by the unaligned loads and stores, which are
+ * cheap on all relevant architectures.
+ */
+static void ws_mask_copy(uint8_t* dst, const uint8_t* src, size_t len,
+		const uint8_t* key, uint64_t phase)
+{
+	uint8_t wide_key[sizeof(ws_mask_vec)];
+	for (size_t i = 0; i < sizeof(wide_key); ++i)
+		wide_key[i] = key[(phase + i) % 4];
+
+	ws_mask_vec vkey;
+	memcpy(&vkey, wide_key, sizeof(vkey));
+
+	size_t i = 0;
+	for (; i + sizeof(vkey) <= len; i += sizeof(vkey)) {
+		ws_mask_vec v;
+		memcpy(&v, src + i, sizeof(v));
+		v ^= vkey;
+		memcpy(dst + i, &v, sizeof(v));
+	}
+
+	// The vector width is a multiple of 4, so the phase is unchanged
+	ws_mask_copy64(dst + i, src + i, len - i, wide_key);
+}
+
 void ws_apply_mask(const struct ws_frame_header* header,
 		uint8_t* restrict payload)
 {
 	assert(header->mask);
 
-	uint64_t len = header->payload_length;
-	const uint8_t* restrict key = header->masking_key;
-
-	for (uint64_t i = 0; i < len; ++i) {
-		payload[i] ^= key[i % 4];
-	}
+	ws_mask_copy(payload, payload, header->payload_length,
+			header->masking_key, header->payload_offset);
 }
 
 void ws_copy_payload(const struct ws_frame_header* header,
@@ -119,10 +165,8 @@ void ws_copy_payload(const struct ws_frame_header* header,
 		return;
 	}
 
-	const uint8_t* restrict key = header->masking_key;
-	for (uint64_t i = 0; i < len; ++i) {
-		dst[i] = src[i] ^ key[i % 4];
-	}
+	ws_mask_copy(dst, src, len, header->masking_key,
+			header->payload_offset);
 }
 
 int ws_write_frame_header(uint8_t* dst, const struct ws_frame_header* header)
@@ -18,7 +18,6 @@
 #include "stream/common.h"
 #include "stream/tcp.h"
 #include "stream/websocket.h"
-#include "vec.h"
 #include "neatvnc.h"
 
 #include <assert.h>
@@ -32,9 +31,19 @@ enum stream_ws_state {
 	STREAM_WS_STATE_READY,
 };
 
+/* Large payloads are split into several binary messages of at most this size.
+ * RFB over WebSocket is a byte stream, so clients don't care where messages
+ * end, and they can start processing the data before all of it has arrived.
+ */
+#define WS_MAX_MESSAGE_SIZE (64 * 1024)
+
+static_assert(WS_HEADER_MIN_SIZE <= STREAM_REQ_PREFIX_SIZE,
+		"A WebSocket frame header must fit into a stream_req prefix");
+
 struct stream_ws_exec_ctx {
 	stream_exec_fn exec;
 	void* userdata;
+	struct stream_req* req;
 };
 
 struct stream_ws {
@@ -66,6 +75,7 @@ static void stream_ws_advance_read_buffer(struct stream_ws* ws, size_t size,
 	memmove(ws->read_buffer, ws->read_buffer + offset + payload_len,
 			ws->read_index);
 	ws->header.payload_length -= payload_len;
+	ws->header.payload_offset += payload_len;
 }
 
 static ssize_t stream_ws_copy_payload(struct stream_ws* ws, void* dst,
@@ -232,23 +242,56 @@ static ssize_t stream_ws_read(struct stream* self, void* dst, size_t size)
 	return -1;
 }
 
-static int stream_ws_send(struct stream* self, struct rcbuf* payload,
-		stream_req_fn on_done, void* userdata)
+static void stream_ws_set_frame_header(struct stream_req* req, size_t len)
 {
-	struct stream_ws* ws = (struct stream_ws*)self;
-
 	struct ws_frame_header head = {
 		.fin = true,
 		.opcode = WS_OPCODE_BIN,
-		.payload_length = payload->size,
+		.payload_length = len,
 	};
+	req->prefix_len = ws_write_frame_header(req->prefix, &head);
+}
+
+static int stream_ws_send(struct stream* self, struct rcbuf* payload,
+		stream_req_fn on_done, void* userdata)
+{
+	struct stream_ws* ws = (struct stream_ws*)self;
+
+	if (ws->base.state == STREAM_STATE_CLOSED)
+		goto failure;
+
+	size_t offset = 0;
+	do {
+		struct stream_req* req = calloc(1, sizeof(*req));
+		if (!req) {
+			// Don't leave a partial message behind in the stream
+			stream_close(&ws->base);
+			goto failure;
+		}
 
-	uint8_t raw_head[WS_HEADER_MIN_SIZE];
-	int head_len = ws_write_frame_header(raw_head, &head);
+		size_t len = MIN(payload->size - offset, WS_MAX_MESSAGE_SIZE);
 
-	stream_tcp_send(&ws->base, rcbuf_from_mem(&raw_head, head_len),
-			NULL, NULL);
-	return stream_tcp_send(&ws->base, payload, on_done, userdata);
+		rcbuf_ref(payload);
+		req->payload = payload;
+		req->payload_start = offset;
+		req->payload_len = len;
+		stream_ws_set_frame_header(req, len);
+
+		offset += len;
+		if (offset == payload->size) {
+			req->on_done = on_done;
+			req->userdata = userdata;
+		}
+
+		TAILQ_INSERT_TAIL(&ws->base.send_queue, req, link);
+	} while (offset < payload->size);
+
+	rcbuf_unref(payload);
+	return stream_tcp_flush(&ws->base);
+
+failure:
+	rcbuf_unref(payload);
+	return -1;
 }
 
 static struct rcbuf* stream_ws_chained_exec(struct stream* tcp_stream,
@@ -263,20 +306,9 @@ static struct rcbuf* stream_ws_chained_exec(struct stream* tcp_stream,
 	// when the stream is destroyed.
 	free(ctx->userdata);
 
-	struct vec out;
-	vec_init(&out, WS_HEADER_MIN_SIZE + buf->size + 1);
-
-	struct ws_frame_header head = {
-		.fin = true,
-		.opcode = WS_OPCODE_BIN,
-		.payload_length = buf->size,
-	};
-	int head_len = ws_write_frame_header(out.data, &head);
-	out.len += head_len;
-
-	vec_append(&out, buf->payload, buf->size);
-	rcbuf_unref(buf);
-	return rcbuf_new(out.data, out.len);
+	// These are small messages, so they are never split up
+	stream_ws_set_frame_header(ctx->req, buf->size);
+	return buf;
 }
 
 static void stream_ws_exec_and_send(struct stream* self, stream_exec_fn exec,
@@ -284,13 +316,25 @@ static void stream_ws_exec_and_send(struct stream* self, stream_exec_fn exec,
 {
 	struct stream_ws* ws = (struct stream_ws*)self;
 
+	if (ws->base.state == STREAM_STATE_CLOSED)
+		return;
+
 	struct stream_ws_exec_ctx* ctx = calloc(1, sizeof(*ctx));
 	assert(ctx);
 
+	struct stream_req* req = calloc(1, sizeof(*req));
+	assert(req);
+
 	ctx->exec = exec;
 	ctx->userdata = userdata;
+	ctx->req = req;
+
+	req->exec = stream_ws_chained_exec;
+	req->userdata = ctx;
+
+	TAILQ_INSERT_TAIL(&ws->base.send_queue, req, link);
 
-	stream_tcp_exec_and_send(&ws->base, stream_ws_chained_exec, ctx);
+	stream_tcp_flush(&ws->base);
 }
 
 static struct stream_impl impl = {
@@ -301,7 +345,8 @@ static struct stream_impl impl = {
 	.exec_and_send = stream_ws_exec_and_send,
 };
 
-struct stream* stream_ws_new(int fd, stream_event_fn on_event, void* userdata)
+struct stream* stream_ws_new(struct aml* loop, int fd,
+		stream_event_fn on_event, void* userdata)
 {
 	struct stream_ws *self = calloc(1, sizeof(*self));
 	if (!self)
@@ -309,7 +354,7 @@ struct stream* stream_ws_new(int fd, stream_event_fn on_event, void* userdata)
 
 	stream_init(&self->base);
 
-	stream_tcp_init(&self->base, fd, on_event, userdata);
+	stream_tcp_init(&self->base, loop, fd, on_event, userdata);
 	self->base.impl =  &impl;
 
 	// Don't send anything until handshake is done:
@@ -0,0 +1,119 @@
+/*
+ * Copyright (c) 2026 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "transform-copy.h"
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/param.h>
+
+// Transposing is done in blocks that fit comfortably in L1 cache
+#define BLOCK_SIZE 16
+
+/* For a pixel (x, y) in the transformed image, the source pixel is at
+ * origin + x * step_x + y * step_y.
+ */
+struct transform_steps {
+	ptrdiff_t origin;
+	ptrdiff_t step_x;
+	ptrdiff_t step_y;
+};
+
+static struct transform_steps get_transform_steps(
+		enum nvnc_transform transform, int32_t stride,
+		uint32_t width, uint32_t height)
+{
+	ptrdiff_t w = width, h = height, s = stride;
+
+	switch (transform) {
+	case NVNC_TRANSFORM_NORMAL:
+		return (struct transform_steps){ 0, 1, s };
+	case NVNC_TRANSFORM_90:
+		return (struct transform_steps){ (h - 1) * s, -s, 1 };
+	case NVNC_TRANSFORM_180:
+		return (struct transform_steps){ (h - 1) * s + w - 1, -1, -s };
+	case NVNC_TRANSFORM_270:
+		return (struct transform_steps){ w - 1, s, -1 };
+	case NVNC_TRANSFORM_FLIPPED:
+		return (struct transform_steps){ w - 1, -1, s };
+	case NVNC_TRANSFORM_FLIPPED_90:
+		return (struct transform_steps){ 0, s, 1 };
+	case NVNC_TRANSFORM_FLIPPED_180:
+		return (struct transform_steps){ (h - 1) * s, 1, -s };
+	case NVNC_TRANSFORM_FLIPPED_270:
+		return (struct transform_steps){ (h - 1) * s + w - 1, -s, -1 };
+	}
+
+	abort();
+}
+
+static void copy_rows(uint32_t* restrict dst, int32_t dst_stride,
+		const uint32_t* restrict src, struct transform_steps steps,
+		const pixman_box16_t* box)
+{
+	size_t width = box->x2 - box->x1;
+
+	for (int y = box->y1; y < box->y2; ++y) {
+		uint32_t* d = dst + y * dst_stride + box->x1;
+		const uint32_t* s = src + steps.origin + y * steps.step_y +
+			box->x1 * steps.step_x;
+
+		if (steps.step_x == 1) {
+			memcpy(d, s, width * sizeof(*d));
+			continue;
+		}
+
+		for (size_t x = 0; x < width; ++x)
+			d[x] = *(s - x);
+	}
+}
+
+static void copy_transposed(uint32_t* restrict dst, int32_t dst_stride,
+		const uint32_t* restrict src, struct transform_steps steps,
+		const pixman_box16_t* box)
+{
+	for (int by = box->y1; by < box->y2; by += BLOCK_SIZE) {
+		int y_end = MIN(by + BLOCK_SIZE, box->y2);
+
+		for (int bx = box->x1; bx < box->x2; bx += BLOCK_SIZE) {
+			int x_end = MIN(bx + BLOCK_SIZE, box->x2);
+
+			for (int y = by; y < y_end; ++y) {
+				uint32_t* d = dst + y * dst_stride;
+				const uint32_t* s = src + steps.origin +
+					y * steps.step_y;
+
+				for (int x = bx; x < x_end; ++x)
+					d[x] = s[x * steps.step_x];
+			}
+		}
+	}
+}
+
+void nvnc_transform_copy32(uint32_t* dst, int32_t dst_stride,
+		const uint32_t* src, int32_t src_stride,
+		uint32_t src_width, uint32_t src_height,
+		enum nvnc_transform transform, const pixman_box16_t* box)
+{
+	struct transform_steps steps = get_transform_steps(transform,
+			src_stride, src_width, src_height);
+
+	if (steps.step_x == 1 || steps.step_x == -1)
+		copy_rows(dst, dst_stride, src, steps, box);
+	else
+		copy_transposed(dst, dst_stride, src, steps, box);
+}
@@ -0,0 +1,182 @@
+#include "downscale.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pixman.h>
+
+#define XSTR(s) STR(s)
+#define STR(s) #s
+
+#define ARRAY_LEN(a) (sizeof(a) / sizeof((a)[0]))
+
+#define STRIDE_PADDING 3
+
+// Per channel, to allow for rounding in both implementations
+#define TOLERANCE 2
+
+// Fine enough for the filter phases to line up with every supported ratio
+#define SUBSAMPLE_BITS 8
+
+#define RUN_TEST(name) ({ \
+	bool ok = test_ ## name(); \
+	printf("[%s] %s\n", ok ? " OK " : "FAIL", XSTR(name)); \
+	ok; \
+})
+
+struct test_case {
+	struct downscale_ratio ratio;
+	int src_width, src_height;
+};
+
+// At least one side of each frame has an odd size
+static const struct test_case test_cases[] = {
+	{ { 2, 1 }, 38, 26 },
+	{ { 3, 2 }, 39, 27 },
+	{ { 4, 3 }, 44, 28 },
+	{ { 4, 1 }, 76, 52 },
+	{ { 8, 1 }, 152, 104 },
+};
+
+static void fill_random(uint32_t* buffer, size_t len)
+{
+	for (size_t i = 0; i < len; ++i)
+		buffer[i] = ((uint32_t)rand() << 16) ^ rand();
+}
+
+/* Area averaging is a box reconstruction filter sampled by a box the size of
+ * a destination pixel.
+ */
+static void reference_downscale(uint32_t* dst, int dst_width, int dst_height,
+		int32_t dst_stride, uint32_t* src, int src_width,
+		int src_height, int32_t src_stride,
+		struct downscale_ratio ratio)
+{
+	pixman_image_t* srcimg = pixman_image_create_bits_no_clear(
+			PIXMAN_a8r8g8b8, src_width, src_height, src,
+			src_stride * 4);
+	pixman_image_t* dstimg = pixman_image_create_bits_no_clear(
+			PIXMAN_a8r8g8b8, dst_width, dst_height, dst,
+			dst_stride * 4);
+
+	pixman_fixed_t scale = pixman_double_to_fixed(
+			(double)ratio.p / ratio.q);
+
+	pixman_transform_t pxform;
+	pixman_transform_init_scale(&pxform, scale, scale);
+	pixman_image_set_transform(srcimg, &pxform);
+
+	int n_params = 0;
+	pixman_fixed_t* params = pixman_filter_create_separable_convolution(
+			&n_params, scale, scale,
+			PIXMAN_KERNEL_BOX, PIXMAN_KERNEL_BOX,
+			PIXMAN_KERNEL_BOX, PIXMAN_KERNEL_BOX,
+			SUBSAMPLE_BITS, SUBSAMPLE_BITS);
+	pixman_image_set_filter(srcimg, PIXMAN_FILTER_SEPARABLE_CONVOLUTION,
+			params, n_params);
+	free(params);
+
+	pixman_image_composite(PIXMAN_OP_SRC, srcimg, NULL, dstimg,
+			0, 0, 0, 0, 0, 0, dst_width, dst_height);
+
+	pixman_image_unref(dstimg);
+	pixman_image_unref(srcimg);
+}
+
+static bool is_pixel_close(uint32_t a, uint32_t b)
+{
+	for (int c = 0; c < 4; ++c) {
+		int ca = (a >> (c * 8)) & 0xff;
+		int cb = (b >> (c * 8)) & 0xff;
+		if (abs(ca - cb) > TOLERANCE)
+			return false;
+	}
+	return true;
+}
+
+static bool check_downscale(const struct test_case* tc,
+		const pixman_box16_t* box)
+{
+	int src_width = tc->src_width;
+	int src_height = tc->src_height;
+	int dst_width = src_width * tc->ratio.q / tc->ratio.p;
+	int dst_height = src_height * tc->ratio.q / tc->ratio.p;
+	int32_t src_stride = src_width + STRIDE_PADDING;
+	int32_t dst_stride = dst_width + STRIDE_PADDING;
+
+	uint32_t* src = malloc(src_stride * src_height * sizeof(*src));
+	uint32_t* dst = calloc(dst_stride * dst_height, sizeof(*dst));
+	uint32_t* ref = calloc(dst_stride * dst_height, sizeof(*ref));
+	fill_random(src, src_stride * src_height);
+
+	pixman_box16_t full = { 0, 0, dst_width, dst_height };
+	if (!box)
+		box = &full;
+
+	downscale32(dst, dst_stride, src, src_stride, tc->ratio, tc->ratio,
+			box);
+	reference_downscale(ref, dst_width, dst_height, dst_stride, src,
+			src_width, src_height, src_stride, tc->ratio);
+
+	bool ok = true;
+	for (int y = box->y1; y < box->y2 && ok; ++y)
+		for (int x = box->x1; x < box->x2 && ok; ++x)
+			if (!is_pixel_close(dst[x + y * dst_stride],
+						ref[x + y * dst_stride])) {
+				printf("%d:%d at (%d, %d): %08x != %08x\n",
+						tc->ratio.p, tc->ratio.q, x, y,
+						dst[x + y * dst_stride],
+						ref[x + y * dst_stride]);
+				ok = false;
+			}
+
+	free(ref);
+	free(dst);
+	free(src);
+	return ok;
+}
+
+static bool test_find_ratio(void)
+{
+	struct downscale_ratio ratio;
+	return downscale_find_ratio(&ratio, 39, 26) &&
+		ratio.p == 3 && ratio.q == 2 &&
+		downscale_find_ratio(&ratio, 44, 33) &&
+		ratio.p == 4 && ratio.q == 3 &&
+		downscale_find_ratio(&ratio, 152, 19) &&
+		ratio.p == 8 && ratio.q == 1 &&
+		!downscale_find_ratio(&ratio, 50, 10) &&
+		!downscale_find_ratio(&ratio, 39, 27);
+}
+
+static bool test_whole_frame(void)
+{
+	bool ok = true;
+	for (size_t i = 0; i < ARRAY_LEN(test_cases); ++i)
+		ok &= check_downscale(&test_cases[i], NULL);
+	return ok;
+}
+
+static bool test_partial_box(void)
+{
+	// Does not start on a tap group boundary for the fractional ratios
+	pixman_box16_t box = { 5, 7, 18, 12 };
+
+	bool ok = true;
+	for (size_t i = 0; i < ARRAY_LEN(test_cases); ++i)
+		ok &= check_downscale(&test_cases[i], &box);
+	return ok;
+}
+
+int main()
+{
+	bool ok = true;
+
+	ok &= RUN_TEST(find_ratio);
+	ok &= RUN_TEST(whole_frame);
+	ok &= RUN_TEST(partial_box);
+
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,165 @@
+#include "encoding-policy.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define XSTR(s) STR(s)
+#define STR(s) #s
+
+#define ARRAY_LEN(a) (sizeof(a) / sizeof((a)[0]))
+
+#define SWITCH_HOLD 16
+
+#define RUN_TEST(name) ({ \
+	bool ok = test_ ## name(); \
+	printf("[%s] %s\n", ok ? " OK " : "FAIL", XSTR(name)); \
+	ok; \
+})
+
+static enum rfb_encodings choose_n(struct encoding_policy* policy,
+		const enum rfb_encodings* candidates, size_t n_candidates,
+		const struct encoding_policy_input* input, int n)
+{
+	enum rfb_encodings encoding = candidates[0];
+	for (int i = 0; i < n; ++i)
+		encoding = encoding_policy_choose(policy, candidates,
+				n_candidates, input);
+	return encoding;
+}
+
+static bool test_no_bandwidth_estimate(void)
+{
+	struct encoding_policy* policy = encoding_policy_create();
+	enum rfb_encodings candidates[] = {
+		RFB_ENCODING_RAW, RFB_ENCODING_TIGHT,
+	};
+	struct encoding_policy_input input = {
+		.n_pixels = 1000000,
+		.n_damaged_pixels = 1000000,
+		.bytes_per_pixel = 4,
+	};
+	enum rfb_encodings encoding = choose_n(policy, candidates,
+			ARRAY_LEN(candidates), &input, 2 * SWITCH_HOLD);
+	encoding_policy_destroy(policy);
+	return encoding == RFB_ENCODING_RAW;
+}
+
+static bool test_switch_after_hold(void)
+{
+	struct encoding_policy* policy = encoding_policy_create();
+	enum rfb_encodings candidates[] = {
+		RFB_ENCODING_RAW, RFB_ENCODING_TIGHT,
+	};
+	struct encoding_policy_input input = {
+		.bandwidth = 1000000,
+		.n_pixels = 1000000,
+		.n_damaged_pixels = 1000000,
+		.bytes_per_pixel = 4,
+	};
+	bool ok = choose_n(policy, candidates, ARRAY_LEN(candidates), &input,
+			SWITCH_HOLD - 1) == RFB_ENCODING_RAW;
+	ok = ok && encoding_policy_choose(policy, candidates,
+			ARRAY_LEN(candidates), &input) == RFB_ENCODING_TIGHT;
+	encoding_policy_destroy(policy);
+	return ok;
+}
+
+static bool test_h264_encodes_whole_frame(void)
+{
+	struct encoding_policy* policy = encoding_policy_create();
+	enum rfb_encodings candidates[] = {
+		RFB_ENCODING_OPEN_H264, RFB_ENCODING_TIGHT,
+	};
+	struct encoding_policy_input input = {
+		.bandwidth = 1000000,
+		.n_pixels = 1000000,
+		.n_damaged_pixels = 10000,
+		.bytes_per_pixel = 4,
+	};
+
+	// A small update is cheaper to send with a damage based encoding
+	enum rfb_encodings encoding = choose_n(policy, candidates,
+			ARRAY_LEN(candidates), &input, SWITCH_HOLD);
+	encoding_policy_destroy(policy);
+	return encoding == RFB_ENCODING_TIGHT;
+}
+
+static bool test_h264_for_full_damage(void)
+{
+	struct encoding_policy* policy = encoding_policy_create();
+	enum rfb_encodings candidates[] = {
+		RFB_ENCODING_TIGHT, RFB_ENCODING_OPEN_H264,
+	};
+	struct encoding_policy_input input = {
+		.bandwidth = 1000000,
+		.n_pixels = 1000000,
+		.n_damaged_pixels = 1000000,
+		.bytes_per_pixel = 4,
+	};
+	enum rfb_encodings encoding = choose_n(policy, candidates,
+			ARRAY_LEN(candidates), &input, SWITCH_HOLD);
+	encoding_policy_destroy(policy);
+	return encoding == RFB_ENCODING_OPEN_H264;
+}
+
+static bool test_measurements_override_priors(void)
+{
+	struct encoding_policy* policy = encoding_policy_create();
+	enum rfb_encodings candidates[] = {
+		RFB_ENCODING_TIGHT, RFB_ENCODING_RAW,
+	};
+	struct encoding_policy_input input = {
+		.bandwidth = 1000000,
+		.n_pixels = 1000000,
+		.n_damaged_pixels = 1000000,
+		.bytes_per_pixel = 4,
+	};
+
+	// Tight turns out to compress nothing and to be slow about it
+	encoding_policy_feed(policy, RFB_ENCODING_TIGHT, 4000000, 1000000,
+			2000000);
+
+	enum rfb_encodings encoding = choose_n(policy, candidates,
+			ARRAY_LEN(candidates), &input, SWITCH_HOLD);
+	encoding_policy_destroy(policy);
+	return encoding == RFB_ENCODING_RAW;
+}
+
+static bool test_margin_prevents_switching(void)
+{
+	struct encoding_policy* policy = encoding_policy_create();
+	enum rfb_encodings candidates[] = {
+		RFB_ENCODING_TIGHT, RFB_ENCODING_ZRLE,
+	};
+	struct encoding_policy_input input = {
+		.bandwidth = 1000000,
+		.n_pixels = 1000000,
+		.n_damaged_pixels = 1000000,
+		.bytes_per_pixel = 4,
+	};
+
+	// ZRLE is measured to be slightly faster, but not enough to switch
+	encoding_policy_feed(policy, RFB_ENCODING_TIGHT, 1000000, 1000000,
+			0);
+	encoding_policy_feed(policy, RFB_ENCODING_ZRLE, 900000, 1000000, 0);
+
+	enum rfb_encodings encoding = choose_n(policy, candidates,
+			ARRAY_LEN(candidates), &input, 2 * SWITCH_HOLD);
+	encoding_policy_destroy(policy);
+	return encoding == RFB_ENCODING_TIGHT;
+}
+
+int main()
+{
+	bool ok = true;
+
+	ok &= RUN_TEST(no_bandwidth_estimate);
+	ok &= RUN_TEST(switch_after_hold);
+	ok &= RUN_TEST(h264_encodes_whole_frame);
+	ok &= RUN_TEST(h264_for_full_damage);
+	ok &= RUN_TEST(measurements_override_priors);
+	ok &= RUN_TEST(margin_prevents_switching);
+
+	return ok ? 0 : 1;
+}
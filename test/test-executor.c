@@ -0,0 +1,204 @@
+/*
+ * Copyright (c) 2026 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include "executor.h"
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <aml.h>
+
+#define XSTR(s) STR(s)
+#define STR(s) #s
+
+#define RUN_TEST(name) ({ \
+	bool ok = test_ ## name(); \
+	printf("[%s] %s\n", ok ? " OK " : "FAIL", XSTR(name)); \
+	ok; \
+})
+
+#define N_JOBS 100
+
+struct counters {
+	atomic_int n_worked;
+	int n_done;
+};
+
+static void count_work(void* userdata)
+{
+	struct counters* counters = userdata;
+	atomic_fetch_add(&counters->n_worked, 1);
+}
+
+static void count_done(void* userdata)
+{
+	struct counters* counters = userdata;
+	counters->n_done++;
+}
+
+static bool submit_jobs(struct executor* executor, struct counters* counters)
+{
+	for (int i = 0; i < N_JOBS; ++i)
+		if (executor_submit(executor, i % EXECUTOR_STAGE_COUNT,
+					count_work, count_done, counters) < 0)
+			return false;
+	return true;
+}
+
+static bool test_shared_between_loops(void)
+{
+	struct aml* loop_a = aml_new();
+	struct aml* loop_b = aml_new();
+	struct executor* a = executor_new(loop_a);
+	struct executor* b = executor_new(loop_b);
+
+	struct counters counters_a = {};
+	struct counters counters_b = {};
+
+	bool ok = submit_jobs(a, &counters_a) && submit_jobs(b, &counters_b);
+
+	// Completions are only delivered to the executor that the job was for
+	executor_destroy(a);
+	ok = ok && counters_a.n_done == N_JOBS && counters_b.n_done == 0;
+
+	executor_destroy(b);
+	ok = ok && counters_b.n_done == N_JOBS;
+	ok = ok && counters_a.n_worked == N_JOBS;
+	ok = ok && counters_b.n_worked == N_JOBS;
+
+	aml_unref(loop_b);
+	aml_unref(loop_a);
+	return ok;
+}
+
+static bool test_configure_after_start(void)
+{
+	struct aml* loop = aml_new();
+	struct executor* executor = executor_new(loop);
+
+	struct counters counters = {};
+	bool ok = executor_set_worker_count(executor, 4) == 0;
+	ok = ok && submit_jobs(executor, &counters);
+	ok = ok && executor_set_worker_count(executor, 8) == -1;
+
+	executor_destroy(executor);
+	ok = ok && counters.n_done == N_JOBS;
+
+	aml_unref(loop);
+	return ok;
+}
+
+struct blocking_encode {
+	struct executor* executor;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	bool is_compressed;
+};
+
+static void compress(void* userdata)
+{
+	struct blocking_encode* encode = userdata;
+	pthread_mutex_lock(&encode->mutex);
+	encode->is_compressed = true;
+	pthread_cond_signal(&encode->cond);
+	pthread_mutex_unlock(&encode->mutex);
+}
+
+static void encode_and_wait(void* userdata)
+{
+	struct blocking_encode* encode = userdata;
+	executor_submit(encode->executor, EXECUTOR_STAGE_COMPRESS, compress,
+			NULL, encode);
+
+	pthread_mutex_lock(&encode->mutex);
+	while (!encode->is_compressed)
+		pthread_cond_wait(&encode->cond, &encode->mutex);
+	pthread_mutex_unlock(&encode->mutex);
+}
+
+/* Encoding jobs may wait for compression jobs, which must still make progress
+ * when every worker that may take encoding jobs is busy with one.
+ */
+static bool test_encode_waits_for_compress(void)
+{
+	struct aml* loop = aml_new();
+	struct executor* executor = executor_new(loop);
+	executor_set_worker_count(executor, EXECUTOR_STAGE_COUNT);
+
+	struct blocking_encode encodes[EXECUTOR_STAGE_COUNT];
+	for (int i = 0; i < EXECUTOR_STAGE_COUNT; ++i) {
+		encodes[i] = (struct blocking_encode){ .executor = executor };
+		pthread_mutex_init(&encodes[i].mutex, NULL);
+		pthread_cond_init(&encodes[i].cond, NULL);
+		executor_submit(executor, EXECUTOR_STAGE_ENCODE,
+				encode_and_wait, NULL, &encodes[i]);
+	}
+
+	executor_destroy(executor);
+
+	bool ok = true;
+	for (int i = 0; i < EXECUTOR_STAGE_COUNT; ++i) {
+		ok = ok && encodes[i].is_compressed;
+		pthread_cond_destroy(&encodes[i].cond);
+		pthread_mutex_destroy(&encodes[i].mutex);
+	}
+
+	aml_unref(loop);
+	return ok;
+}
+
+struct chain {
+	struct executor* executor;
+	int n_left;
+};
+
+static void submit_next(void* userdata)
+{
+	struct chain* chain = userdata;
+	if (--chain->n_left > 0)
+		executor_submit(chain->executor, EXECUTOR_STAGE_COMPOSITE, NULL,
+				submit_next, chain);
+}
+
+static bool test_destroy_runs_chained_jobs(void)
+{
+	struct aml* loop = aml_new();
+	struct executor* executor = executor_new(loop);
+
+	struct chain chain = { .executor = executor, .n_left = 10 };
+	executor_submit(executor, EXECUTOR_STAGE_COMPOSITE, NULL, submit_next,
+			&chain);
+
+	executor_destroy(executor);
+	bool ok = chain.n_left == 0;
+
+	aml_unref(loop);
+	return ok;
+}
+
+int main(int argc, char* argv[])
+{
+	bool ok = true;
+
+	ok &= RUN_TEST(shared_between_loops);
+	ok &= RUN_TEST(configure_after_start);
+	ok &= RUN_TEST(encode_waits_for_compress);
+	ok &= RUN_TEST(destroy_runs_chained_jobs);
+
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,118 @@
+#include "rate-control.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define XSTR(s) STR(s)
+#define STR(s) #s
+
+#define N_PIXELS 1000000
+
+#define RUN_TEST(name) ({ \
+	bool ok = test_ ## name(); \
+	printf("[%s] %s\n", ok ? " OK " : "FAIL", XSTR(name)); \
+	ok; \
+})
+
+// Quality level q costs (q + 1) / 10 bytes per pixel
+static struct rate_control* create_measured(void)
+{
+	struct rate_control* rc = rate_control_create();
+	for (int q = 0; q < RATE_CONTROL_QUALITY_LEVELS; ++q)
+		rate_control_feed(rc, q, (q + 1) * N_PIXELS / 10, N_PIXELS);
+	return rc;
+}
+
+static struct rate_control_input make_input(int bandwidth)
+{
+	return (struct rate_control_input){
+		.bandwidth = bandwidth,
+		.min_rtt = INT32_MAX,
+		.n_pixels = N_PIXELS,
+		.min_quality = 0,
+		.max_quality = RATE_CONTROL_QUALITY_LEVELS - 1,
+	};
+}
+
+static bool test_no_bandwidth_estimate(void)
+{
+	struct rate_control* rc = rate_control_create();
+	struct rate_control_input input = make_input(0);
+	int q = rate_control_get_quality(rc, &input);
+	rate_control_destroy(rc);
+	return q == RATE_CONTROL_QUALITY_LEVELS - 1;
+}
+
+static bool test_clamp(void)
+{
+	struct rate_control* rc = create_measured();
+	struct rate_control_input input = make_input(0);
+	input.max_quality = 5;
+	bool ok = rate_control_get_quality(rc, &input) == 5;
+
+	input = make_input(1000);
+	input.min_quality = 3;
+	ok = ok && rate_control_get_quality(rc, &input) == 3;
+
+	rate_control_destroy(rc);
+	return ok;
+}
+
+static bool test_back_off_immediately(void)
+{
+	struct rate_control* rc = create_measured();
+
+	// Budget of a little more than 1 MB per frame: everything fits
+	struct rate_control_input input = make_input(31000000);
+	bool ok = rate_control_get_quality(rc, &input) == 9;
+
+	// Budget of a little more than 0.5 MB per frame
+	input = make_input(16000000);
+	ok = ok && rate_control_get_quality(rc, &input) == 4;
+
+	rate_control_destroy(rc);
+	return ok;
+}
+
+static bool test_in_flight_bytes_reduce_budget(void)
+{
+	struct rate_control* rc = create_measured();
+	struct rate_control_input input = make_input(31000000);
+	input.inflight_bytes = 500000;
+	bool ok = rate_control_get_quality(rc, &input) == 4;
+	rate_control_destroy(rc);
+	return ok;
+}
+
+static bool test_recover_slowly(void)
+{
+	struct rate_control* rc = create_measured();
+
+	struct rate_control_input input = make_input(16000000);
+	bool ok = rate_control_get_quality(rc, &input) == 4;
+
+	input = make_input(31000000);
+	for (int i = 0; i < 7; ++i)
+		ok = ok && rate_control_get_quality(rc, &input) == 4;
+
+	// One level at a time
+	ok = ok && rate_control_get_quality(rc, &input) == 5;
+	ok = ok && rate_control_get_quality(rc, &input) == 5;
+
+	rate_control_destroy(rc);
+	return ok;
+}
+
+int main()
+{
+	bool ok = true;
+
+	ok &= RUN_TEST(no_bandwidth_estimate);
+	ok &= RUN_TEST(clamp);
+	ok &= RUN_TEST(back_off_immediately);
+	ok &= RUN_TEST(in_flight_bytes_reduce_budget);
+	ok &= RUN_TEST(recover_slowly);
+
+	return ok ? 0 : 1;
+}
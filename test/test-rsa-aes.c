@@ -0,0 +1,163 @@
+/*
+ * Copyright (c) 2026 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include "stream/stream.h"
+#include "rcbuf.h"
+#include "crypto.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <aml.h>
+
+#define XSTR(s) STR(s)
+#define STR(s) #s
+
+#define RUN_TEST(name) ({ \
+	bool ok = test_ ## name(); \
+	printf("[%s] %s\n", ok ? " OK " : "FAIL", XSTR(name)); \
+	ok; \
+})
+
+static struct aml* loop;
+
+// Large enough to be encrypted on a worker thread
+#define LARGE_PAYLOAD_SIZE (1024 * 1024)
+
+struct send_result {
+	int n_calls;
+	enum stream_req_status status;
+};
+
+static void on_send_done(void* userdata, enum stream_req_status status)
+{
+	struct send_result* result = userdata;
+	result->n_calls++;
+	result->status = status;
+}
+
+static void on_stream_event(struct stream* stream, enum stream_event event)
+{
+}
+
+static struct rcbuf* make_payload(size_t size)
+{
+	uint8_t* data = calloc(1, size);
+	return data ? rcbuf_new(data, size) : NULL;
+}
+
+static struct stream* make_stream(int fds[2])
+{
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+		return NULL;
+
+	struct stream* stream = stream_new(loop, fds[0], on_stream_event,
+			NULL);
+	if (!stream)
+		return NULL;
+
+	static const uint8_t enc_key[16] = { 1 };
+	static const uint8_t dec_key[16] = { 2 };
+	if (stream_upgrade_to_rsa_eas(stream, CRYPTO_CIPHER_AES_EAX,
+				enc_key, dec_key) < 0) {
+		stream_close(stream);
+		stream_destroy(stream);
+		return NULL;
+	}
+
+	return stream;
+}
+
+// Runs the loop until only the caller's reference to the stream remains
+static bool wait_for_jobs(struct stream* stream)
+{
+	for (int i = 0; i < 100 && stream->ref > 1; ++i) {
+		aml_poll(loop, 100);
+		aml_dispatch(loop);
+	}
+	return stream->ref == 1;
+}
+
+static bool test_close_while_encrypting(void)
+{
+	int fds[2];
+	struct stream* stream = make_stream(fds);
+	if (!stream)
+		return false;
+
+	struct send_result large = {};
+	struct send_result small = {};
+
+	stream_send(stream, make_payload(LARGE_PAYLOAD_SIZE), on_send_done,
+			&large);
+	// Queued behind the large payload, so it can't skip the queue
+	stream_send(stream, make_payload(16), on_send_done, &small);
+
+	// Keep the stream around after close so that it can be inspected
+	stream_ref(stream);
+	stream_close(stream);
+	stream_destroy(stream);
+
+	bool ok = large.n_calls == 1 && large.status == STREAM_REQ_FAILED;
+	ok = ok && small.n_calls == 1 && small.status == STREAM_REQ_FAILED;
+
+	ok = ok && wait_for_jobs(stream);
+	ok = ok && large.n_calls == 1 && small.n_calls == 1;
+
+	stream_destroy(stream);
+	close(fds[1]);
+	return ok;
+}
+
+static bool test_send_after_close(void)
+{
+	int fds[2];
+	struct stream* stream = make_stream(fds);
+	if (!stream)
+		return false;
+
+	stream_close(stream);
+
+	struct send_result result = {};
+	bool ok = stream_send(stream, make_payload(LARGE_PAYLOAD_SIZE),
+			on_send_done, &result) < 0;
+	ok = ok && result.n_calls == 0;
+
+	stream_destroy(stream);
+	close(fds[1]);
+	return ok;
+}
+
+int main(int argc, char* argv[])
+{
+	bool ok = true;
+
+	loop = aml_new();
+	if (!loop)
+		return 1;
+	aml_require_workers(loop, 1);
+
+	ok &= RUN_TEST(close_while_encrypting);
+	ok &= RUN_TEST(send_after_close);
+
+	aml_unref(loop);
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,127 @@
+#include "enc/tile-cache.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#define XSTR(s) STR(s)
+#define STR(s) #s
+
+#define RUN_TEST(name) ({ \
+	bool ok = test_ ## name(); \
+	printf("[%s] %s\n", ok ? " OK " : "FAIL", XSTR(name)); \
+	ok; \
+})
+
+static bool test_lookup_miss(void)
+{
+	struct tile_cache* cache = tile_cache_create(1024);
+	char buffer[16];
+	bool ok = tile_cache_lookup(cache, 1, buffer, sizeof(buffer)) == -1;
+	tile_cache_unref(cache);
+	return ok;
+}
+
+static bool test_insert_and_lookup(void)
+{
+	struct tile_cache* cache = tile_cache_create(1024);
+	tile_cache_insert(cache, 1, "hello", 5);
+	tile_cache_insert(cache, 4097, "world", 5);
+
+	char buffer[16] = {};
+	bool ok = tile_cache_lookup(cache, 1, buffer, sizeof(buffer)) == 5 &&
+		memcmp(buffer, "hello", 5) == 0;
+	ok = ok && tile_cache_lookup(cache, 4097, buffer, sizeof(buffer)) == 5 &&
+		memcmp(buffer, "world", 5) == 0;
+
+	tile_cache_unref(cache);
+	return ok;
+}
+
+static bool test_replace(void)
+{
+	struct tile_cache* cache = tile_cache_create(1024);
+	tile_cache_insert(cache, 1, "hello", 5);
+	tile_cache_insert(cache, 1, "bye", 3);
+
+	char buffer[16] = {};
+	bool ok = tile_cache_lookup(cache, 1, buffer, sizeof(buffer)) == 3 &&
+		memcmp(buffer, "bye", 3) == 0;
+
+	tile_cache_unref(cache);
+	return ok;
+}
+
+static bool test_does_not_fit_in_dst(void)
+{
+	struct tile_cache* cache = tile_cache_create(1024);
+	tile_cache_insert(cache, 1, "hello", 5);
+
+	char buffer[4];
+	bool ok = tile_cache_lookup(cache, 1, buffer, sizeof(buffer)) == -1;
+
+	tile_cache_unref(cache);
+	return ok;
+}
+
+static bool test_too_big_for_cache(void)
+{
+	struct tile_cache* cache = tile_cache_create(4);
+	tile_cache_insert(cache, 1, "hello", 5);
+
+	char buffer[16];
+	bool ok = tile_cache_lookup(cache, 1, buffer, sizeof(buffer)) == -1;
+
+	tile_cache_unref(cache);
+	return ok;
+}
+
+static bool test_evict_least_recently_used(void)
+{
+	struct tile_cache* cache = tile_cache_create(10);
+	tile_cache_insert(cache, 1, "aaaa", 4);
+	tile_cache_insert(cache, 2, "bbbb", 4);
+
+	// Makes 2 the least recently used
+	char buffer[16];
+	bool ok = tile_cache_lookup(cache, 1, buffer, sizeof(buffer)) == 4;
+
+	tile_cache_insert(cache, 3, "cccc", 4);
+
+	ok = ok && tile_cache_lookup(cache, 1, buffer, sizeof(buffer)) == 4;
+	ok = ok && tile_cache_lookup(cache, 2, buffer, sizeof(buffer)) == -1;
+	ok = ok && tile_cache_lookup(cache, 3, buffer, sizeof(buffer)) == 4;
+
+	tile_cache_unref(cache);
+	return ok;
+}
+
+static bool test_shared_reference(void)
+{
+	struct tile_cache* cache = tile_cache_create(1024);
+	tile_cache_ref(cache);
+	tile_cache_insert(cache, 1, "hello", 5);
+	tile_cache_unref(cache);
+
+	char buffer[16];
+	bool ok = tile_cache_lookup(cache, 1, buffer, sizeof(buffer)) == 5;
+
+	tile_cache_unref(cache);
+	return ok;
+}
+
+int main()
+{
+	bool ok = true;
+
+	ok &= RUN_TEST(lookup_miss);
+	ok &= RUN_TEST(insert_and_lookup);
+	ok &= RUN_TEST(replace);
+	ok &= RUN_TEST(does_not_fit_in_dst);
+	ok &= RUN_TEST(too_big_for_cache);
+	ok &= RUN_TEST(evict_least_recently_used);
+	ok &= RUN_TEST(shared_reference);
+
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,135 @@
+#include "transform-copy.h"
+#include "transform-util.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pixman.h>
+
+#define XSTR(s) STR(s)
+#define STR(s) #s
+
+#define ARRAY_LEN(a) (sizeof(a) / sizeof((a)[0]))
+
+// Odd sizes and a padded stride catch off-by-one errors in the kernels
+#define WIDTH 37
+#define HEIGHT 23
+#define STRIDE 41
+
+#define RUN_TEST(name) ({ \
+	bool ok = test_ ## name(); \
+	printf("[%s] %s\n", ok ? " OK " : "FAIL", XSTR(name)); \
+	ok; \
+})
+
+static const enum nvnc_transform transforms[] = {
+	NVNC_TRANSFORM_NORMAL,
+	NVNC_TRANSFORM_90,
+	NVNC_TRANSFORM_180,
+	NVNC_TRANSFORM_270,
+	NVNC_TRANSFORM_FLIPPED,
+	NVNC_TRANSFORM_FLIPPED_90,
+	NVNC_TRANSFORM_FLIPPED_180,
+	NVNC_TRANSFORM_FLIPPED_270,
+};
+
+static void fill_random(uint32_t* buffer, size_t len)
+{
+	for (size_t i = 0; i < len; ++i)
+		buffer[i] = ((uint32_t)rand() << 16) ^ rand();
+}
+
+static void reference_transform(uint32_t* dst, int32_t dst_stride,
+		uint32_t* src, enum nvnc_transform transform)
+{
+	uint32_t width = WIDTH, height = HEIGHT;
+	nvnc_transform_dimensions(transform, &width, &height);
+
+	pixman_image_t* srcimg = pixman_image_create_bits_no_clear(
+			PIXMAN_a8r8g8b8, WIDTH, HEIGHT, src, STRIDE * 4);
+	pixman_image_t* dstimg = pixman_image_create_bits_no_clear(
+			PIXMAN_a8r8g8b8, width, height, dst, dst_stride * 4);
+
+	pixman_transform_t pxform;
+	nvnc_transform_to_pixman_transform(&pxform, transform, WIDTH, HEIGHT);
+	pixman_image_set_transform(srcimg, &pxform);
+
+	pixman_image_composite(PIXMAN_OP_SRC, srcimg, NULL, dstimg,
+			0, 0, 0, 0, 0, 0, width, height);
+
+	pixman_image_unref(dstimg);
+	pixman_image_unref(srcimg);
+}
+
+static bool is_box_equal(const uint32_t* a, const uint32_t* b, int32_t stride,
+		const pixman_box16_t* box)
+{
+	for (int y = box->y1; y < box->y2; ++y)
+		if (memcmp(a + y * stride + box->x1, b + y * stride + box->x1,
+					(box->x2 - box->x1) * sizeof(*a)) != 0)
+			return false;
+	return true;
+}
+
+static bool check_transform(enum nvnc_transform transform,
+		const pixman_box16_t* box)
+{
+	static uint32_t src[STRIDE * HEIGHT];
+	static uint32_t dst[STRIDE * STRIDE];
+	static uint32_t ref[STRIDE * STRIDE];
+
+	fill_random(src, ARRAY_LEN(src));
+	memset(dst, 0, sizeof(dst));
+
+	uint32_t width = WIDTH, height = HEIGHT;
+	nvnc_transform_dimensions(transform, &width, &height);
+
+	pixman_box16_t full = { 0, 0, width, height };
+	if (!box)
+		box = &full;
+
+	nvnc_transform_copy32(dst, STRIDE, src, STRIDE, WIDTH, HEIGHT,
+			transform, box);
+	reference_transform(ref, STRIDE, src, transform);
+
+	return is_box_equal(dst, ref, STRIDE, box);
+}
+
+static bool test_whole_frame(void)
+{
+	bool ok = true;
+	for (size_t i = 0; i < ARRAY_LEN(transforms); ++i)
+		if (!check_transform(transforms[i], NULL)) {
+			printf("Transform %d differs from pixman\n",
+					transforms[i]);
+			ok = false;
+		}
+	return ok;
+}
+
+static bool test_partial_box(void)
+{
+	// Fits inside the transformed frame for all transforms
+	pixman_box16_t box = { 3, 5, 20, 22 };
+
+	bool ok = true;
+	for (size_t i = 0; i < ARRAY_LEN(transforms); ++i)
+		if (!check_transform(transforms[i], &box)) {
+			printf("Transform %d differs from pixman\n",
+					transforms[i]);
+			ok = false;
+		}
+	return ok;
+}
+
+int main()
+{
+	bool ok = true;
+
+	ok &= RUN_TEST(whole_frame);
+	ok &= RUN_TEST(partial_box);
+
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,160 @@
+/*
+ * Copyright (c) 2026 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include "stream/websocket.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#define XSTR(s) STR(s)
+#define STR(s) #s
+
+#define RUN_TEST(name) ({ \
+	bool ok = test_ ## name(); \
+	printf("[%s] %s\n", ok ? " OK " : "FAIL", XSTR(name)); \
+	ok; \
+})
+
+// Long enough to cover the vector loop, the 64 bit loop and the tail
+#define MAX_PAYLOAD_SIZE 100
+
+static const uint8_t masking_key[4] = { 0x12, 0x34, 0x56, 0x78 };
+
+static void fill_pattern(uint8_t* data, size_t len)
+{
+	for (size_t i = 0; i < len; ++i)
+		data[i] = i * 37 + 11;
+}
+
+static void unmask_bytewise(uint8_t* dst, const uint8_t* src, size_t len,
+		uint64_t offset)
+{
+	for (size_t i = 0; i < len; ++i)
+		dst[i] = src[i] ^ masking_key[(offset + i) % 4];
+}
+
+static bool test_copy_payload(void)
+{
+	// One extra byte so that both buffers can be used unaligned
+	uint8_t src[MAX_PAYLOAD_SIZE + 1];
+	uint8_t expected[MAX_PAYLOAD_SIZE];
+	uint8_t result[MAX_PAYLOAD_SIZE + 1];
+	fill_pattern(src, sizeof(src));
+
+	struct ws_frame_header header = { .mask = true };
+	memcpy(header.masking_key, masking_key, sizeof(masking_key));
+
+	for (int unaligned = 0; unaligned < 2; ++unaligned)
+	for (uint64_t offset = 0; offset < 8; ++offset)
+	for (size_t len = 0; len <= MAX_PAYLOAD_SIZE; ++len) {
+		header.payload_offset = offset;
+		unmask_bytewise(expected, src + unaligned, len, offset);
+		ws_copy_payload(&header, result + unaligned, src + unaligned,
+				len);
+		if (memcmp(expected, result + unaligned, len) != 0)
+			return false;
+	}
+
+	return true;
+}
+
+static bool test_apply_mask(void)
+{
+	uint8_t src[MAX_PAYLOAD_SIZE];
+	uint8_t expected[MAX_PAYLOAD_SIZE];
+	uint8_t payload[MAX_PAYLOAD_SIZE];
+	fill_pattern(src, sizeof(src));
+
+	struct ws_frame_header header = { .mask = true };
+	memcpy(header.masking_key, masking_key, sizeof(masking_key));
+
+	for (uint64_t offset = 0; offset < 4; ++offset)
+	for (size_t len = 0; len <= MAX_PAYLOAD_SIZE; ++len) {
+		header.payload_offset = offset;
+		header.payload_length = len;
+		memcpy(payload, src, len);
+		unmask_bytewise(expected, src, len, offset);
+		ws_apply_mask(&header, payload);
+		if (memcmp(expected, payload, len) != 0)
+			return false;
+	}
+
+	return true;
+}
+
+static bool test_unmasked_payload(void)
+{
+	uint8_t src[MAX_PAYLOAD_SIZE];
+	uint8_t result[MAX_PAYLOAD_SIZE] = {};
+	fill_pattern(src, sizeof(src));
+
+	struct ws_frame_header header = { .payload_offset = 3 };
+	ws_copy_payload(&header, result, src, sizeof(src));
+	return memcmp(src, result, sizeof(src)) == 0;
+}
+
+/* A payload that arrives over several reads must unmask to the same data as
+ * one that arrives all at once. Each read continues from the phase that the
+ * previous one left off at.
+ */
+static bool test_split_reads(void)
+{
+	uint8_t src[MAX_PAYLOAD_SIZE];
+	uint8_t expected[MAX_PAYLOAD_SIZE];
+	uint8_t result[MAX_PAYLOAD_SIZE];
+	fill_pattern(src, sizeof(src));
+	unmask_bytewise(expected, src, sizeof(src), 0);
+
+	struct ws_frame_header header = { .mask = true };
+	memcpy(header.masking_key, masking_key, sizeof(masking_key));
+
+	for (size_t chunk_size = 1; chunk_size <= 33; ++chunk_size) {
+		memset(result, 0, sizeof(result));
+		header.payload_offset = 0;
+
+		while (header.payload_offset < sizeof(src)) {
+			size_t offset = header.payload_offset;
+			size_t len = sizeof(src) - offset;
+			if (len > chunk_size)
+				len = chunk_size;
+
+			ws_copy_payload(&header, result + offset, src + offset,
+					len);
+			header.payload_offset += len;
+		}
+
+		if (memcmp(expected, result, sizeof(result)) != 0)
+			return false;
+	}
+
+	return true;
+}
+
+int main(int argc, char* argv[])
+{
+	bool ok = true;
+
+	ok &= RUN_TEST(copy_payload);
+	ok &= RUN_TEST(apply_mask);
+	ok &= RUN_TEST(unmasked_payload);
+	ok &= RUN_TEST(split_reads);
+
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,367 @@
+#include "enc/zrle.h"
+#include "enc/util.h"
+#include "rfb-proto.h"
+#include "pixels.h"
+#include "vec.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libdrm/drm_fourcc.h>
+
+#define XSTR(s) STR(s)
+#define STR(s) #s
+
+#define TILE_LENGTH 64
+#define N_RANDOM_TILES 2000
+
+#define RUN_TEST(name) ({ \
+	bool ok = test_ ## name(); \
+	printf("[%s] %s\n", ok ? " OK " : "FAIL", XSTR(name)); \
+	ok; \
+})
+
+static struct rfb_pixel_format fmt;
+static int bytes_per_cpixel;
+
+struct reader {
+	const uint8_t* data;
+	size_t len;
+	size_t pos;
+};
+
+static bool read_bytes(struct reader* reader, void* dst, size_t len)
+{
+	if (reader->len - reader->pos < len)
+		return false;
+	memcpy(dst, reader->data + reader->pos, len);
+	reader->pos += len;
+	return true;
+}
+
+static bool read_run_length(struct reader* reader, size_t* run_length)
+{
+	uint8_t byte;
+	*run_length = 1;
+	do {
+		if (!read_bytes(reader, &byte, 1))
+			return false;
+		*run_length += byte;
+	} while (byte == 255);
+	return true;
+}
+
+/* A straightforward decoder that follows the RFB specification. Decoded
+ * pixels are in the compressed pixel format.
+ */
+static bool decode_tile(uint8_t* dst, const uint8_t* src, size_t len,
+		int width, int height)
+{
+	struct reader reader = { .data = src, .len = len };
+	size_t length = width * height;
+	int bpc = bytes_per_cpixel;
+	uint8_t palette[128 * 4];
+
+	uint8_t type;
+	if (!read_bytes(&reader, &type, 1))
+		return false;
+
+	if (type == 0) {
+		if (!read_bytes(&reader, dst, length * bpc))
+			return false;
+	} else if (type == 1) {
+		if (!read_bytes(&reader, palette, bpc))
+			return false;
+		for (size_t i = 0; i < length; ++i)
+			memcpy(dst + i * bpc, palette, bpc);
+	} else if (type <= 16) {
+		int bits = type <= 2 ? 1 : type <= 4 ? 2 : 4;
+		if (!read_bytes(&reader, palette, type * bpc))
+			return false;
+
+		for (int y = 0; y < height; ++y) {
+			uint8_t byte = 0;
+			int shift = 0;
+			for (int x = 0; x < width; ++x) {
+				if (shift == 0) {
+					if (!read_bytes(&reader, &byte, 1))
+						return false;
+					shift = 8;
+				}
+				shift -= bits;
+				int index = (byte >> shift) & ((1 << bits) - 1);
+				if (index >= type)
+					return false;
+				memcpy(dst + (y * width + x) * bpc,
+						palette + index * bpc, bpc);
+			}
+		}
+	} else if (type == 128) {
+		size_t pos = 0;
+		while (pos < length) {
+			uint8_t cpixel[4];
+			size_t run_length;
+			if (!read_bytes(&reader, cpixel, bpc) ||
+					!read_run_length(&reader, &run_length) ||
+					pos + run_length > length)
+				return false;
+			for (size_t i = 0; i < run_length; ++i, ++pos)
+				memcpy(dst + pos * bpc, cpixel, bpc);
+		}
+	} else if (type >= 130) {
+		int palette_size = type - 128;
+		if (!read_bytes(&reader, palette, palette_size * bpc))
+			return false;
+
+		size_t pos = 0;
+		while (pos < length) {
+			uint8_t index;
+			size_t run_length = 1;
+			if (!read_bytes(&reader, &index, 1))
+				return false;
+			if ((index & 128) &&
+					!read_run_length(&reader, &run_length))
+				return false;
+			index &= 127;
+			if (index >= palette_size || pos + run_length > length)
+				return false;
+			for (size_t i = 0; i < run_length; ++i, ++pos)
+				memcpy(dst + pos * bpc, palette + index * bpc,
+						bpc);
+		}
+	} else {
+		return false;
+	}
+
+	return reader.pos == reader.len;
+}
+
+static uint32_t random_colour(void)
+{
+	return (((uint32_t)rand() << 16) ^ rand()) & 0xffffff;
+}
+
+static void fill_palette(uint32_t* palette, int n)
+{
+	for (int i = 0; i < n; ++i) {
+		palette[i] = random_colour();
+		for (int j = 0; j < i; ++j)
+			if (palette[j] == palette[i]) {
+				--i;
+				break;
+			}
+	}
+}
+
+/* Fills the tile with runs of colours from a palette of n_colours. The run
+ * lengths are picked at random up to max_run.
+ */
+static void fill_tile(uint32_t* tile, size_t length, int n_colours,
+		int max_run)
+{
+	uint32_t* palette = malloc(n_colours * sizeof(*palette));
+	fill_palette(palette, n_colours);
+
+	size_t pos = 0;
+	int colour = 0;
+	while (pos < length) {
+		size_t run_length = 1 + rand() % max_run;
+		for (size_t i = 0; i < run_length && pos < length; ++i)
+			tile[pos++] = palette[colour];
+		colour = (colour + 1 + rand() % n_colours) % n_colours;
+	}
+
+	free(palette);
+}
+
+// Cycles through n_colours distinct colours in runs of equal length
+static void fill_runs(uint32_t* tile, size_t length, int n_colours,
+		int run_length)
+{
+	for (size_t i = 0; i < length; ++i)
+		tile[i] = (i / run_length % n_colours) * 0x010305;
+}
+
+static size_t smallest_estimate(const uint32_t* tile, int width, int height)
+{
+	static const enum zrle_subencoding subencodings[] = {
+		ZRLE_RAW, ZRLE_SOLID, ZRLE_PACKED_PALETTE, ZRLE_PLAIN_RLE,
+		ZRLE_PALETTE_RLE,
+	};
+
+	size_t smallest = SIZE_MAX;
+	for (size_t i = 0; i < sizeof(subencodings) / sizeof(subencodings[0]);
+			++i) {
+		size_t size = zrle_estimate_tile_size((const uint8_t*)tile,
+				&fmt, &fmt, width, height, subencodings[i]);
+		if (size != 0 && size < smallest)
+			smallest = size;
+	}
+	return smallest;
+}
+
+/* Encodes the tile, checks that it decodes back to the input and that the
+ * output has the estimated size, which is the smallest of all estimates.
+ */
+static bool check_round_trip(const uint32_t* tile, int width, int height,
+		enum zrle_subencoding* subencoding)
+{
+	size_t length = width * height;
+	bool ok = false;
+
+	struct vec out;
+	vec_init(&out, 1 + 4 * TILE_LENGTH * TILE_LENGTH + 127 * 4);
+
+	uint8_t* expected = malloc(length * bytes_per_cpixel);
+	uint8_t* decoded = malloc(length * bytes_per_cpixel);
+
+	pixel_to_cpixel(expected, &fmt, (const uint8_t*)tile, &fmt,
+			bytes_per_cpixel, length);
+
+	*subencoding = zrle_encode_tile(&out, &fmt, (const uint8_t*)tile, &fmt,
+			width, height);
+
+	if (!decode_tile(decoded, out.data, out.len, width, height)) {
+		printf("Failed to decode %dx%d tile\n", width, height);
+		goto done;
+	}
+
+	if (memcmp(decoded, expected, length * bytes_per_cpixel) != 0) {
+		printf("Decoded %dx%d tile differs from input\n", width,
+				height);
+		goto done;
+	}
+
+	size_t estimate = zrle_estimate_tile_size((const uint8_t*)tile, &fmt,
+			&fmt, width, height, *subencoding);
+	if (estimate != out.len) {
+		printf("Estimated %zu bytes, but got %zu\n", estimate, out.len);
+		goto done;
+	}
+
+	if (estimate != smallest_estimate(tile, width, height)) {
+		printf("Subencoding %d is not the smallest\n", *subencoding);
+		goto done;
+	}
+
+	ok = true;
+done:
+	free(decoded);
+	free(expected);
+	vec_destroy(&out);
+	return ok;
+}
+
+static bool check_subencoding(const uint32_t* tile, int width, int height,
+		enum zrle_subencoding expected)
+{
+	enum zrle_subencoding subencoding;
+	if (!check_round_trip(tile, width, height, &subencoding))
+		return false;
+
+	if (subencoding != expected) {
+		printf("Expected subencoding %d, got %d\n", expected,
+				subencoding);
+		return false;
+	}
+	return true;
+}
+
+static uint32_t tile[TILE_LENGTH * TILE_LENGTH];
+
+static bool test_solid(void)
+{
+	fill_tile(tile, 13 * 7, 1, 1);
+	return check_subencoding(tile, 13, 7, ZRLE_SOLID);
+}
+
+static bool test_raw(void)
+{
+	fill_runs(tile, TILE_LENGTH * TILE_LENGTH, 1000, 1);
+	return check_subencoding(tile, TILE_LENGTH, TILE_LENGTH, ZRLE_RAW);
+}
+
+static bool test_packed_palette(void)
+{
+	bool ok = true;
+
+	// 1, 2 and 4 bits per pixel with padded rows
+	static const int palette_sizes[] = { 2, 3, 4, 5, 16 };
+	for (size_t i = 0; i < sizeof(palette_sizes) /
+			sizeof(palette_sizes[0]); ++i) {
+		fill_tile(tile, 13 * 11, palette_sizes[i], 1);
+		ok &= check_subencoding(tile, 13, 11, ZRLE_PACKED_PALETTE);
+	}
+
+	return ok;
+}
+
+static bool test_plain_rle(void)
+{
+	// Too many colours for a palette
+	fill_runs(tile, TILE_LENGTH * TILE_LENGTH, 200, 20);
+	return check_subencoding(tile, TILE_LENGTH, TILE_LENGTH,
+			ZRLE_PLAIN_RLE);
+}
+
+static bool test_palette_rle(void)
+{
+	fill_runs(tile, TILE_LENGTH * TILE_LENGTH, 60, 20);
+	return check_subencoding(tile, TILE_LENGTH, TILE_LENGTH,
+			ZRLE_PALETTE_RLE);
+}
+
+static bool test_long_runs(void)
+{
+	bool ok = true;
+
+	// Runs that need more than one length byte
+	fill_runs(tile, TILE_LENGTH * TILE_LENGTH, 3, 1000);
+	ok &= check_subencoding(tile, TILE_LENGTH, TILE_LENGTH,
+			ZRLE_PALETTE_RLE);
+
+	// A palette is out of reach with this many colours
+	fill_runs(tile, 200, 200, 1);
+	fill_runs(tile + 200, TILE_LENGTH * TILE_LENGTH - 200, 2, 1000);
+	ok &= check_subencoding(tile, TILE_LENGTH, TILE_LENGTH,
+			ZRLE_PLAIN_RLE);
+
+	return ok;
+}
+
+static bool test_random_tiles(void)
+{
+	for (int i = 0; i < N_RANDOM_TILES; ++i) {
+		int width = 1 + rand() % TILE_LENGTH;
+		int height = 1 + rand() % TILE_LENGTH;
+		int n_colours = 1 + rand() % 200;
+		int max_run = 1 + rand() % 300;
+
+		fill_tile(tile, width * height, n_colours, max_run);
+
+		enum zrle_subencoding subencoding;
+		if (!check_round_trip(tile, width, height, &subencoding))
+			return false;
+	}
+	return true;
+}
+
+int main()
+{
+	bool ok = true;
+
+	rfb_pixfmt_from_fourcc(&fmt, DRM_FORMAT_XRGB8888);
+	bytes_per_cpixel = nvnc__calc_bytes_per_cpixel(&fmt);
+
+	ok &= RUN_TEST(solid);
+	ok &= RUN_TEST(raw);
+	ok &= RUN_TEST(packed_palette);
+	ok &= RUN_TEST(plain_rle);
+	ok &= RUN_TEST(palette_rle);
+	ok &= RUN_TEST(long_runs);
+	ok &= RUN_TEST(random_tiles);
+
+	return ok ? 0 : 1;
+}